@@ -24,6 +24,8 @@
 #include <chrono>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <system_error>
 
 #ifndef NO_LINUX_HEADERS
 #include <unistd.h>
@@ -88,6 +90,12 @@ control::~control()
   reset();
 }
 
+// Sleeps until the motor reports that it is no longer running.
+static void wait_until_stopped(const motor &m)
+{
+  m.wait_while(motor_state::running);
+}
+
 void control::drive(int speed, int time)
 {
   _motor_left.set_speed_sp(-speed);
@@ -101,8 +109,8 @@ void control::drive(int speed, int time)
     _motor_left .set_time_sp(time).run_timed();
     _motor_right.set_time_sp(time).run_timed();
 
-    while (_motor_left.state().count("running") || _motor_right.state().count("running"))
-      this_thread::sleep_for(chrono::milliseconds(10));
+    wait_until_stopped(_motor_left);
+    wait_until_stopped(_motor_right);
 
     _state = state_idle;
   }
@@ -126,8 +134,8 @@ void control::turn(int direction)
   _motor_left. set_position_sp( direction).set_speed_sp(500).run_to_rel_pos();
   _motor_right.set_position_sp(-direction).set_speed_sp(500).run_to_rel_pos();
 
-  while (_motor_left.state().count("running") || _motor_right.state().count("running"))
-    this_thread::sleep_for(chrono::milliseconds(10));
+  wait_until_stopped(_motor_left);
+  wait_until_stopped(_motor_right);
 
   _state = state_idle;
 }
@@ -304,7 +312,7 @@ void control::drive_autonomously()
     {
       if (_state != state_driving)
         drive(750);
-      this_thread::sleep_for(chrono::milliseconds(10));
+      _sensor_ir.wait_value_change(distance, 0, chrono::milliseconds(100));
     }
     else
     {
@@ -334,14 +342,34 @@ void control::drive_autonomously()
   }
 }
 
-int main()
+// drive-test --record <trace> records all attribute accesses while it
+// drives; drive-test --replay <trace> runs the same control code against the
+// recording instead of the robot, e.g. on a workstation.
+int main(int argc, char *argv[])
 {
+  unique_ptr<trace_recorder> recorder;
+  unique_ptr<trace_replay>   replay;
+
+  if ((argc == 3) && (string(argv[1]) == "--record"))
+  {
+    recorder.reset(new trace_recorder(argv[2]));
+    device::set_backend(recorder.get());
+  }
+  else if ((argc == 3) && (string(argv[1]) == "--replay"))
+  {
+    replay.reset(new trace_replay(argv[2]));
+    device::set_backend(replay.get());
+  }
+
   control c;
 
   if (c.initialized())
   {
-    c.terminate_on_key(); // we terminate if a button is pressed
-    c.panic_if_touched(); // we panic if the touch sensor is triggered
+    if (!replay)
+    {
+      c.terminate_on_key(); // we terminate if a button is pressed
+      c.panic_if_touched(); // we panic if the touch sensor is triggered
+    }
 
   // change mode to 1 to get IR remote mode
     int mode = 2;
@@ -360,7 +388,31 @@ int main()
     {
       cout << "touch the sensor or press a button to stop." << endl << endl;
 
-      c.drive_autonomously();
+      try
+      {
+        c.drive_autonomously();
+      }
+      catch (const system_error &)
+      {
+        if (!replay || !replay->finished())
+          throw;
+      }
+    }
+
+    if (replay)
+    {
+      const auto recorded = replay->recorded_writes();
+      const auto written  = replay->writes();
+
+      size_t same = 0;
+      while ((same < recorded.size()) && (same < written.size()) &&
+             (recorded[same].path  == written[same].path) &&
+             (recorded[same].value == written[same].value))
+        ++same;
+
+      cout << "replayed " << chrono::duration_cast<chrono::milliseconds>(
+                replay->now().time_since_epoch()).count() << " ms, "
+           << same << " of " << recorded.size() << " writes as recorded" << endl;
     }
   }
   else
@@ -68,8 +68,8 @@ template <class Motor, class Leds>
 std::function<void(bool)> roll(Motor &motor1, Motor &motor2, int distance_rot, int speed, int dir1, int dir2, Leds &leds, int delay_ms) {
     return [&motor1, &motor2, dir1, dir2, distance_rot, speed, &leds, delay_ms](bool state) {
         if (state) {
-            motor1.set_position_sp(distance_rot * dir1).set_speed_sp(speed).run_to_rel_pos();
-            motor2.set_position_sp(distance_rot * dir2).set_speed_sp(speed).run_to_rel_pos();
+            motor1.batch().set_position_sp(distance_rot * dir1).set_speed_sp(speed).run_to_rel_pos();
+            motor2.batch().set_position_sp(distance_rot * dir2).set_speed_sp(speed).run_to_rel_pos();
             ev3::led::set_color(leds, dir1 > 0 ? ev3::led::green : ev3::led::red);
             std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
         } else {
@@ -29,20 +29,32 @@
 #include <sstream>
 #include <fstream>
 #include <list>
+#include <deque>
 #include <map>
+#include <unordered_map>
 #include <array>
 #include <algorithm>
 #include <system_error>
 #include <mutex>
+#include <condition_variable>
+#include <future>
 #include <chrono>
 #include <thread>
 #include <stdexcept>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <math.h>
 
 #include <dirent.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -55,6 +67,15 @@
 #  define FSTREAM_CACHE_SIZE 16
 #endif
 
+#ifndef BUTTON_DEVICE
+#  define BUTTON_DEVICE "/dev/input/by-path/platform-gpio_keys-event"
+#endif
+
+#if defined(EV3DEV_ATTR_IO_URING)
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#endif
+
 #ifndef NO_LINUX_HEADERS
 #  include <linux/fb.h>
 #  include <linux/input.h>
@@ -66,8 +87,66 @@ static const int bits_per_long = sizeof(long) * 8;
 namespace ev3dev {
 namespace {
 
-// This class implements a small LRU cache. It assumes the number of elements
-// is small, and so uses a simple linear search.
+// Counters of a single attribute cache. Each counter is only ever modified
+// by the thread owning the cache, so plain loads and stores suffice and no
+// atomic read-modify-write is needed on the hot path.
+struct cache_counters {
+    std::atomic<unsigned long> hits;
+    std::atomic<unsigned long> misses;
+    std::atomic<unsigned long> evictions;
+
+    cache_counters() : hits(0), misses(0), evictions(0) {}
+
+    static void bump(std::atomic<unsigned long> &c) {
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+// Keeps track of the counters of all live caches, and of the totals of the
+// caches that are gone (with the threads that owned them).
+class cache_registry {
+    public:
+        static cache_registry& instance() {
+            static cache_registry r;
+            return r;
+        }
+
+        void add(const cache_counters *c) {
+            std::lock_guard<std::mutex> lock(_mx);
+            _live.push_back(c);
+        }
+
+        void remove(const cache_counters *c) {
+            std::lock_guard<std::mutex> lock(_mx);
+            _live.erase(std::remove(_live.begin(), _live.end(), c), _live.end());
+            accumulate(_retired, *c);
+        }
+
+        device::attr_cache_stats stats() {
+            std::lock_guard<std::mutex> lock(_mx);
+            device::attr_cache_stats s = _retired;
+            for(auto c : _live) accumulate(s, *c);
+            return s;
+        }
+
+    private:
+        cache_registry() : _retired() {}
+
+        static void accumulate(device::attr_cache_stats &s, const cache_counters &c) {
+            s.hits      += c.hits     .load(std::memory_order_relaxed);
+            s.misses    += c.misses   .load(std::memory_order_relaxed);
+            s.evictions += c.evictions.load(std::memory_order_relaxed);
+        }
+
+        std::mutex _mx;
+        std::vector<const cache_counters*> _live;
+        device::attr_cache_stats _retired;
+};
+
+// This class implements a small LRU cache with constant time lookup. It is
+// not synchronized: every thread owns its own instance (see the thread_local
+// caches below), so control threads never contend for it and never share
+// the cached handles.
 template <typename K, typename V>
 class lru_cache {
     private:
@@ -82,55 +161,61 @@ class lru_cache {
         };
 
     public:
-        lru_cache(size_t size = 3) : _size(size) {}
+        lru_cache(size_t size = 3) : _size(size) {
+            _index.reserve(size + 1);
+            cache_registry::instance().add(&_counters);
+        }
+
+        ~lru_cache() {
+            cache_registry::instance().remove(&_counters);
+        }
 
         V &operator[] (const K &k) {
-            iterator i = find(k);
-            if (i != _items.end()) {
+            auto i = _index.find(k);
+            if (i != _index.end()) {
+                cache_counters::bump(_counters.hits);
                 // Found the key, bring the item to the front.
-                _items.splice(_items.begin(), _items, i);
+                _items.splice(_items.begin(), _items, i->second);
             } else {
+                cache_counters::bump(_counters.misses);
                 // If the cache is full, remove oldest items to make room.
                 while (_items.size() + 1 > _size) {
+                    cache_counters::bump(_counters.evictions);
+                    _index.erase(_items.back().first);
                     _items.pop_back();
                 }
                 // Insert a new default constructed value for this new key.
                 _items.emplace_front(k);
+                _index.emplace(k, _items.begin());
             }
             // The new item is the most recently used.
             return _items.front().second;
         }
 
         void clear() {
+            _index.clear();
             _items.clear();
         }
 
     private:
         typedef typename std::list<item>::iterator iterator;
 
-        iterator find(const K &k) {
-            return std::find_if(_items.begin(), _items.end(),
-                    [&](const item &i) { return i.first == k; });
-        }
-
         size_t _size;
         std::list<item> _items;
+        std::unordered_map<K, iterator> _index;
+        cache_counters _counters;
 };
 
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+
 // A global cache of files.
 std::ifstream& ifstream_cache(const std::string &path) {
-    static lru_cache<std::string, std::ifstream> cache(FSTREAM_CACHE_SIZE);
-    static std::mutex mx;
-
-    std::lock_guard<std::mutex> lock(mx);
+    static thread_local lru_cache<std::string, std::ifstream> cache(FSTREAM_CACHE_SIZE);
     return cache[path];
 }
 
 std::ofstream& ofstream_cache(const std::string &path) {
-    static lru_cache<std::string, std::ofstream> cache(FSTREAM_CACHE_SIZE);
-    static std::mutex mx;
-
-    std::lock_guard<std::mutex> lock(mx);
+    static thread_local lru_cache<std::string, std::ofstream> cache(FSTREAM_CACHE_SIZE);
     return cache[path];
 }
 
@@ -160,246 +245,2505 @@ std::ifstream &ifstream_open(const std::string &path) {
     return file;
 }
 
-} // namespace
+// The streams above do not go through attribute backends, so with a backend
+// set the attributes are read and written through these.
+size_t attr_read(const std::string &path, char *buf, size_t size) {
+    return device::backend()->read(path, buf, size);
+}
 
-//-----------------------------------------------------------------------------
-bool device::connect(
-        const std::string &dir,
-        const std::string &pattern,
-        const std::map<std::string, std::set<std::string>> &match
-        ) noexcept
-{
-    using namespace std;
+void attr_write(const std::string &path, const char *buf, size_t size) {
+    device::backend()->write(path, buf, size);
+}
 
-    const size_t pattern_length = pattern.length();
+#else // assume EV3DEV_ATTR_IO_PREAD or EV3DEV_ATTR_IO_URING
 
-    struct dirent *dp;
-    DIR *dfd;
+//-----------------------------------------------------------------------------
+// Owns a raw file descriptor of a sysfs attribute.
+class attr_file {
+    public:
+        attr_file() : _fd(-1) {}
+        attr_file(attr_file &&f) : _fd(f._fd) { f._fd = -1; }
+        ~attr_file() { close(); }
 
-    if ((dfd = opendir(dir.c_str())) != nullptr) {
-        while ((dp = readdir(dfd)) != nullptr) {
-            if (strncmp(dp->d_name, pattern.c_str(), pattern_length)==0) {
-                try {
-                    _path = dir + dp->d_name + '/';
-
-                    bool bMatch = true;
-                    for (auto &m : match) {
-                        const auto &attribute = m.first;
-                        const auto &matches   = m.second;
-                        const auto strValue   = get_attr_string(attribute);
-
-                        if (!matches.empty() && !matches.begin()->empty() &&
-                                (matches.find(strValue) == matches.end()))
-                        {
-                            bMatch = false;
-                            break;
-                        }
-                    }
+        attr_file(const attr_file&) = delete;
+        attr_file& operator=(const attr_file&) = delete;
 
-                    if (bMatch) {
-                        closedir(dfd);
-                        return true;
-                    }
-                } catch (...) { }
+        bool is_open() const { return _fd >= 0; }
+        int  fd()      const { return _fd; }
 
-                _path.clear();
+        bool open(const std::string &path, int flags) {
+            close();
+            _fd = ::open(path.c_str(), flags | O_CLOEXEC);
+            return is_open();
+        }
+
+        void close() {
+            if (_fd >= 0) {
+                ::close(_fd);
+                _fd = -1;
             }
         }
 
-        closedir(dfd);
-    }
+    private:
+        int _fd;
+};
 
-    return false;
+// Reads the attribute behind `fd` from the beginning. Sysfs regenerates the
+// attribute contents on every read at offset zero.
+ssize_t pread_attr(int fd, char *buf, size_t size) {
+    ssize_t n;
+    do {
+        n = pread(fd, buf, size, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Stores `size` bytes into the attribute behind `fd` with a single system
+// call, so the driver always sees the complete value.
+ssize_t pwrite_attr(int fd, const char *buf, size_t size) {
+    ssize_t n;
+    do {
+        n = pwrite(fd, buf, size, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n >= 0 && static_cast<size_t>(n) != size) {
+        // Sysfs attributes are stored as a whole or not at all.
+        errno = EIO;
+        return -1;
+    }
+    return n;
 }
 
+// A read of a batch: the attribute, where to put its contents, and the
+// number of bytes read or -errno.
+struct attr_io {
+    int     fd;
+    char   *buf;
+    size_t  size;
+    ssize_t result;
+};
+
+#if defined(EV3DEV_ATTR_IO_URING)
+
 //-----------------------------------------------------------------------------
-int device::device_index() const {
-    using namespace std;
+// An io_uring instance for reading batches of attributes. All reads of a
+// batch are submitted, and their completions reaped, with one system call.
+class attr_ring {
+    public:
+        static const unsigned depth = 64;
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+        attr_ring() {
+            io_uring_params p;
+            memset(&p, 0, sizeof(p));
 
-    if (_device_index < 0) {
-        unsigned f = 1;
-        _device_index = 0;
-        for (auto it=_path.rbegin(); it!=_path.rend(); ++it) {
-            if(*it =='/')
-                continue;		
-            if ((*it < '0') || (*it > '9'))
-                break;
+            _fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &p));
+            if (_fd < 0) return;
 
-            _device_index += (*it -'0') * f;
-            f *= 10;
+            // Kernels 5.1 to 5.5 have io_uring, but not IORING_OP_READ.
+            if (!supports(IORING_OP_READ)) {
+                release();
+                return;
+            }
+
+            _sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            _cq_len = p.cq_off.cqes  + p.cq_entries * sizeof(io_uring_cqe);
+
+            if (p.features & IORING_FEAT_SINGLE_MMAP)
+                _sq_len = _cq_len = std::max(_sq_len, _cq_len);
+
+            _sq = map(_sq_len, IORING_OFF_SQ_RING);
+            _cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? _sq : map(_cq_len, IORING_OFF_CQ_RING);
+            _sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+            _sqes = static_cast<io_uring_sqe*>(map(_sqes_len, IORING_OFF_SQES));
+
+            if (!_sq || !_cq || !_sqes) {
+                release();
+                return;
+            }
+
+            char *sq = static_cast<char*>(_sq);
+            char *cq = static_cast<char*>(_cq);
+
+            _sq_head  = reinterpret_cast<std::atomic<unsigned>*>(sq + p.sq_off.head);
+            _sq_tail  = reinterpret_cast<std::atomic<unsigned>*>(sq + p.sq_off.tail);
+            _sq_mask  = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+            _sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+            _cq_head  = reinterpret_cast<std::atomic<unsigned>*>(cq + p.cq_off.head);
+            _cq_tail  = reinterpret_cast<std::atomic<unsigned>*>(cq + p.cq_off.tail);
+            _cq_mask  = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+            _cqes     = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
         }
-    }
 
-    return _device_index;
-}
+        ~attr_ring() { release(); }
 
-//-----------------------------------------------------------------------------
-int device::get_attr_int(const std::string &name) const {
-    using namespace std;
+        attr_ring(const attr_ring&) = delete;
+        attr_ring& operator=(const attr_ring&) = delete;
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+        // The ring of the calling thread, or nullptr if the kernel does not
+        // support io_uring.
+        static attr_ring* get() {
+            static thread_local attr_ring ring;
+            return ring._fd >= 0 ? &ring : nullptr;
+        }
 
-    for(int attempt = 0; attempt < 2; ++attempt) {
-        ifstream &is = ifstream_open(_path + name);
-        if (is.is_open()) {
-            int result = 0;
-            try {
-                is >> result;
-                return result;
-            } catch(...) {
-                // This could mean the sysfs attribute was recreated and the
-                // corresponding file handle got stale. Lets close the file and try
-                // again (once):
-                if (attempt != 0) throw;
+        void read(attr_io *io, size_t count) {
+            for(size_t i = 0; i < count; i += depth)
+                submit(io + i, std::min<size_t>(count - i, depth));
+        }
+
+    private:
+        int    _fd = -1;
+        void  *_sq = nullptr, *_cq = nullptr;
+        size_t _sq_len = 0, _cq_len = 0, _sqes_len = 0;
+
+        io_uring_sqe          *_sqes = nullptr;
+        std::atomic<unsigned> *_sq_head;
+        std::atomic<unsigned> *_sq_tail;
+        unsigned               _sq_mask;
+        unsigned              *_sq_array;
+        std::atomic<unsigned> *_cq_head;
+        std::atomic<unsigned> *_cq_tail;
+        unsigned               _cq_mask;
+        io_uring_cqe          *_cqes;
+
+        void* map(size_t size, off_t offset) {
+            void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, offset);
+            return p == MAP_FAILED ? nullptr : p;
+        }
+
+        // Whether the kernel supports the opcode `op`. The probe came with
+        // the same kernel as IORING_OP_READ, so it fails on older ones.
+        bool supports(unsigned op) const {
+            static const unsigned max_ops = 256;
+            alignas(io_uring_probe) char buf[sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op)];
+            memset(buf, 0, sizeof(buf));
+
+            io_uring_probe *probe = reinterpret_cast<io_uring_probe*>(buf);
+            if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, max_ops) < 0)
+                return false;
+
+            return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        }
+
+        void release() {
+            if (_sqes) munmap(_sqes, _sqes_len);
+            if (_cq && _cq != _sq) munmap(_cq, _cq_len);
+            if (_sq) munmap(_sq, _sq_len);
+            if (_fd >= 0) ::close(_fd);
+
+            _sq = _cq = nullptr;
+            _sqes = nullptr;
+            _fd = -1;
+        }
+
+        void submit(attr_io *io, unsigned n) {
+            using namespace std;
 
-                is.close();
-                is.clear();
+            unsigned tail = _sq_tail->load(memory_order_relaxed);
+            for(unsigned i = 0; i < n; ++i, ++tail) {
+                const unsigned idx = tail & _sq_mask;
+
+                io_uring_sqe &e = _sqes[idx];
+                memset(&e, 0, sizeof(e));
+                e.opcode    = IORING_OP_READ;
+                e.fd        = io[i].fd;
+                e.addr      = reinterpret_cast<uintptr_t>(io[i].buf);
+                e.len       = static_cast<unsigned>(io[i].size);
+                e.off       = 0;
+                e.user_data = i;
+
+                _sq_array[idx] = idx;
+            }
+            _sq_tail->store(tail, memory_order_release);
+
+            // The reads in flight write into the buffers of the caller, so
+            // their completions are reaped even after an error, before it is
+            // thrown. The kernel only waits for them once all are submitted.
+            int err = 0;
+            unsigned submitted = 0, reaped = 0;
+            while (reaped < submitted || (!err && submitted < n)) {
+                const unsigned to_submit = err ? 0 : n - submitted;
+                const int rc = static_cast<int>(syscall(__NR_io_uring_enter, _fd,
+                            to_submit, submitted + to_submit - reaped, IORING_ENTER_GETEVENTS, nullptr, 0));
+
+                if (rc > 0) {
+                    submitted += rc;
+                } else if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    if (err) break; // cannot even wait for the completions
+
+                    // Take back the entries the kernel did not consume, so
+                    // that they do not go out with the next batch.
+                    err = errno;
+                    _sq_tail->store(_sq_head->load(memory_order_acquire), memory_order_release);
+                }
+
+                unsigned head = _cq_head->load(memory_order_relaxed);
+                const unsigned end = _cq_tail->load(memory_order_acquire);
+                for(; head != end; ++head, ++reaped) {
+                    const io_uring_cqe &c = _cqes[head & _cq_mask];
+                    io[c.user_data].result = c.res;
+                }
+                _cq_head->store(head, memory_order_release);
             }
-        } else break;
+
+            if (err)
+                throw system_error(error_code(err, system_category()), "io_uring_enter");
+        }
+};
+
+#endif
+
+// Reads a batch of attributes, with io_uring where the kernel has it. A
+// round trip through the ring costs more than a couple of pread() calls, so
+// small batches are read directly.
+void read_batch(attr_io *io, size_t count) {
+#if defined(EV3DEV_ATTR_IO_URING)
+    attr_ring *ring = count >= 4 ? attr_ring::get() : nullptr;
+    if (ring) {
+        ring->read(io, count);
+        return;
+    }
+#endif
+
+    for(size_t i = 0; i < count; ++i) {
+        io[i].result = pread_attr(io[i].fd, io[i].buf, io[i].size);
+        if (io[i].result < 0) io[i].result = -errno;
     }
-    throw system_error(make_error_code(errc::no_such_device), _path+name);
 }
 
-//-----------------------------------------------------------------------------
-void device::set_attr_int(const std::string &name, int value) {
+// Reads the attribute at `path` from the beginning into `buf`. Sysfs
+// regenerates the attribute contents on every read at offset zero, so a
+// single pread() is all we need, no seeking and no stream state.
+// Returns the number of bytes read.
+size_t attr_read(const std::string &path, char *buf, size_t size) {
     using namespace std;
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+    if (attr_backend *b = device::backend())
+        return b->read(path, buf, size);
 
-    for(int attempt = 0; attempt < 2; ++attempt) {
-        ofstream &os = ofstream_open(_path + name);
-        if (os.is_open()) {
-            if (os << value) return;
+    static thread_local lru_cache<string, attr_file> cache(FSTREAM_CACHE_SIZE);
 
-            // An error could mean that sysfs attribute was recreated and the cached
-            // file handle is stale. Lets close the file and try again (once):
-            if (attempt == 0 && errno == ENODEV) {
-                os.close();
-                os.clear();
-            } else {
-                throw system_error(std::error_code(errno, std::system_category()));
-            }
-        } else {
-            throw system_error(make_error_code(errc::no_such_device), _path + name);
-        }
+    for(int attempt = 0; ; ++attempt) {
+        attr_file &file = cache[path];
+        if (!file.is_open() && !file.open(path, O_RDONLY))
+            throw system_error(error_code(errno, system_category()), path);
+
+        const ssize_t n = pread_attr(file.fd(), buf, size);
+        if (n >= 0) return n;
+
+        // ENODEV means the sysfs attribute was recreated and the cached file
+        // handle got stale. Lets close the file and try again (once):
+        const int err = errno;
+        file.close();
+        if (attempt != 0 || err != ENODEV)
+            throw system_error(error_code(err, system_category()), path);
     }
 }
 
-//-----------------------------------------------------------------------------
-std::string device::get_attr_string(const std::string &name) const {
+// Writes `buf` to the attribute at `path` with a single system call.
+void attr_write(const std::string &path, const char *buf, size_t size) {
     using namespace std;
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+    if (attr_backend *b = device::backend())
+        return b->write(path, buf, size);
 
-    ifstream &is = ifstream_open(_path + name);
-    if (is.is_open()) {
-        string result;
-        is >> result;
-        return result;
+    static thread_local lru_cache<string, attr_file> cache(FSTREAM_CACHE_SIZE);
+
+    for(int attempt = 0; ; ++attempt) {
+        attr_file &file = cache[path];
+        if (!file.is_open() && !file.open(path, O_WRONLY | O_TRUNC))
+            throw system_error(error_code(errno, system_category()), path);
+
+        if (pwrite_attr(file.fd(), buf, size) >= 0) return;
+
+        // An error could mean that sysfs attribute was recreated and the cached
+        // file handle is stale. Lets close the file and try again (once):
+        const int err = errno;
+        file.close();
+        if (attempt != 0 || err != ENODEV)
+            throw system_error(error_code(err, system_category()), path);
     }
+}
+
+#endif
+
+// Returns the first whitespace delimited token.
+std::string parse_token(const char *s, const char *end) {
+    while (s != end && isspace(static_cast<unsigned char>(*s))) ++s;
 
-    throw system_error(make_error_code(errc::no_such_device), _path+name);
+    const char *e = s;
+    while (e != end && !isspace(static_cast<unsigned char>(*e))) ++e;
+
+    return std::string(s, e);
 }
 
-//-----------------------------------------------------------------------------
-void device::set_attr_string(const std::string &name, const std::string &value) {
-    using namespace std;
+// Sysfs attributes never exceed a page.
+const size_t attr_page_size = 4096;
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+// Parses a decimal integer, skipping leading whitespace.
+bool parse_int(const char *s, const char *end, int &value) {
+    while (s != end && isspace(static_cast<unsigned char>(*s))) ++s;
 
-    ofstream &os = ofstream_open(_path + name);
-    if (os.is_open()) {
-        if (!(os << value)) throw system_error(std::error_code(errno, std::system_category()));
-        return;
-    }
+    bool neg = false;
+    if (s != end && (*s == '-' || *s == '+')) neg = (*s++ == '-');
 
-    throw system_error(make_error_code(errc::no_such_device), _path+name);
+    if (s == end || *s < '0' || *s > '9') return false;
+
+    long long v = 0;
+    for(; s != end && *s >= '0' && *s <= '9'; ++s)
+        v = v * 10 + (*s - '0');
+
+    value = static_cast<int>(neg ? -v : v);
+    return true;
 }
 
-//-----------------------------------------------------------------------------
-std::string device::get_attr_line(const std::string &name) const {
-    using namespace std;
+// Formats `value` followed by a newline (the way `echo` would store it).
+// `buf` must hold at least 13 characters. Returns the formatted length.
+size_t format_int(int value, char *buf) {
+    char tmp[12];
+    char *p = tmp + sizeof(tmp);
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+    unsigned v = value < 0 ? 0u - static_cast<unsigned>(value) : value;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
 
-    ifstream &is = ifstream_open(_path + name);
-    if (is.is_open()) {
-        string result;
-        getline(is, result);
-        return result;
-    }
+    if (value < 0) *--p = '-';
 
-    throw system_error(make_error_code(errc::no_such_device), _path+name);
+    const size_t n = tmp + sizeof(tmp) - p;
+    std::copy_n(p, n, buf);
+    buf[n] = '\n';
+    return n + 1;
 }
 
-//-----------------------------------------------------------------------------
-mode_set device::get_attr_set(
-        const std::string &name, std::string *pCur) const
-{
-    using namespace std;
+// Returns everything up to the first newline.
+std::string parse_line(const char *s, const char *end) {
+    return std::string(s, std::find(s, end, '\n'));
+}
 
-    string s = get_attr_line(name);
+// Names of the attributes in device::attr_slot order.
+const char *const attr_slot_names[] = {
+    "position",
+    "position_sp",
+    "speed",
+    "speed_sp",
+    "duty_cycle",
+    "duty_cycle_sp",
+    "state",
+    "command",
+    "stop_action",
+    "mode",
+    "value0",
+    "value1",
+    "value2",
+    "value3",
+    "value4",
+    "value5",
+    "value6",
+    "value7"
+};
+
+// Bounds of the interval at which attributes are polled when their driver
+// does not notify changes. The interval doubles while the value stays the
+// same.
+const std::chrono::milliseconds attr_poll_min(1), attr_poll_max(8);
+
+// A waiter that polls starts by rereading the attribute for `attr_spin_time`,
+// yielding in between, then sleeps for `attr_wait_min`, doubling up to
+// `attr_poll_max`. Motion completion is noticed well within a millisecond.
+const std::chrono::microseconds attr_spin_time(200), attr_wait_min(100);
+
+// Drivers may notify only some of the changes of an attribute, so waits on
+// one that notifies still reread it at this interval. A wait that sees a
+// change without a notification goes back to polling.
+const std::chrono::milliseconds attr_notify_poll(50);
+
+// Number of mode changes made through sensor::set_mode(), by sensor index.
+// Sensors that share an entry only cause each other's pinned modes to be
+// restored once too often.
+std::atomic<unsigned> sensor_mode_epochs[64];
+
+// The flags of a motor state.
+const struct {
+    const char *name;
+    size_t      size;
+    unsigned    bit;
+} motor_state_flags[] = {
+    { "running",    7,  motor_state::running    },
+    { "ramping",    7,  motor_state::ramping    },
+    { "holding",    7,  motor_state::holding    },
+    { "overloaded", 10, motor_state::overloaded },
+    { "stalled",    7,  motor_state::stalled    }
+};
+
+// Names of the attributes in device::const_attr order.
+const char *const const_attr_names[] = {
+    "address",
+    "driver_name",
+    "commands",
+    "stop_actions",
+    "modes",
+    "count_per_rot",
+    "count_per_m",
+    "full_travel_count",
+    "max_speed",
+    "max_brightness"
+};
 
+// Splits a space separated list of values. The value in square brackets
+// (if any) is the currently selected one.
+mode_set parse_set(const std::string &s, std::string *pCur) {
     mode_set result;
-    size_t pos, last_pos = 0;
-    string t;
-    do {
-        pos = s.find(' ', last_pos);
+    const token_set tokens(s.data(), s.data() + s.size());
 
-        if (pos != string::npos) {
-            t = s.substr(last_pos, pos-last_pos);
-            last_pos = pos+1;
-        } else {
-            t = s.substr(last_pos);
+    result.insert(tokens.begin(), tokens.end());
+    if (pCur && tokens.selected()) *pCur = tokens.selected();
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+// The thread that carries out the asynchronous attribute operations, in the
+// order they were queued. Started on first use.
+class io_thread {
+    public:
+        static io_thread& instance() {
+            static io_thread t;
+            return t;
         }
 
-        if (!t.empty()) {
-            if (*t.begin()=='[') {
-                t = t.substr(1, t.length()-2);
-                if (pCur)
-                    *pCur = t;
+        ~io_thread() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
             }
-            result.insert(t);
+            _cv.notify_one();
+            _thread.join();
         }
-    } while (pos!=string::npos);
 
-    return result;
+        void post(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _tasks.push_back(std::move(task));
+            }
+            _cv.notify_one();
+        }
+
+        // The device the thread works on for devices at `path`, not yet
+        // connected when first asked for. Only for use by the tasks.
+        device& device_for(const std::string &path) { return _devices[path]; }
+
+    private:
+        std::mutex                              _mutex;
+        std::condition_variable                 _cv;
+        std::deque<std::function<void()>>       _tasks;
+        bool                                    _stop = false;
+        std::unordered_map<std::string, device> _devices;
+        std::thread                             _thread;
+
+        io_thread() : _thread([this]() { run(); }) {}
+
+        void run() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for(;;) {
+                _cv.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+                if (_tasks.empty()) return;
+
+                std::function<void()> task = std::move(_tasks.front());
+                _tasks.pop_front();
+
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+};
+
+// Telemetry logs are mapped in segments of this size, this many ahead of
+// the records being written.
+const size_t log_segment_size   = 64 * 1024;
+const size_t log_segments_ahead = 4;
+
+const char log_magic[8] = "EV3TLOG";
+
+// Hands a segment of a log over to the kernel.
+void unmap_segment(void *data) {
+    msync(data, log_segment_size, MS_ASYNC);
+    munmap(data, log_segment_size);
+}
+
+// Values in attribute traces are kept on one line.
+std::string escape_trace(const char *s, size_t size) {
+    std::string r;
+    r.reserve(size);
+    for(size_t i = 0; i < size; ++i) {
+        if (s[i] == '\\')
+            r += "\\\\";
+        else if (s[i] == '\n')
+            r += "\\n";
+        else
+            r += s[i];
+    }
+    return r;
+}
+
+std::string unescape_trace(const std::string &s) {
+    std::string r;
+    r.reserve(s.size());
+    for(size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '\\' && i + 1 < s.size())
+            r += (s[++i] == 'n') ? '\n' : s[i];
+        else
+            r += s[i];
+    }
+    return r;
+}
+
+// Thrown by trace_replay once the trace cannot answer.
+std::system_error end_of_trace() {
+    return std::system_error(std::make_error_code(std::errc::no_message_available), "end of trace");
 }
 
+} // namespace
+
 //-----------------------------------------------------------------------------
-std::string device::get_attr_from_set(const std::string &name) const {
-    using namespace std;
+device::handle_table::handle_table() : users(0), pending(false) {
+    for(auto &f : rd) f = -1;
+    for(auto &f : wr) f = -1;
+    for(auto &n : notifies) n = false;
+}
 
-    string s = get_attr_line(name);
+device::handle_table::handle_table(const handle_table&) : handle_table() {}
 
-    size_t pos, last_pos = 0;
-    string t;
-    do {
-        pos = s.find(' ', last_pos);
+device::handle_table& device::handle_table::operator=(const handle_table&) {
+    close();
+    return *this;
+}
 
-        if (pos != string::npos) {
-            t = s.substr(last_pos, pos-last_pos);
-            last_pos = pos+1;
-        } else {
-            t = s.substr(last_pos);
+device::handle_table::~handle_table() {
+    close();
+}
+
+void device::handle_table::drop(std::atomic<int> &handle, int fd) {
+    if (!handle.compare_exchange_strong(fd, -1)) return;
+
+    std::lock_guard<std::mutex> lock(retired_lock);
+    retired.push_back(fd);
+    pending = true;
+}
+
+void device::handle_table::close() {
+    {
+        std::lock_guard<std::mutex> lock(retired_lock);
+        for(auto &f : rd) {
+            const int h = f.exchange(-1);
+            if (h >= 0) retired.push_back(h);
         }
+        for(auto &f : wr) {
+            const int h = f.exchange(-1);
+            if (h >= 0) retired.push_back(h);
+        }
+        pending = !retired.empty();
+    }
+    for(auto &n : notifies) n = false;
 
-        if (!t.empty()) {
-            if (*t.begin()=='[') {
-                return t.substr(1, t.length()-2);
-            }
+    if (users == 0) collect();
+}
+
+// A thread that becomes a user after the check below finds the retired
+// descriptors gone from the table, so they are safe to close. The last
+// user to leave only comes here when `pending` is set, so reads without
+// retired descriptors do not take the lock.
+void device::handle_table::collect() {
+    std::lock_guard<std::mutex> lock(retired_lock);
+    if (users != 0) return;
+
+    for(int fd : retired) ::close(fd);
+    retired.clear();
+    pending = false;
+}
+
+//-----------------------------------------------------------------------------
+device::const_table::const_table() {
+    for(auto &i : e) i.state = empty;
+}
+
+device::const_table::const_table(const const_table&) : const_table() {}
+
+device::const_table& device::const_table::operator=(const const_table&) {
+    clear();
+    return *this;
+}
+
+void device::const_table::clear() {
+    for(auto &i : e) {
+        i.state = empty;
+        i.str.clear();
+        i.set.clear();
+    }
+}
+
+//-----------------------------------------------------------------------------
+bool device::connect(
+        const std::string &dir,
+        const std::string &pattern,
+        const std::map<std::string, std::set<std::string>> &match
+        ) noexcept
+{
+    using namespace std;
+
+    _handles.close();
+    _consts.clear();
+    invalidate_shadow();
+
+    vector<string> names;
+    if (attr_backend *b = backend()) {
+        try {
+            names = b->list(dir);
+        } catch (...) { }
+    } else {
+        struct dirent *dp;
+        DIR *dfd;
+
+        if ((dfd = opendir(dir.c_str())) != nullptr) {
+            while ((dp = readdir(dfd)) != nullptr)
+                names.push_back(dp->d_name);
+
+            closedir(dfd);
         }
-    } while (pos!=string::npos);
+    }
+
+    for (const auto &name : names) {
+        if (name.compare(0, pattern.length(), pattern) == 0) {
+            try {
+                _path = dir + name + '/';
+
+                bool bMatch = true;
+                for (auto &m : match) {
+                    const auto &attribute = m.first;
+                    const auto &matches   = m.second;
+                    const auto strValue   = get_attr_string(attribute);
+
+                    if (!matches.empty() && !matches.begin()->empty() &&
+                            (matches.find(strValue) == matches.end()))
+                    {
+                        bMatch = false;
+                        break;
+                    }
+                }
+
+                if (bMatch) return true;
+            } catch (...) { }
+
+            _path.clear();
+        }
+    }
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+std::atomic<attr_backend*> device::_backend(nullptr);
+
+//-----------------------------------------------------------------------------
+device::attr_cache_stats device::cache_stats() {
+    return cache_registry::instance().stats();
+}
+
+//-----------------------------------------------------------------------------
+void device::set_shadowing(bool enable) {
+    if (!enable)
+        _shadow.clear();
+    else if (_shadow.empty())
+        _shadow.resize(attr_slot_count);
+}
+
+//-----------------------------------------------------------------------------
+void device::invalidate_shadow() {
+    for(auto &s : _shadow) s.valid = false;
+}
+
+//-----------------------------------------------------------------------------
+int device::device_index() const {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    if (_device_index < 0) {
+        unsigned f = 1;
+        _device_index = 0;
+        for (auto it=_path.rbegin(); it!=_path.rend(); ++it) {
+            if(*it =='/')
+                continue;		
+            if ((*it < '0') || (*it > '9'))
+                break;
+
+            _device_index += (*it -'0') * f;
+            f *= 10;
+        }
+    }
+
+    return _device_index;
+}
+
+//-----------------------------------------------------------------------------
+int device::get_attr_int(const std::string &name) const {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    if (!backend()) {
+        for(int attempt = 0; attempt < 2; ++attempt) {
+            ifstream &is = ifstream_open(_path + name);
+            if (is.is_open()) {
+                int result = 0;
+                try {
+                    is >> result;
+                    return result;
+                } catch(...) {
+                    // This could mean the sysfs attribute was recreated and the
+                    // corresponding file handle got stale. Lets close the file and try
+                    // again (once):
+                    if (attempt != 0) throw;
+
+                    is.close();
+                    is.clear();
+                }
+            } else break;
+        }
+        throw system_error(make_error_code(errc::no_such_device), _path+name);
+    }
+#endif
+
+    const string path = _path + name;
+
+    char buf[32];
+    const size_t n = attr_read(path, buf, sizeof(buf));
+
+    int result;
+    if (!parse_int(buf, buf + n, result))
+        throw system_error(make_error_code(errc::invalid_argument), path);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+void device::set_attr_int(const std::string &name, int value) {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    if (!backend()) {
+        for(int attempt = 0; attempt < 2; ++attempt) {
+            ofstream &os = ofstream_open(_path + name);
+            if (os.is_open()) {
+                if (os << value) return;
+
+                // An error could mean that sysfs attribute was recreated and the cached
+                // file handle is stale. Lets close the file and try again (once):
+                if (attempt == 0 && errno == ENODEV) {
+                    os.close();
+                    os.clear();
+                } else {
+                    throw system_error(std::error_code(errno, std::system_category()));
+                }
+            } else {
+                throw system_error(make_error_code(errc::no_such_device), _path + name);
+            }
+        }
+    }
+#endif
+
+    char buf[16];
+    attr_write(_path + name, buf, format_int(value, buf));
+}
+
+//-----------------------------------------------------------------------------
+std::string device::get_attr_string(const std::string &name) const {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    if (!backend()) {
+        ifstream &is = ifstream_open(_path + name);
+        if (is.is_open()) {
+            string result;
+            is >> result;
+            return result;
+        }
+
+        throw system_error(make_error_code(errc::no_such_device), _path+name);
+    }
+#endif
+
+    char buf[attr_page_size];
+    const size_t n = attr_read(_path + name, buf, sizeof(buf));
+    return parse_token(buf, buf + n);
+}
+
+//-----------------------------------------------------------------------------
+void device::set_attr_string(const std::string &name, const std::string &value) {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    if (!backend()) {
+        ofstream &os = ofstream_open(_path + name);
+        if (os.is_open()) {
+            if (!(os << value)) throw system_error(std::error_code(errno, std::system_category()));
+            return;
+        }
+
+        throw system_error(make_error_code(errc::no_such_device), _path+name);
+    }
+#endif
+
+    if (value.size() >= attr_page_size)
+        throw system_error(make_error_code(errc::invalid_argument), _path+name);
+
+    char buf[attr_page_size];
+    copy(value.begin(), value.end(), buf);
+    buf[value.size()] = '\n';
+
+    attr_write(_path + name, buf, value.size() + 1);
+}
+
+//-----------------------------------------------------------------------------
+std::string device::get_attr_line(const std::string &name) const {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    if (!backend()) {
+        ifstream &is = ifstream_open(_path + name);
+        if (is.is_open()) {
+            string result;
+            getline(is, result);
+            return result;
+        }
+
+        throw system_error(make_error_code(errc::no_such_device), _path+name);
+    }
+#endif
+
+    char buf[attr_page_size];
+    const size_t n = attr_read(_path + name, buf, sizeof(buf));
+    return parse_line(buf, buf + n);
+}
+
+//-----------------------------------------------------------------------------
+mode_set device::get_attr_set(
+        const std::string &name, std::string *pCur) const
+{
+    return parse_set(get_attr_line(name), pCur);
+}
+
+//-----------------------------------------------------------------------------
+int device::slot_handle(attr_slot slot, bool write) const {
+    using namespace std;
+
+    atomic<int> &handle = write ? _handles.wr[slot] : _handles.rd[slot];
+
+    int fd = handle.load(memory_order_acquire);
+    if (fd >= 0) return fd;
+
+    const string path = _path + attr_slot_names[slot];
+    fd = ::open(path.c_str(), (write ? O_WRONLY | O_TRUNC : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0)
+        throw system_error(error_code(errno, system_category()), path);
+
+    // Another thread may have opened the same attribute meanwhile.
+    int expected = -1;
+    if (!handle.compare_exchange_strong(expected, fd)) {
+        ::close(fd);
+        fd = expected;
+    }
+
+    return fd;
+}
+
+//-----------------------------------------------------------------------------
+size_t device::read_attr(attr_slot slot, char *buf, size_t size) const {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    if (attr_backend *b = backend())
+        return b->read(_path + attr_slot_names[slot], buf, size);
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    const string s = get_attr_line(attr_slot_names[slot]);
+    const size_t n = min(size, s.size());
+    copy_n(s.data(), n, buf);
+    return n;
+#else
+    handle_table::user user(_handles);
+
+    for(int attempt = 0; ; ++attempt) {
+        const int fd = slot_handle(slot, false);
+
+        const ssize_t n = pread_attr(fd, buf, size);
+        if (n >= 0) return n;
+
+        // ENODEV means the sysfs attribute was recreated and the file handle
+        // got stale. Lets drop the handle and try again (once):
+        const int err = errno;
+        if (attempt != 0 || err != ENODEV)
+            throw system_error(error_code(err, system_category()), _path + attr_slot_names[slot]);
+
+        _handles.drop(_handles.rd[slot], fd);
+    }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+void device::write_attr(attr_slot slot, const char *buf, size_t size) {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    if (attr_backend *b = backend())
+        return b->write(_path + attr_slot_names[slot], buf, size);
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    set_attr_string(attr_slot_names[slot], string(buf, size - 1));
+#else
+    handle_table::user user(_handles);
+
+    for(int attempt = 0; ; ++attempt) {
+        const int fd = slot_handle(slot, true);
+
+        if (pwrite_attr(fd, buf, size) >= 0) return;
+
+        // An error could mean that sysfs attribute was recreated and the
+        // file handle is stale. Lets drop the handle and try again (once):
+        const int err = errno;
+        if (attempt != 0 || err != ENODEV)
+            throw system_error(error_code(err, system_category()), _path + attr_slot_names[slot]);
+
+        _handles.drop(_handles.wr[slot], fd);
+    }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+device::shadow_entry* device::shadow(attr_slot slot) const {
+    if (_shadow.empty()) return nullptr;
+
+    // Only the attributes that do not change unless written are shadowed.
+    switch (slot) {
+        case attr_position_sp:
+        case attr_speed_sp:
+        case attr_duty_cycle_sp:
+        case attr_stop_action:
+        case attr_mode:
+            return &_shadow[slot];
+        default:
+            return nullptr;
+    }
+}
+
+//-----------------------------------------------------------------------------
+size_t device::load_attr(attr_slot slot, char *buf, size_t size) const {
+    using namespace std;
+
+    shadow_entry *s = shadow(slot);
+    if (s && s->valid) {
+        const size_t n = min(size, s->value.size());
+        copy_n(s->value.data(), n, buf);
+        return n;
+    }
+
+    const size_t n = read_attr(slot, buf, size);
+
+    if (s) {
+        s->value = parse_line(buf, buf + n);
+        s->valid = true;
+    }
+
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// The value in buf is terminated with a newline, which is not part of the
+// shadowed value.
+void device::store_attr(attr_slot slot, const char *buf, size_t size) {
+    shadow_entry *s = shadow(slot);
+    if (s) {
+        if (s->valid && s->value.compare(0, std::string::npos, buf, size - 1) == 0)
+            return;
+
+        // Should the write fail, the value of the attribute is unknown.
+        s->valid = false;
+    }
+
+    write_attr(slot, buf, size);
+
+    if (s) {
+        s->value.assign(buf, size - 1);
+        s->valid = true;
+    } else if (slot == attr_command && size == 6 && strncmp(buf, "reset", 5) == 0) {
+        // Resetting a motor sets all of its attributes to their defaults.
+        invalidate_shadow();
+    }
+}
+
+//-----------------------------------------------------------------------------
+int device::get_attr_int(attr_slot slot) const {
+    using namespace std;
+
+    char buf[32];
+    const size_t n = load_attr(slot, buf, sizeof(buf));
+
+    int result;
+    if (!parse_int(buf, buf + n, result))
+        throw system_error(make_error_code(errc::invalid_argument), _path + attr_slot_names[slot]);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+void device::set_attr_int(attr_slot slot, int value) {
+    char buf[16];
+    store_attr(slot, buf, format_int(value, buf));
+}
+
+//-----------------------------------------------------------------------------
+std::string device::get_attr_line(attr_slot slot) const {
+    char buf[attr_page_size];
+    const size_t n = load_attr(slot, buf, sizeof(buf));
+    return parse_line(buf, buf + n);
+}
+
+//-----------------------------------------------------------------------------
+void device::set_attr_string(attr_slot slot, const std::string &value) {
+    using namespace std;
+
+    if (value.size() >= attr_page_size)
+        throw system_error(make_error_code(errc::invalid_argument), _path + attr_slot_names[slot]);
+
+    char buf[attr_page_size];
+    copy(value.begin(), value.end(), buf);
+    buf[value.size()] = '\n';
+
+    store_attr(slot, buf, value.size() + 1);
+}
+
+//-----------------------------------------------------------------------------
+mode_set device::get_attr_set(attr_slot slot) const {
+    return parse_set(get_attr_line(slot), nullptr);
+}
+
+//-----------------------------------------------------------------------------
+motor_state device::get_attr_state(attr_slot slot) const {
+    char buf[attr_page_size];
+    const size_t n = load_attr(slot, buf, sizeof(buf));
+    return motor_state::parse(buf, buf + n);
+}
+
+//-----------------------------------------------------------------------------
+std::chrono::steady_clock::time_point device::read_attrs(
+        attr_request *reads, size_t count) const
+{
+    if (count > attr_slot_count)
+        throw std::invalid_argument("count");
+
+    const attr_reads batch = { this, reads, count };
+    return read_attrs(&batch, 1);
+}
+
+//-----------------------------------------------------------------------------
+std::chrono::steady_clock::time_point device::read_attrs(
+        const attr_reads *batch, size_t count)
+{
+    using namespace std;
+
+    for(size_t i = 0; i < count; ++i)
+        if (batch[i].dev->_path.empty())
+            throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    if (attr_backend *b = backend()) {
+        const auto timestamp = b->now();
+        for(size_t i = 0; i < count; ++i) {
+            const attr_reads &r = batch[i];
+            for(size_t j = 0; j < r.count; ++j)
+                r.reads[j].size = r.dev->read_attr(r.reads[j].slot, r.reads[j].data, sizeof(r.reads[j].data));
+        }
+        return timestamp;
+    }
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    const auto timestamp = chrono::steady_clock::now();
+    for(size_t i = 0; i < count; ++i) {
+        const attr_reads &b = batch[i];
+        for(size_t j = 0; j < b.count; ++j) {
+            attr_request &r = b.reads[j];
+            r.size = b.dev->read_attr(r.slot, r.data, sizeof(r.data));
+        }
+    }
+    return timestamp;
+#else
+    // Resolve all the handles first, so that the reads follow each other as
+    // closely as possible.
+    static thread_local vector<attr_io> io;
+    io.clear();
+
+    // Keeps the handles of the devices open until the batch is read.
+    struct batch_users {
+        const attr_reads *batch;
+        size_t            count;
+
+        ~batch_users() {
+            for(size_t i = 0; i < count; ++i) {
+                handle_table &t = batch[i].dev->_handles;
+                if (--t.users == 0 && t.pending) t.collect();
+            }
+        }
+    } users = { batch, 0 };
+
+    for(; users.count < count; ++users.count)
+        ++batch[users.count].dev->_handles.users;
+
+    for(size_t i = 0; i < count; ++i) {
+        const attr_reads &b = batch[i];
+        for(size_t j = 0; j < b.count; ++j) {
+            attr_request &r = b.reads[j];
+            io.push_back(attr_io{b.dev->slot_handle(r.slot, false), r.data, sizeof(r.data), 0});
+        }
+    }
+
+    const auto timestamp = chrono::steady_clock::now();
+    read_batch(io.data(), io.size());
+
+    size_t k = 0;
+    for(size_t i = 0; i < count; ++i) {
+        const attr_reads &b = batch[i];
+        for(size_t j = 0; j < b.count; ++j, ++k) {
+            attr_request &r = b.reads[j];
+            if (io[k].result >= 0)
+                r.size = io[k].result;
+            else // Let the single read deal with stale handles and errors.
+                r.size = b.dev->read_attr(r.slot, r.data, sizeof(r.data));
+        }
+    }
+    return timestamp;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+bool device::wait_attr(
+        attr_slot slot,
+        const std::function<bool(const char*, size_t)> &done,
+        std::chrono::milliseconds timeout
+        ) const
+{
+    using namespace std;
+
+    // Backends have clocks of their own and do the waiting themselves.
+    if (attr_backend *b = backend()) {
+        const string path = _path + attr_slot_names[slot];
+        const auto deadline = timeout.count() < 0 ?
+            attr_backend::time_point::max() : b->now() + timeout;
+
+        for(;;) {
+            char buf[attr_page_size];
+            const size_t n = read_attr(slot, buf, sizeof(buf));
+            if (done(buf, n)) return true;
+
+            if (!b->wait(path, deadline)) return false;
+        }
+    }
+
+    const auto start    = chrono::steady_clock::now();
+    const auto deadline = start + timeout;
+    chrono::microseconds interval = attr_wait_min;
+
+#if !defined(EV3DEV_ATTR_IO_FSTREAM)
+    char   last[attr_page_size];
+    size_t last_n    = 0;
+    bool   timed_out = false; // waiting for a notification
+#endif
+
+    for(;;) {
+        // Reading the attribute also rearms the notification.
+        char buf[attr_page_size];
+        const size_t n = read_attr(slot, buf, sizeof(buf));
+        if (done(buf, n)) return true;
+
+#if !defined(EV3DEV_ATTR_IO_FSTREAM)
+        if (timed_out && (n != last_n || memcmp(buf, last, n) != 0))
+            _handles.notifies[slot].store(false, memory_order_relaxed);
+
+        copy_n(buf, n, last);
+        last_n = n;
+#endif
+
+        const auto now = chrono::steady_clock::now();
+
+        chrono::microseconds wait(-1);
+        if (timeout.count() >= 0) {
+            wait = chrono::duration_cast<chrono::microseconds>(deadline - now);
+            if (wait.count() <= 0) return false;
+        }
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+        if (now - start < attr_spin_time) {
+            this_thread::yield();
+            continue;
+        }
+
+        this_thread::sleep_for(wait.count() < 0 ? interval : min(wait, interval));
+        interval = min<chrono::microseconds>(interval * 2, attr_poll_max);
+#else
+        const bool notifies = _handles.notifies[slot].load(memory_order_relaxed);
+        if (!notifies) {
+            if (now - start < attr_spin_time) {
+                this_thread::yield();
+                continue;
+            }
+
+            if (wait.count() < 0 || wait > interval) wait = interval;
+        } else if (wait.count() < 0 || wait > attr_notify_poll) {
+            wait = attr_notify_poll;
+        }
+
+        timespec ts;
+        ts.tv_sec  = wait.count() / 1000000;
+        ts.tv_nsec = (wait.count() % 1000000) * 1000;
+
+        pollfd p = { -1, POLLPRI, 0 };
+        int rc, err;
+        {
+            handle_table::user user(_handles);
+            p.fd = slot_handle(slot, false);
+            rc   = ppoll(&p, 1, &ts, nullptr);
+            err  = errno;
+        }
+
+        if (rc < 0 && err != EINTR)
+            throw system_error(error_code(err, system_category()), _path + attr_slot_names[slot]);
+
+        timed_out = rc == 0 && notifies;
+
+        if (rc > 0 && (p.revents & (POLLPRI | POLLERR)))
+            _handles.notifies[slot].store(true, memory_order_relaxed);
+        else if (rc == 0 && !notifies)
+            interval = min<chrono::microseconds>(interval * 2, attr_poll_max);
+#endif
+    }
+}
+
+//-----------------------------------------------------------------------------
+const device::const_table::entry& device::load_const(const_attr attr) const {
+    using namespace std;
+
+    const_table::entry &e = _consts.e[attr];
+
+    // The first caller loads the value, concurrent callers wait for it.
+    for(;;) {
+        int state = e.state.load(memory_order_acquire);
+        if (state == const_table::ready) return e;
+
+        if (state == const_table::empty &&
+                e.state.compare_exchange_weak(state, const_table::loading))
+            break;
+
+        this_thread::yield();
+    }
+
+    try {
+        const char *name = const_attr_names[attr];
+        switch (attr) {
+            case const_address:
+            case const_driver_name:
+                e.str = get_attr_string(name);
+                break;
+            case const_commands:
+            case const_stop_actions:
+            case const_modes:
+                get_attr_tokens(name, e.set);
+                break;
+            default:
+                e.num = get_attr_int(name);
+        }
+    } catch(...) {
+        e.state.store(const_table::empty, memory_order_release);
+        throw;
+    }
+
+    e.state.store(const_table::ready, memory_order_release);
+    return e;
+}
+
+//-----------------------------------------------------------------------------
+int device::get_attr_int(const_attr attr) const {
+    return load_const(attr).num;
+}
+
+//-----------------------------------------------------------------------------
+const std::string& device::get_attr_string(const_attr attr) const {
+    return load_const(attr).str;
+}
+
+//-----------------------------------------------------------------------------
+const token_set& device::get_attr_set(const_attr attr) const {
+    return load_const(attr).set;
+}
+
+//-----------------------------------------------------------------------------
+void device::attr_batch::set(attr_slot slot, const char *name, std::string value) {
+    for(auto &i : _items) {
+        if (strcmp(i.name, name) == 0) {
+            i.value = std::move(value);
+            return;
+        }
+    }
+
+    _items.push_back(item{slot, name, std::move(value)});
+}
+
+void device::attr_batch::set(attr_slot slot, int value) {
+    char buf[16];
+    set(slot, attr_slot_names[slot], std::string(buf, format_int(value, buf) - 1));
+}
+
+void device::attr_batch::set(attr_slot slot, const std::string &value) {
+    set(slot, attr_slot_names[slot], value);
+}
+
+void device::attr_batch::set(const char *name, int value) {
+    char buf[16];
+    set(attr_slot_count, name, std::string(buf, format_int(value, buf) - 1));
+}
+
+void device::attr_batch::set(const char *name, const std::string &value) {
+    set(attr_slot_count, name, value);
+}
+
+//-----------------------------------------------------------------------------
+void device::commit_attrs(const attr_batch &batch) {
+    for(const auto &i : batch._items) {
+        if (i.slot != attr_slot_count)
+            set_attr_string(i.slot, i.value);
+        else
+            set_attr_string(i.name, i.value);
+    }
+}
+
+//-----------------------------------------------------------------------------
+std::string device::get_attr_from_set(const std::string &name) const {
+    using namespace std;
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    const string line = get_attr_line(name);
+    const char *s = line.data(), *end = s + line.size();
+#else
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    char buf[attr_page_size];
+    const char *s = buf, *end = buf + attr_read(_path + name, buf, sizeof(buf));
+#endif
+
+    // The selected token is the one in square brackets.
+    const char *b = static_cast<const char*>(memchr(s, '[', end - s));
+    if (b) {
+        const char *e = static_cast<const char*>(memchr(b, ']', end - b));
+        if (e) return string(b + 1, e);
+    }
+
+    return { "none" };
+}
+
+//-----------------------------------------------------------------------------
+const token_set& device::get_attr_tokens(const std::string &name, token_set &tokens) const {
+    using namespace std;
+
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
+    const string line = get_attr_line(name);
+    tokens.assign(line.data(), line.data() + line.size());
+#else
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    char buf[attr_page_size];
+    tokens.assign(buf, buf + attr_read(_path + name, buf, sizeof(buf)));
+#endif
+
+    return tokens;
+}
+
+//-----------------------------------------------------------------------------
+template <class T>
+std::future<T> device::async_call(std::function<T(device&)> f) const {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    // The I/O thread works on a device of its own, with its own handles, so
+    // that this one can be used (or destroyed) meanwhile.
+    const string path  = _path;
+    const int    index = _device_index;
+
+    auto task = make_shared<packaged_task<T()>>([path, index, f]() {
+            device &d = io_thread::instance().device_for(path);
+            if (d._path.empty()) {
+                d._path         = path;
+                d._device_index = index;
+            }
+            return f(d);
+            });
+
+    future<T> result = task->get_future();
+    io_thread::instance().post([task]() { (*task)(); });
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+std::future<int> device::async_get_attr_int(const std::string &name) const {
+    return async_call<int>([name](device &d) { return d.get_attr_int(name); });
+}
+
+std::future<std::string> device::async_get_attr_string(const std::string &name) const {
+    return async_call<std::string>([name](device &d) { return d.get_attr_string(name); });
+}
+
+std::future<std::string> device::async_get_attr_line(const std::string &name) const {
+    return async_call<std::string>([name](device &d) { return d.get_attr_line(name); });
+}
+
+std::future<mode_set> device::async_get_attr_set(const std::string &name) const {
+    return async_call<mode_set>([name](device &d) { return d.get_attr_set(name); });
+}
+
+std::future<std::string> device::async_get_attr_from_set(const std::string &name) const {
+    return async_call<std::string>([name](device &d) { return d.get_attr_from_set(name); });
+}
+
+std::future<motor_state> device::async_get_attr_state(attr_slot slot) const {
+    return async_call<motor_state>([slot](device &d) { return d.get_attr_state(slot); });
+}
+
+//-----------------------------------------------------------------------------
+// The shadow of this device does not see the write, so it is dropped.
+std::future<void> device::async_set_attr_int(const std::string &name, int value) {
+    invalidate_shadow();
+    return async_call<void>([name, value](device &d) { d.set_attr_int(name, value); });
+}
+
+std::future<void> device::async_set_attr_string(const std::string &name, const std::string &value) {
+    invalidate_shadow();
+    return async_call<void>([name, value](device &d) { d.set_attr_string(name, value); });
+}
+
+//-----------------------------------------------------------------------------
+class sysfs_backend::state {
+    public:
+        std::string root;
+
+        // An open attribute. Whoever reads or writes through it holds a
+        // reference, so a stale handle is only closed once nobody uses it.
+        struct file {
+            const int fd;
+
+            explicit file(int fd) : fd(fd) {}
+            ~file() { ::close(fd); }
+
+            file(const file&) = delete;
+            file& operator=(const file&) = delete;
+        };
+
+        std::mutex lock;
+        std::unordered_map<std::string, std::shared_ptr<file>> rd, wr; // by path
+
+        // The path under the root of the backend.
+        std::string map(const std::string &path) const {
+            static const std::string sys_root { SYS_ROOT };
+
+            if (path.compare(0, sys_root.size(), sys_root) == 0)
+                return root + path.substr(sys_root.size());
+            return path;
+        }
+
+        // Attributes stay open until the backend is destroyed, or until
+        // they are dropped as stale.
+        std::shared_ptr<file> handle(const std::string &path, bool write) {
+            std::lock_guard<std::mutex> guard(lock);
+
+            auto &handles = write ? wr : rd;
+
+            auto h = handles.find(path);
+            if (h != handles.end()) return h->second;
+
+            const std::string p = map(path);
+            const int fd = ::open(p.c_str(), (write ? O_WRONLY | O_TRUNC : O_RDONLY) | O_CLOEXEC);
+            if (fd < 0)
+                throw std::system_error(std::make_error_code(std::errc::no_such_device), p);
+
+            return handles[path] = std::make_shared<file>(fd);
+        }
+
+        // Forgets `f`, unless another thread has already reopened the path.
+        void drop(const std::string &path, bool write, const std::shared_ptr<file> &f) {
+            std::lock_guard<std::mutex> guard(lock);
+
+            auto &handles = write ? wr : rd;
+
+            auto h = handles.find(path);
+            if (h != handles.end() && h->second == f) handles.erase(h);
+        }
+};
+
+//-----------------------------------------------------------------------------
+sysfs_backend::sysfs_backend() : sysfs_backend(SYS_ROOT) {}
+
+//-----------------------------------------------------------------------------
+sysfs_backend::sysfs_backend(const std::string &root) : _s(new state) {
+    _s->root = root;
+}
+
+//-----------------------------------------------------------------------------
+sysfs_backend::~sysfs_backend() {}
+
+//-----------------------------------------------------------------------------
+std::vector<std::string> sysfs_backend::list(const std::string &dir) {
+    std::vector<std::string> names;
+
+    if (DIR *dfd = opendir(_s->map(dir).c_str())) {
+        while (struct dirent *dp = readdir(dfd))
+            names.push_back(dp->d_name);
+        closedir(dfd);
+    }
+
+    return names;
+}
+
+//-----------------------------------------------------------------------------
+size_t sysfs_backend::read(const std::string &path, char *buf, size_t size) {
+    using namespace std;
+
+    for(int attempt = 0; ; ++attempt) {
+        const auto f = _s->handle(path, false);
+
+        ssize_t n;
+        do {
+            n = pread(f->fd, buf, size, 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n >= 0) return n;
+
+        // ENODEV means the sysfs attribute was recreated and the cached file
+        // handle got stale. Lets drop the handle and try again (once):
+        const int err = errno;
+        _s->drop(path, false, f);
+        if (attempt != 0 || err != ENODEV)
+            throw system_error(error_code(err, system_category()), _s->map(path));
+    }
+}
+
+//-----------------------------------------------------------------------------
+void sysfs_backend::write(const std::string &path, const char *buf, size_t size) {
+    using namespace std;
+
+    for(int attempt = 0; ; ++attempt) {
+        const auto f = _s->handle(path, true);
+
+        ssize_t n;
+        do {
+            n = pwrite(f->fd, buf, size, 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n >= 0) return;
+
+        // As in read(), a stale handle is dropped and the write retried once.
+        const int err = errno;
+        _s->drop(path, true, f);
+        if (attempt != 0 || err != ENODEV)
+            throw system_error(error_code(err, system_category()), _s->map(path));
+    }
+}
+
+//-----------------------------------------------------------------------------
+bool sysfs_backend::wait(const std::string &path, time_point deadline) {
+    using namespace std;
+
+    const auto t = now();
+    if (t >= deadline) return false;
+
+    // Wakes up on change notifications, and polls the attributes that do
+    // not send them.
+    const auto wait = chrono::duration_cast<chrono::microseconds>(
+            min<time_point::duration>(deadline - t, chrono::milliseconds(1)));
+
+    timespec ts;
+    ts.tv_sec  = wait.count() / 1000000;
+    ts.tv_nsec = (wait.count() % 1000000) * 1000;
+
+    const auto f = _s->handle(path, false);
+
+    pollfd p = { f->fd, POLLPRI, 0 };
+    if (ppoll(&p, 1, &ts, nullptr) < 0 && errno != EINTR)
+        throw system_error(error_code(errno, system_category()), _s->map(path));
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+attr_backend::time_point sysfs_backend::now() {
+    return std::chrono::steady_clock::now();
+}
+
+//-----------------------------------------------------------------------------
+class memory_backend::state {
+    public:
+        mutable std::mutex      lock;
+        std::condition_variable changed;
+        unsigned long           version = 0; // counts the changes
+
+        // The contents of the attributes, by path, and the devices of each
+        // class directory.
+        std::unordered_map<std::string, std::string>              attrs;
+        std::unordered_map<std::string, std::vector<std::string>> dirs;
+
+        std::string& find(const std::string &path) {
+            auto a = attrs.find(path);
+            if (a == attrs.end())
+                throw std::system_error(std::make_error_code(std::errc::no_such_device), path);
+            return a->second;
+        }
+
+        // The version a thread saw at its last read. Waits after a read
+        // return at once if something changed in between.
+        static std::pair<const state*, unsigned long>& seen() {
+            static thread_local std::pair<const state*, unsigned long> s(nullptr, 0);
+            return s;
+        }
+};
+
+//-----------------------------------------------------------------------------
+memory_backend::memory_backend() : _s(new state) {}
+
+//-----------------------------------------------------------------------------
+memory_backend::~memory_backend() {}
+
+//-----------------------------------------------------------------------------
+std::string memory_backend::add_device(const std::string &cls, const std::string &name,
+        const std::map<std::string, std::string> &attrs)
+{
+    const std::string dir  = SYS_ROOT "/" + cls + "/";
+    const std::string path = dir + name + "/";
+
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    _s->dirs[dir].push_back(name);
+    for(const auto &a : attrs)
+        _s->attrs[path + a.first] = a.second + '\n';
+
+    ++_s->version;
+    _s->changed.notify_all();
+    return path;
+}
+
+//-----------------------------------------------------------------------------
+void memory_backend::set(const std::string &path, const std::string &value) {
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    _s->find(path) = value + '\n';
+
+    ++_s->version;
+    _s->changed.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+std::string memory_backend::get(const std::string &path) const {
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    const std::string &v = _s->find(path);
+    return v.empty() || v.back() != '\n' ? v : v.substr(0, v.size() - 1);
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::string> memory_backend::list(const std::string &dir) {
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    auto d = _s->dirs.find(dir);
+    if (d == _s->dirs.end()) return {};
+    return d->second;
+}
+
+//-----------------------------------------------------------------------------
+size_t memory_backend::read(const std::string &path, char *buf, size_t size) {
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    const std::string &v = _s->find(path);
+    const size_t n = std::min(size, v.size());
+    std::copy_n(v.data(), n, buf);
+
+    state::seen() = std::make_pair(_s.get(), _s->version);
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+void memory_backend::write(const std::string &path, const char *buf, size_t size) {
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    _s->find(path).assign(buf, size);
+
+    ++_s->version;
+    _s->changed.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+bool memory_backend::wait(const std::string&, time_point deadline) {
+    std::unique_lock<std::mutex> lock(_s->lock);
+
+    const auto &seen = state::seen();
+    const unsigned long v = seen.first == _s.get() ? seen.second : _s->version;
+    const auto changed = [&]() { return _s->version != v; };
+
+    if (deadline == time_point::max()) {
+        _s->changed.wait(lock, changed);
+        return true;
+    }
+
+    return _s->changed.wait_until(lock, deadline, changed);
+}
+
+//-----------------------------------------------------------------------------
+attr_backend::time_point memory_backend::now() {
+    return std::chrono::steady_clock::now();
+}
+
+//-----------------------------------------------------------------------------
+class trace_recorder::state {
+    public:
+        std::mutex    lock;
+        std::ofstream out;
+
+        attr_backend                  *target;
+        std::unique_ptr<sysfs_backend> sysfs; // the default target
+        attr_backend::time_point       start;
+
+        void log(char op, const std::string &path, const std::string &value) {
+            const auto t = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    target->now() - start).count();
+            out << t << ' ' << op << ' ' << path << ' ' << value << '\n';
+        }
+};
+
+//-----------------------------------------------------------------------------
+trace_recorder::trace_recorder(const std::string &path) : _s(new state) {
+    _s->sysfs.reset(new sysfs_backend);
+    _s->target = _s->sysfs.get();
+
+    _s->out.open(path);
+    if (!_s->out)
+        throw std::system_error(std::error_code(errno, std::system_category()), path);
+
+    _s->start = _s->target->now();
+}
+
+//-----------------------------------------------------------------------------
+trace_recorder::trace_recorder(const std::string &path, attr_backend &target) : _s(new state) {
+    _s->target = &target;
+
+    _s->out.open(path);
+    if (!_s->out)
+        throw std::system_error(std::error_code(errno, std::system_category()), path);
+
+    _s->start = _s->target->now();
+}
+
+//-----------------------------------------------------------------------------
+trace_recorder::~trace_recorder() {
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::string> trace_recorder::list(const std::string &dir) {
+    using namespace std;
+
+    lock_guard<mutex> lock(_s->lock);
+
+    const vector<string> names = _s->target->list(dir);
+
+    string line;
+    for(const auto &name : names) {
+        if (!line.empty()) line += ' ';
+        line += name;
+    }
+
+    _s->log('l', dir, line);
+    return names;
+}
+
+//-----------------------------------------------------------------------------
+size_t trace_recorder::read(const std::string &path, char *buf, size_t size) {
+    // The lock is held over the I/O, so the trace has the order of the reads.
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    const size_t n = _s->target->read(path, buf, size);
+    _s->log('r', path, escape_trace(buf, n));
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+void trace_recorder::write(const std::string &path, const char *buf, size_t size) {
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    _s->target->write(path, buf, size);
+    _s->log('w', path, escape_trace(buf, size));
+}
+
+//-----------------------------------------------------------------------------
+bool trace_recorder::wait(const std::string &path, time_point deadline) {
+    return _s->target->wait(path, deadline);
+}
+
+//-----------------------------------------------------------------------------
+attr_backend::time_point trace_recorder::now() {
+    return _s->target->now();
+}
+
+//-----------------------------------------------------------------------------
+class trace_replay::state {
+    public:
+        // The values of an attribute (or directory) in the order they were
+        // read, and the next one to answer with.
+        struct history {
+            std::vector<long long>   times;
+            std::vector<std::string> values;
+            size_t                   next;
+        };
+
+        mutable std::mutex lock;
+
+        std::unordered_map<std::string, history> reads, lists;
+        std::vector<entry> recorded, written;
+
+        long long now = 0;
+        long long end = 0;
+        bool finished = false;
+
+        history& find(const std::string &path) {
+            auto h = reads.find(path);
+            if (h == reads.end())
+                throw std::system_error(std::make_error_code(std::errc::no_such_device), path);
+            return h->second;
+        }
+
+        // Drops the values that lie behind the clock.
+        void skip(history &h) {
+            while (h.next < h.times.size() && h.times[h.next] < now) ++h.next;
+        }
+
+        const std::string& take(history &h) {
+            skip(h);
+
+            if (h.next < h.times.size()) {
+                now = std::max(now, h.times[h.next]);
+                return h.values[h.next++];
+            }
+
+            if (now >= end) {
+                finished = true;
+                throw end_of_trace();
+            }
+
+            return h.values.back();
+        }
+};
+
+//-----------------------------------------------------------------------------
+trace_replay::trace_replay(const std::string &path) : _s(new state) {
+    using namespace std;
+
+    ifstream is(path);
+    if (!is)
+        throw system_error(make_error_code(errc::no_such_file_or_directory), path);
+
+    string line;
+    while (getline(is, line)) {
+        // <time> <op> <path> <value>
+        const size_t a = line.find(' ');
+        if (a == string::npos || a + 3 > line.size() || line[a + 2] != ' ')
+            throw system_error(make_error_code(errc::invalid_argument), path);
+
+        const size_t b = line.find(' ', a + 3);
+
+        const long long t  = atoll(line.c_str());
+        const char      op = line[a + 1];
+        const string    p  = line.substr(a + 3, b == string::npos ? string::npos : b - a - 3);
+        string          v  = b == string::npos ? string() : unescape_trace(line.substr(b + 1));
+
+        _s->end = max(_s->end, t);
+
+        if (op == 'w') {
+            if (!v.empty() && v.back() == '\n') v.pop_back();
+            _s->recorded.push_back(entry{chrono::nanoseconds(t), p, v});
+            continue;
+        }
+
+        state::history &h = (op == 'l' ? _s->lists : _s->reads)[p];
+        h.times.push_back(t);
+        h.values.push_back(v);
+        h.next = 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+trace_replay::~trace_replay() {
+}
+
+//-----------------------------------------------------------------------------
+std::vector<std::string> trace_replay::list(const std::string &dir) {
+    using namespace std;
+
+    lock_guard<mutex> lock(_s->lock);
+
+    auto h = _s->lists.find(dir);
+    if (h == _s->lists.end()) return {};
+
+    istringstream is(_s->take(h->second));
+    vector<string> names;
+    for(string name; is >> name; ) names.push_back(name);
+    return names;
+}
+
+//-----------------------------------------------------------------------------
+size_t trace_replay::read(const std::string &path, char *buf, size_t size) {
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    const std::string &v = _s->take(_s->find(path));
+    const size_t n = std::min(size, v.size());
+    std::copy_n(v.data(), n, buf);
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+void trace_replay::write(const std::string &path, const char *buf, size_t size) {
+    std::lock_guard<std::mutex> lock(_s->lock);
+
+    if (size && buf[size - 1] == '\n') --size;
+    _s->written.push_back(entry{std::chrono::nanoseconds(_s->now), path, std::string(buf, size)});
+}
+
+//-----------------------------------------------------------------------------
+bool trace_replay::wait(const std::string &path, time_point deadline) {
+    using namespace std;
+
+    lock_guard<mutex> lock(_s->lock);
+
+    state::history &h = _s->find(path);
+    _s->skip(h);
+
+    const long long d = deadline == time_point::max() ? LLONG_MAX :
+        chrono::duration_cast<chrono::nanoseconds>(deadline.time_since_epoch()).count();
+
+    if (h.next < h.times.size() && h.times[h.next] <= d) {
+        _s->now = max(_s->now, h.times[h.next]);
+        return true;
+    }
+
+    if (d > _s->end) {
+        _s->finished = true;
+        throw end_of_trace();
+    }
+
+    _s->now = max(_s->now, d);
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+attr_backend::time_point trace_replay::now() {
+    std::lock_guard<std::mutex> lock(_s->lock);
+    return time_point(std::chrono::duration_cast<time_point::duration>(
+                std::chrono::nanoseconds(_s->now)));
+}
+
+//-----------------------------------------------------------------------------
+std::vector<trace_replay::entry> trace_replay::recorded_writes() const {
+    std::lock_guard<std::mutex> lock(_s->lock);
+    return _s->recorded;
+}
+
+//-----------------------------------------------------------------------------
+std::vector<trace_replay::entry> trace_replay::writes() const {
+    std::lock_guard<std::mutex> lock(_s->lock);
+    return _s->written;
+}
+
+//-----------------------------------------------------------------------------
+bool trace_replay::finished() const {
+    std::lock_guard<std::mutex> lock(_s->lock);
+    return _s->finished;
+}
+
+//-----------------------------------------------------------------------------
+motor_simulator::model motor_simulator::lego_ev3_l_motor() {
+    model m = { "lego-ev3-l-motor", 360, 1050, 0.1, 6 };
+    return m;
+}
+
+//-----------------------------------------------------------------------------
+motor_simulator::model motor_simulator::lego_ev3_m_motor() {
+    model m = { "lego-ev3-m-motor", 360, 1560, 0.05, 4 };
+    return m;
+}
+
+//-----------------------------------------------------------------------------
+class motor_simulator::sim {
+    public:
+        struct tacho {
+            std::string path;
+            model       m;
+            double      load = 0;
+
+            // The setpoints in effect, in the direction of the motor. The
+            // duty cycle of run-direct and the polarity apply at once, the
+            // others with the next command, as in the kernel.
+            enum { idle, forever, timed, to_pos, direct } mode = idle;
+            double polarity    = 1;
+            double duty_sp     = 0;
+            double speed_sp    = 0;
+            double position_sp = 0;
+            double ramp_up     = 0; // in seconds from 0 to max_speed
+            double ramp_down   = 0;
+            bool   holding     = false;
+            bool   braking     = false;
+            std::chrono::nanoseconds end = std::chrono::nanoseconds(0); // of run-timed
+
+            // The regulation.
+            double kp = 0, ki = 0, kd = 0;
+            double ramped     = 0; // the speed setpoint after the ramps
+            double integral   = 0;
+            double last_error = 0;
+            std::chrono::nanoseconds stalled = std::chrono::nanoseconds(0);
+
+            // The physics.
+            double duty     = 0;
+            double speed    = 0; // in counts/s
+            double position = 0; // in counts
+
+            // What the attributes that change by themselves were set to.
+            int         shown_position = 0;
+            int         shown_speed    = 0;
+            int         shown_duty     = 0;
+            std::string shown_state;
+        };
+
+        sim(memory_backend &mem, std::chrono::microseconds step)
+            : mem(mem), step(step), dt(std::chrono::duration<double>(step).count()) {}
+
+        memory_backend          &mem;
+        std::mutex               lock;
+        std::condition_variable  wrote; // a motor attribute was written
+        std::chrono::nanoseconds step;
+        double                   dt;   // the step in seconds
+        std::chrono::nanoseconds clock = std::chrono::nanoseconds(0);
+        std::chrono::nanoseconds quiet = std::chrono::nanoseconds(0); // since the last change
+        std::deque<tacho>        motors;
+
+        static std::map<std::string, std::string> defaults(const model &m) {
+            return {
+                {"command",       ""},
+                {"commands",      "run-forever run-to-abs-pos run-to-rel-pos run-timed run-direct stop reset"},
+                {"count_per_rot", std::to_string(m.count_per_rot)},
+                {"driver_name",   m.driver_name},
+                {"duty_cycle",    "0"},
+                {"duty_cycle_sp", "0"},
+                {"hold_pid/Kd",   "0"},
+                {"hold_pid/Ki",   "0"},
+                {"hold_pid/Kp",   "20000"},
+                {"max_speed",     std::to_string(m.max_speed)},
+                {"polarity",      "normal"},
+                {"position",      "0"},
+                {"position_sp",   "0"},
+                {"ramp_down_sp",  "0"},
+                {"ramp_up_sp",    "0"},
+                {"speed",         "0"},
+                {"speed_pid/Kd",  "0"},
+                {"speed_pid/Ki",  "60"},
+                {"speed_pid/Kp",  "1000"},
+                {"speed_sp",      "0"},
+                {"state",         ""},
+                {"stop_action",   "coast"},
+                {"stop_actions",  "coast brake hold"},
+                {"time_sp",       "0"}
+            };
+        }
+
+        tacho* find(const std::string &path) {
+            for(auto &t : motors)
+                if (path.compare(0, t.path.size(), t.path) == 0) return &t;
+            return nullptr;
+        }
+
+        int get_int(const std::string &path) const {
+            const std::string v = mem.get(path);
+
+            int result;
+            if (!parse_int(v.data(), v.data() + v.size(), result))
+                throw std::system_error(std::make_error_code(std::errc::invalid_argument), path);
+            return result;
+        }
+
+        // Takes up a write to the attribute `attr` of the motor.
+        void written(tacho &t, const std::string &attr, const std::string &value) {
+            if (attr == "command") {
+                // The driver updates the state before the write returns.
+                command(t, value);
+                publish(t, state(t, false));
+            } else if (attr == "duty_cycle_sp") {
+                t.duty_sp = get_int(t.path + attr);
+            } else if (attr == "polarity") {
+                t.polarity = value == "inversed" ? -1 : 1;
+            } else if (attr == "position") {
+                t.position = t.polarity * get_int(t.path + attr);
+                t.shown_position = get_int(t.path + attr);
+            }
+        }
+
+        void command(tacho &t, const std::string &c) {
+            if (c == "stop")  { stop(t);  return; }
+            if (c == "reset") { reset(t); return; }
+
+            t.holding = t.braking = false;
+            if (t.mode == tacho::idle) {
+                t.ramped     = t.speed;
+                t.integral   = 0;
+                t.last_error = 0;
+            }
+
+            if (c == "run-direct") {
+                t.mode = tacho::direct;
+                return;
+            }
+
+            set_gains(t, "speed_pid/");
+            t.speed_sp  = t.polarity * get_int(t.path + "speed_sp");
+            t.ramp_up   = get_int(t.path + "ramp_up_sp")   / 1000.0;
+            t.ramp_down = get_int(t.path + "ramp_down_sp") / 1000.0;
+
+            if (c == "run-forever") {
+                t.mode = tacho::forever;
+            } else if (c == "run-timed") {
+                t.mode = tacho::timed;
+                t.end  = clock + std::chrono::milliseconds(get_int(t.path + "time_sp"));
+            } else {
+                // The sign of speed_sp does not matter here.
+                const double sp = t.polarity * get_int(t.path + "position_sp");
+                t.position_sp = c == "run-to-abs-pos" ? sp : t.position + sp;
+                t.speed_sp    = t.position_sp < t.position ? -fabs(t.speed_sp) : fabs(t.speed_sp);
+                t.mode        = tacho::to_pos;
+            }
+        }
+
+        void stop(tacho &t) {
+            const std::string action = mem.get(t.path + "stop_action");
+
+            t.holding    = action == "hold";
+            t.braking    = action == "brake";
+            t.integral   = 0;
+            t.last_error = 0;
+
+            // Motions to a position hold at that position, others where
+            // they stopped.
+            if (t.holding) {
+                if (t.mode != tacho::to_pos) t.position_sp = t.position;
+                set_gains(t, "hold_pid/");
+            }
+
+            t.mode = tacho::idle;
+        }
+
+        // Stops the motor and sets all attributes to their defaults. It
+        // keeps turning until friction stops it.
+        void reset(tacho &t) {
+            for(const auto &a : defaults(t.m))
+                mem.set(t.path + a.first, a.second);
+
+            t.mode     = tacho::idle;
+            t.holding  = t.braking = false;
+            t.polarity = 1;
+            t.duty_sp  = 0;
+            t.position = 0;
+            t.duty     = 0;
+
+            t.shown_position = t.shown_speed = t.shown_duty = 0;
+            t.shown_state.clear();
+        }
+
+        void set_gains(tacho &t, const char *pid) {
+            t.kp = get_int(t.path + pid + "Kp");
+            t.ki = get_int(t.path + pid + "Ki");
+            t.kd = get_int(t.path + pid + "Kd");
+        }
+
+        // The PID loop of the kernel driver, which runs every 2 ms and
+        // divides its output by 10000. Returns the duty cycle.
+        double regulate(tacho &t, double error) {
+            const double ticks      = dt / 0.002;
+            const double integral   = t.integral + error * ticks;
+            const double derivative = (error - t.last_error) / ticks;
+            t.last_error = error;
+
+            const double duty = (t.kp * error + t.ki * integral + t.kd * derivative) / 10000;
+            if (fabs(duty) <= 100) {
+                t.integral = integral;
+                return duty;
+            }
+
+            // The integral stops growing while the output saturates.
+            return copysign(100.0, duty);
+        }
+
+        // Moves the motor on by a step. Returns whether its attributes changed.
+        bool advance(tacho &t) {
+            const double max = t.m.max_speed;
+
+            if ((t.mode == tacho::timed  && clock >= t.end) ||
+                (t.mode == tacho::to_pos && (t.position_sp - t.position) * t.speed_sp <= 0))
+                stop(t);
+
+            bool ramping = false;
+            if (t.mode == tacho::direct) {
+                t.duty = t.polarity * t.duty_sp;
+            } else if (t.mode != tacho::idle) {
+                double target = t.speed_sp;
+
+                // Slows down in time to stop at the position, at the rate of
+                // the ramp or else as fast as the motor can.
+                if (t.mode == tacho::to_pos) {
+                    const double decel = max / (t.ramp_down > 0 ? t.ramp_down : t.m.time_constant);
+                    const double limit = sqrt(2 * decel * fabs(t.position_sp - t.position));
+                    if (limit < fabs(target)) target = copysign(limit, target);
+                }
+
+                const bool   up    = fabs(target) > fabs(t.ramped) && target * t.ramped >= 0;
+                const double ramp  = up ? t.ramp_up : t.ramp_down;
+                const double delta = ramp > 0 ? max / ramp * dt : HUGE_VAL;
+
+                ramping  = fabs(target - t.ramped) > delta;
+                t.ramped = ramping ? t.ramped + copysign(delta, target - t.ramped) : target;
+                t.duty   = regulate(t, t.ramped - t.speed);
+            } else if (t.holding) {
+                t.duty = regulate(t, t.position_sp - t.position);
+            } else {
+                t.duty = 0;
+            }
+
+            // The duty cycle drives the speed towards the no-load speed it
+            // stands for, less the friction and the load. Braking shorts the
+            // windings, which slows the motor down faster.
+            const double drive  = t.duty / 100 * max;
+            const double resist = (t.m.friction + t.load) / 100 * max;
+
+            if (t.speed != 0 || fabs(drive) > resist) {
+                const double dir    = copysign(1.0, t.speed != 0 ? t.speed : drive);
+                const double target = drive - dir * resist;
+                const double tau    = t.braking ? t.m.time_constant / 5 : t.m.time_constant;
+
+                double speed = t.speed + (target - t.speed) * (1 - exp(-dt / tau));
+
+                // Friction stops the motor, it does not turn it around.
+                if (speed * dir < 0) speed = 0;
+
+                t.position += (t.speed + speed) / 2 * dt;
+                t.speed     = speed;
+            }
+
+            if (t.mode != tacho::idle && fabs(t.duty) > t.m.friction && fabs(t.speed) < max / 100)
+                t.stalled += step;
+            else
+                t.stalled = std::chrono::nanoseconds(0);
+
+            return publish(t, state(t, ramping));
+        }
+
+        static std::string state(const tacho &t, bool ramping) {
+            const bool regulated = (t.mode != tacho::idle && t.mode != tacho::direct) || t.holding;
+
+            std::string s;
+            if (t.mode != tacho::idle)                       s += "running ";
+            if (ramping)                                     s += "ramping ";
+            if (t.holding)                                   s += "holding ";
+            if (regulated && fabs(t.duty) >= 100)            s += "overloaded ";
+            if (t.mode != tacho::idle &&
+                t.stalled >= std::chrono::milliseconds(100)) s += "stalled ";
+            if (!s.empty()) s.pop_back();
+
+            return s;
+        }
+
+        bool publish(tacho &t, const std::string &state) {
+            const int position = static_cast<int>(lround(t.polarity * t.position));
+            const int speed    = static_cast<int>(lround(t.polarity * t.speed));
+            const int duty     = static_cast<int>(lround(t.polarity * t.duty));
+
+            bool changed = false;
+            if (position != t.shown_position) {
+                mem.set(t.path + "position", std::to_string(position));
+                t.shown_position = position;
+                changed = true;
+            }
+            if (speed != t.shown_speed) {
+                mem.set(t.path + "speed", std::to_string(speed));
+                t.shown_speed = speed;
+                changed = true;
+            }
+            if (duty != t.shown_duty) {
+                mem.set(t.path + "duty_cycle", std::to_string(duty));
+                t.shown_duty = duty;
+                changed = true;
+            }
+            if (state != t.shown_state) {
+                mem.set(t.path + "state", state);
+                t.shown_state = state;
+                changed = true;
+            }
+            return changed;
+        }
+
+        void advance_all() {
+            clock += step;
+
+            bool changed = false;
+            for(auto &t : motors)
+                changed = advance(t) || changed || t.mode != tacho::idle;
+
+            quiet = changed ? std::chrono::nanoseconds(0) : quiet + step;
+        }
+};
+
+//-----------------------------------------------------------------------------
+motor_simulator::motor_simulator(std::chrono::microseconds step)
+    : _sim(new sim(*this, step))
+{
+    if (step.count() <= 0)
+        throw std::system_error(std::make_error_code(std::errc::invalid_argument), "step");
+}
+
+//-----------------------------------------------------------------------------
+motor_simulator::~motor_simulator() {}
+
+//-----------------------------------------------------------------------------
+std::string motor_simulator::add_motor(const std::string &address, const model &m) {
+    std::lock_guard<std::mutex> lock(_sim->lock);
+
+    auto attrs = sim::defaults(m);
+    attrs["address"] = address;
+
+    sim::tacho t;
+    t.m    = m;
+    t.path = add_device("tacho-motor", "motor" + std::to_string(_sim->motors.size()), attrs);
+    _sim->motors.push_back(t);
+
+    return t.path;
+}
+
+//-----------------------------------------------------------------------------
+void motor_simulator::set_load(const std::string &path, double load) {
+    std::lock_guard<std::mutex> lock(_sim->lock);
+
+    sim::tacho *t = _sim->find(path);
+    if (!t)
+        throw std::system_error(std::make_error_code(std::errc::no_such_device), path);
+
+    t->load = load;
+}
+
+//-----------------------------------------------------------------------------
+void motor_simulator::sleep_for(std::chrono::nanoseconds d) {
+    std::unique_lock<std::mutex> lock(_sim->lock);
+
+    for(const auto end = _sim->clock + d; _sim->clock < end; ) {
+        _sim->advance_all();
+
+        // Let other threads in between the steps.
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
+
+//-----------------------------------------------------------------------------
+void motor_simulator::write(const std::string &path, const char *buf, size_t size) {
+    std::lock_guard<std::mutex> lock(_sim->lock);
+
+    sim::tacho *t = _sim->find(path);
+    if (!t) {
+        memory_backend::write(path, buf, size);
+        return;
+    }
+
+    // Values the driver would reject.
+    const std::string attr  = path.substr(t->path.size());
+    const std::string value = parse_token(buf, buf + size);
+
+    int v = 0;
+    const bool number = parse_int(buf, buf + size, v);
+
+    if ((attr == "command" &&
+            value != "run-forever" && value != "run-to-abs-pos" && value != "run-to-rel-pos" &&
+            value != "run-timed" && value != "run-direct" && value != "stop" && value != "reset") ||
+        (attr == "duty_cycle_sp" && (!number || v < -100 || v > 100)) ||
+        (attr == "speed_sp" && (!number || abs(v) > t->m.max_speed)) ||
+        (attr == "stop_action" && value != "coast" && value != "brake" && value != "hold") ||
+        (attr == "polarity" && value != "normal" && value != "inversed"))
+        throw std::system_error(std::make_error_code(std::errc::invalid_argument), path);
+
+    memory_backend::write(path, buf, size);
+    _sim->written(*t, attr, value);
+
+    _sim->quiet = std::chrono::nanoseconds(0);
+    _sim->wrote.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+bool motor_simulator::wait(const std::string &path, time_point deadline) {
+    std::unique_lock<std::mutex> lock(_sim->lock);
+
+    const std::string before = get(path);
+    const auto active = [this]() { return _sim->quiet < std::chrono::seconds(1); };
+
+    while (time_point(std::chrono::duration_cast<time_point::duration>(_sim->clock)) < deadline) {
+        // Before calling it a deadlock, give other threads a moment of real
+        // time to command the motors.
+        if (deadline == time_point::max() && !active() &&
+                !_sim->wrote.wait_for(lock, std::chrono::milliseconds(100), active))
+            throw std::system_error(std::make_error_code(std::errc::resource_deadlock_would_occur), path);
+
+        _sim->advance_all();
+        if (get(path) != before) return true;
+
+        // Let other threads in between the steps.
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+
+    return false;
+}
 
-    return { "none" };
+//-----------------------------------------------------------------------------
+attr_backend::time_point motor_simulator::now() {
+    std::lock_guard<std::mutex> lock(_sim->lock);
+    return time_point(std::chrono::duration_cast<time_point::duration>(_sim->clock));
 }
 
 //-----------------------------------------------------------------------------
@@ -431,8 +2775,14 @@ bool sensor::connect(const std::map<std::string, std::set<std::string>> &match)
     static const std::string _strClassDir { SYS_ROOT "/lego-sensor/" };
     static const std::string _strPattern  { "sensor" };
 
+    _mode_descs.clear();
+    _mode_desc = -1;
+
     try {
         if (device::connect(_strClassDir, _strPattern, match)) {
+            // Describe the current mode up front, so that the getters only
+            // read the descriptors. Failing that, the first getter tries again.
+            try { mode_desc(); } catch (...) { }
             return true;
         }
     } catch (...) { }
@@ -442,6 +2792,112 @@ bool sensor::connect(const std::map<std::string, std::set<std::string>> &match)
     return false;
 }
 
+//-----------------------------------------------------------------------------
+sensor& sensor::set_mode(std::string v) {
+    set_attr_string(attr_mode, v);
+
+    const unsigned epoch = mode_epoch().fetch_add(1, std::memory_order_acq_rel) + 1;
+    if (!_pin.mode.empty() && _pin.mode == v)
+        _pin.epoch = epoch;
+
+    _mode_desc = -1;
+    for(size_t i = 0; i < _mode_descs.size(); ++i) {
+        if (_mode_descs[i].mode == v) {
+            _mode_desc = i;
+            return *this;
+        }
+    }
+
+    _mode_desc = load_mode_desc(v);
+    return *this;
+}
+
+//-----------------------------------------------------------------------------
+std::atomic<unsigned>& sensor::mode_epoch() const {
+    return sensor_mode_epochs[device_index() % 64];
+}
+
+//-----------------------------------------------------------------------------
+void sensor::require_mode(const char *mode, bool rewrite) {
+    using namespace std;
+
+    if (!_pin.mode.empty() && _pin.mode != mode)
+        throw system_error(make_error_code(errc::device_or_resource_busy), _path + "mode");
+
+    // A repeated write must not be skipped by the shadow.
+    if (rewrite) invalidate_shadow();
+
+    if (_pin.mode.empty() || rewrite) {
+        set_mode(mode);
+        return;
+    }
+
+    // Somebody else changed the mode since it was pinned. The shadow still
+    // holds the pinned mode, so it must not skip the write.
+    if (mode_epoch().load(memory_order_acquire) != _pin.epoch) {
+        invalidate_shadow();
+        set_mode(_pin.mode);
+    }
+}
+
+//-----------------------------------------------------------------------------
+sensor::mode_lock::mode_lock(sensor &s, std::string mode) : _sensor(s) {
+    _outer.swap(s._pin.mode);
+    s._pin.mode = mode;
+
+    try {
+        s.set_mode(mode);
+    } catch(...) {
+        s._pin.mode.swap(_outer);
+        throw;
+    }
+}
+
+sensor::mode_lock::~mode_lock() {
+    if (_sensor._pin.mode != _outer) {
+        // Let the next read of the outer mode restore it.
+        _sensor._pin.epoch = _sensor.mode_epoch().load(std::memory_order_acquire) - 1;
+    }
+    _sensor._pin.mode.swap(_outer);
+}
+
+//-----------------------------------------------------------------------------
+const sensor::mode_descriptor& sensor::mode_desc() const {
+    if (_mode_desc < 0)
+        _mode_desc = load_mode_desc(get_attr_line(attr_mode));
+
+    return _mode_descs[_mode_desc];
+}
+
+//-----------------------------------------------------------------------------
+size_t sensor::load_mode_desc(const std::string &mode) const {
+    using namespace std;
+
+    static const map<string, size_t> value_sizes {
+        {"u8",     1},
+        {"s8",     1},
+        {"u16",    2},
+        {"s16",    2},
+        {"s16_be", 2},
+        {"s32",    4},
+        {"float",  4}
+    };
+
+    mode_descriptor d;
+    d.mode            = mode;
+    d.decimals        = get_attr_int("decimals");
+    d.num_values      = get_attr_int("num_values");
+    d.bin_data_format = get_attr_string("bin_data_format");
+    d.units           = get_attr_string("units");
+    d.scale           = powf(10, -d.decimals);
+
+    auto s = value_sizes.find(d.bin_data_format);
+    d.value_size = s != value_sizes.end() ? s->second : 1;
+
+    _mode_descs.push_back(move(d));
+    return _mode_descs.size() - 1;
+}
+
 //-----------------------------------------------------------------------------
 std::string sensor::type_name() const {
     auto type = driver_name();
@@ -472,18 +2928,110 @@ std::string sensor::type_name() const {
 
 //-----------------------------------------------------------------------------
 int sensor::value(unsigned index) const {
-    if (static_cast<int>(index) >= num_values())
+    if (static_cast<int>(index) >= mode_desc().num_values)
         throw std::invalid_argument("index");
 
+    if (index < 8)
+        return get_attr_int(static_cast<attr_slot>(attr_value0 + index));
+
     char svalue[7] = "value0";
     svalue[5] += index;
 
     return get_attr_int(svalue);
 }
 
+//-----------------------------------------------------------------------------
+sensor::sample sensor::snapshot(unsigned count, bool with_mode) const {
+    attr_request reads[9];
+    const size_t n = sample_reads(count, with_mode, reads);
+
+    sample s;
+    s.timestamp = read_attrs(reads, n);
+    parse_sample(reads, count, with_mode, s);
+    return s;
+}
+
+//-----------------------------------------------------------------------------
+size_t sensor::sample_reads(unsigned count, bool with_mode, attr_request *reads) const {
+    if (count > 8)
+        throw std::invalid_argument("count");
+
+    size_t n = 0;
+
+    for(unsigned i = 0; i < count; ++i)
+        reads[n++].slot = static_cast<attr_slot>(attr_value0 + i);
+
+    if (with_mode)
+        reads[n++].slot = attr_mode;
+
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+void sensor::parse_sample(const attr_request *reads, unsigned count, bool with_mode, sample &s) const {
+    using namespace std;
+
+    s.num_values = count;
+
+    for(unsigned i = 0; i < count; ++i) {
+        const attr_request &r = reads[i];
+        if (!parse_int(r.data, r.data + r.size, s.values[i]))
+            throw system_error(make_error_code(errc::invalid_argument), _path + attr_slot_names[r.slot]);
+    }
+
+    if (with_mode) {
+        const attr_request &r = reads[count];
+        s.mode = parse_line(r.data, r.data + r.size);
+    }
+}
+
+//-----------------------------------------------------------------------------
+bool sensor::wait_value_change(
+        int &value, unsigned index, std::chrono::milliseconds timeout) const
+{
+    using namespace std;
+
+    if (index >= 8 || static_cast<int>(index) >= mode_desc().num_values)
+        throw invalid_argument("index");
+
+    const attr_slot slot = static_cast<attr_slot>(attr_value0 + index);
+    const int last = value;
+
+    return wait_attr(slot, [&](const char *data, size_t size) {
+            if (!parse_int(data, data + size, value))
+                throw system_error(make_error_code(errc::invalid_argument), _path + attr_slot_names[slot]);
+            return value != last;
+            }, timeout);
+}
+
 //-----------------------------------------------------------------------------
 float sensor::float_value(unsigned index) const {
-    return value(index) * powf(10, -decimals());
+    return value(index) * mode_desc().scale;
+}
+
+//-----------------------------------------------------------------------------
+std::future<int> sensor::async_value(unsigned index) const {
+    if (static_cast<int>(index) >= mode_desc().num_values)
+        throw std::invalid_argument("index");
+
+    char svalue[7] = "value0";
+    svalue[5] += index;
+
+    return async_get_attr_int(svalue);
+}
+
+//-----------------------------------------------------------------------------
+std::future<float> sensor::async_float_value(unsigned index) const {
+    if (static_cast<int>(index) >= mode_desc().num_values)
+        throw std::invalid_argument("index");
+
+    char svalue[7] = "value0";
+    svalue[5] += index;
+
+    const std::string name = svalue;
+    const float scale = mode_desc().scale;
+
+    return async_call<float>([name, scale](device &d) { return d.get_attr_int(name) * scale; });
 }
 
 //-----------------------------------------------------------------------------
@@ -493,27 +3041,11 @@ const std::vector<char>& sensor::bin_data() const {
     if (_path.empty())
         throw system_error(make_error_code(errc::function_not_supported), "no device connected");
 
-    if (_bin_data.empty()) {
-        static const map<string, int> lookup_table {
-            {"u8",     1},
-            {"s8",     1},
-            {"u16",    2},
-            {"s16",    2},
-            {"s16_be", 2},
-            {"s32",    4},
-            {"float",  4}
-        };
-
-        int value_size = 1;
-
-        auto s = lookup_table.find(bin_data_format());
-        if (s != lookup_table.end())
-            value_size = s->second;
-
-        _bin_data.resize(num_values() * value_size);
-    }
+    const mode_descriptor &d = mode_desc();
+    _bin_data.resize(d.num_values * d.value_size);
 
     const string fname = _path + "bin_data";
+#if defined(EV3DEV_ATTR_IO_FSTREAM)
     ifstream &is = ifstream_open(fname);
     if (is.is_open()) {
         is.read(_bin_data.data(), _bin_data.size());
@@ -521,6 +3053,10 @@ const std::vector<char>& sensor::bin_data() const {
     }
 
     throw system_error(make_error_code(errc::no_such_device), fname);
+#else
+    attr_read(fname, _bin_data.data(), _bin_data.size());
+    return _bin_data;
+#endif
 }
 
 //-----------------------------------------------------------------------------
@@ -617,76 +3153,553 @@ sound_sensor::sound_sensor(address_type address)
 }
 
 //-----------------------------------------------------------------------------
-char light_sensor::mode_reflect[] = "REFLECT";
-char light_sensor::mode_ambient[] = "AMBIENT";
+char light_sensor::mode_reflect[] = "REFLECT";
+char light_sensor::mode_ambient[] = "AMBIENT";
+
+light_sensor::light_sensor(address_type address)
+    : sensor(address, { nxt_light })
+{ }
+
+//-----------------------------------------------------------------------------
+char motor::motor_large[] = "lego-ev3-l-motor";
+char motor::motor_medium[] = "lego-ev3-m-motor";
+char motor::motor_nxt[] = "lego-nxt-motor";
+char motor::command_run_forever[] = "run-forever";
+char motor::command_run_to_abs_pos[] = "run-to-abs-pos";
+char motor::command_run_to_rel_pos[] = "run-to-rel-pos";
+char motor::command_run_timed[] = "run-timed";
+char motor::command_run_direct[] = "run-direct";
+char motor::command_stop[] = "stop";
+char motor::command_reset[] = "reset";
+char motor::encoder_polarity_normal[] = "normal";
+char motor::encoder_polarity_inversed[] = "inversed";
+char motor::polarity_normal[] = "normal";
+char motor::polarity_inversed[] = "inversed";
+char motor::state_running[] = "running";
+char motor::state_ramping[] = "ramping";
+char motor::state_holding[] = "holding";
+char motor::state_overloaded[] = "overloaded";
+char motor::state_stalled[] = "stalled";
+char motor::stop_action_coast[] = "coast";
+char motor::stop_action_brake[] = "brake";
+char motor::stop_action_hold[] = "hold";
+
+//-----------------------------------------------------------------------------
+motor::motor(address_type address) {
+    connect({{ "address", { address } }});
+}
+
+//-----------------------------------------------------------------------------
+motor::motor(address_type address, const motor_type &t) {
+    connect({{ "address", { address } }, { "driver_name", { t }}});
+}
+
+//-----------------------------------------------------------------------------
+bool motor::connect(const std::map<std::string, std::set<std::string>> &match) noexcept
+{
+    static const std::string _strClassDir { SYS_ROOT "/tacho-motor/" };
+    static const std::string _strPattern  { "motor" };
+
+    try {
+        return device::connect(_strClassDir, _strPattern, match);
+    } catch (...) { }
+
+    _path.clear();
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+bool motor::wait_state_change(mode_set &state, std::chrono::milliseconds timeout) const {
+    return wait_attr(attr_state, [&](const char *data, size_t size) {
+            mode_set current = parse_set(parse_line(data, data + size), nullptr);
+            if (current == state) return false;
+            state.swap(current);
+            return true;
+            }, timeout);
+}
+
+//-----------------------------------------------------------------------------
+void token_set::assign(const char *s, const char *end) {
+    clear();
+
+    while (s != end) {
+        while (s != end && isspace(static_cast<unsigned char>(*s))) ++s;
+
+        const char *e = s;
+        while (e != end && !isspace(static_cast<unsigned char>(*e))) ++e;
+
+        if (s != e) {
+            const char *b = s, *t = e;
+            if (*b == '[' && t - b >= 2 && t[-1] == ']') {
+                ++b;
+                --t;
+                _selected = static_cast<int>(_text.size());
+            }
+
+            _tokens.push_back(static_cast<unsigned short>(_text.size()));
+            _text.append(b, t);
+            _text.push_back('\0');
+        }
+
+        s = e;
+    }
+
+    const char *text = _text.data();
+    std::sort(_tokens.begin(), _tokens.end(), [text](unsigned short a, unsigned short b) {
+            return strcmp(text + a, text + b) < 0;
+            });
+}
+
+//-----------------------------------------------------------------------------
+size_t token_set::count(const char *token) const {
+    const char *text = _text.data();
+    auto i = std::lower_bound(_tokens.begin(), _tokens.end(), token,
+            [text](unsigned short o, const char *t) { return strcmp(text + o, t) < 0; });
+    return i != _tokens.end() && strcmp(text + *i, token) == 0 ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+bool token_set::operator==(const token_set &s) const {
+    if (size() != s.size()) return false;
+
+    for(auto a = begin(), b = s.begin(); a != end(); ++a, ++b)
+        if (strcmp(*a, *b) != 0) return false;
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+bool token_set::operator==(const mode_set &s) const {
+    if (size() != s.size()) return false;
+
+    auto b = s.begin();
+    for(auto a = begin(); a != end(); ++a, ++b)
+        if (*b != *a) return false;
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+motor_state motor_state::parse(const char *s, const char *end) {
+    unsigned bits = 0;
+
+    while (s != end) {
+        while (s != end && isspace(static_cast<unsigned char>(*s))) ++s;
+
+        const char *e = s;
+        while (e != end && !isspace(static_cast<unsigned char>(*e))) ++e;
+
+        for(const auto &f : motor_state_flags) {
+            if (static_cast<size_t>(e - s) == f.size && memcmp(s, f.name, f.size) == 0) {
+                bits |= f.bit;
+                break;
+            }
+        }
+
+        s = e;
+    }
+
+    return motor_state(bits);
+}
+
+//-----------------------------------------------------------------------------
+size_t motor_state::count(const std::string &flag) const {
+    for(const auto &f : motor_state_flags)
+        if (flag == f.name) return has(f.bit) ? 1 : 0;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+mode_set motor_state::to_set() const {
+    mode_set result;
+    for(const auto &f : motor_state_flags)
+        if (has(f.bit)) result.insert(f.name);
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+bool motor::wait_until(unsigned mask, std::chrono::milliseconds timeout) const {
+    return wait_attr(attr_state, [mask](const char *data, size_t size) {
+            return motor_state::parse(data, data + size).has(mask);
+            }, timeout);
+}
+
+//-----------------------------------------------------------------------------
+bool motor::wait_while(unsigned mask, std::chrono::milliseconds timeout) const {
+    return wait_attr(attr_state, [mask](const char *data, size_t size) {
+            return !motor_state::parse(data, data + size).has(mask);
+            }, timeout);
+}
+
+//-----------------------------------------------------------------------------
+motor::sample motor::snapshot(unsigned fields) const {
+    attr_request reads[4];
+    const size_t n = sample_reads(fields, reads);
+
+    sample s;
+    s.timestamp = read_attrs(reads, n);
+    parse_sample(reads, n, s);
+    return s;
+}
+
+//-----------------------------------------------------------------------------
+size_t motor::sample_reads(unsigned fields, attr_request *reads) const {
+    static const struct {
+        sample_field field;
+        attr_slot    slot;
+    } layout[] = {
+        { sample_position,   attr_position   },
+        { sample_speed,      attr_speed      },
+        { sample_duty_cycle, attr_duty_cycle },
+        { sample_state,      attr_state      }
+    };
+
+    size_t n = 0;
+
+    for(const auto &l : layout)
+        if (fields & l.field) reads[n++].slot = l.slot;
+
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+void motor::parse_sample(const attr_request *reads, size_t count, sample &s) const {
+    using namespace std;
+
+    s.position   = 0;
+    s.speed      = 0;
+    s.duty_cycle = 0;
+    s.state      = motor_state();
+
+    for(size_t i = 0; i < count; ++i) {
+        const attr_request &r = reads[i];
+        const char *end = r.data + r.size;
+
+        bool ok = true;
+        switch (r.slot) {
+            case attr_position:
+                ok = parse_int(r.data, end, s.position);
+                break;
+            case attr_speed:
+                ok = parse_int(r.data, end, s.speed);
+                break;
+            case attr_duty_cycle:
+                ok = parse_int(r.data, end, s.duty_cycle);
+                break;
+            default:
+                s.state = motor_state::parse(r.data, end);
+                break;
+        }
+
+        if (!ok)
+            throw system_error(make_error_code(errc::invalid_argument), _path + attr_slot_names[r.slot]);
+    }
+}
+
+//-----------------------------------------------------------------------------
+medium_motor::medium_motor(address_type address)
+    : motor(address, motor_medium)
+{ }
+
+//-----------------------------------------------------------------------------
+large_motor::large_motor(address_type address)
+    : motor(address, motor_large)
+{ }
+
+//-----------------------------------------------------------------------------
+nxt_motor::nxt_motor(address_type address)
+    : motor(address, motor_nxt)
+{ }
+
+//-----------------------------------------------------------------------------
+size_t sample_group::add(const motor &m, unsigned fields) {
+    device::attr_request reads[4];
+
+    motor_entry e;
+    e.dev    = &m;
+    e.fields = fields;
+    e.first  = _reads.size();
+    e.count  = m.sample_reads(fields, reads);
+
+    _reads.insert(_reads.end(), reads, reads + e.count);
+    _motors.push_back(e);
+    return _motors.size() - 1;
+}
+
+//-----------------------------------------------------------------------------
+size_t sample_group::add(const sensor &s, unsigned count, bool with_mode) {
+    device::attr_request reads[9];
+
+    sensor_entry e;
+    e.dev        = &s;
+    e.num_values = count;
+    e.with_mode  = with_mode;
+    e.first      = _reads.size();
+    e.count      = s.sample_reads(count, with_mode, reads);
+
+    _reads.insert(_reads.end(), reads, reads + e.count);
+    _sensors.push_back(e);
+    return _sensors.size() - 1;
+}
+
+//-----------------------------------------------------------------------------
+std::chrono::steady_clock::time_point sample_group::read() {
+    _batch.clear();
+    for(const auto &e : _motors)
+        _batch.push_back(device::attr_reads{e.dev, &_reads[e.first], e.count});
+    for(const auto &e : _sensors)
+        _batch.push_back(device::attr_reads{e.dev, &_reads[e.first], e.count});
+
+    const auto timestamp = device::read_attrs(_batch.data(), _batch.size());
+
+    for(auto &e : _motors) {
+        e.s.timestamp = timestamp;
+        e.dev->parse_sample(&_reads[e.first], e.count, e.s);
+    }
+
+    for(auto &e : _sensors) {
+        e.s.timestamp = timestamp;
+        e.dev->parse_sample(&_reads[e.first], e.num_values, e.with_mode, e.s);
+    }
+
+    return timestamp;
+}
+
+//-----------------------------------------------------------------------------
+sampler::~sampler() {
+    try {
+        stop();
+    } catch(...) {
+    }
+}
+
+#ifndef __cpp_aligned_new
+//-----------------------------------------------------------------------------
+void* sampler::channel_state::operator new(size_t size) {
+    void *p;
+    if (posix_memalign(&p, alignof(channel_state), size) != 0)
+        throw std::bad_alloc();
+    return p;
+}
 
-light_sensor::light_sensor(address_type address)
-    : sensor(address, { nxt_light })
-{ }
+//-----------------------------------------------------------------------------
+void sampler::channel_state::operator delete(void *p) {
+    free(p);
+}
+#endif
 
 //-----------------------------------------------------------------------------
-char motor::motor_large[] = "lego-ev3-l-motor";
-char motor::motor_medium[] = "lego-ev3-m-motor";
-char motor::motor_nxt[] = "lego-nxt-motor";
-char motor::command_run_forever[] = "run-forever";
-char motor::command_run_to_abs_pos[] = "run-to-abs-pos";
-char motor::command_run_to_rel_pos[] = "run-to-rel-pos";
-char motor::command_run_timed[] = "run-timed";
-char motor::command_run_direct[] = "run-direct";
-char motor::command_stop[] = "stop";
-char motor::command_reset[] = "reset";
-char motor::encoder_polarity_normal[] = "normal";
-char motor::encoder_polarity_inversed[] = "inversed";
-char motor::polarity_normal[] = "normal";
-char motor::polarity_inversed[] = "inversed";
-char motor::state_running[] = "running";
-char motor::state_ramping[] = "ramping";
-char motor::state_holding[] = "holding";
-char motor::state_overloaded[] = "overloaded";
-char motor::state_stalled[] = "stalled";
-char motor::stop_action_coast[] = "coast";
-char motor::stop_action_brake[] = "brake";
-char motor::stop_action_hold[] = "hold";
+size_t sampler::add(const device &d, device::attr_slot slot, std::chrono::microseconds period) {
+    using namespace std;
+
+    if (_thread.joinable())
+        throw logic_error("sampler is running");
+    if (d._path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+    if (period.count() <= 0)
+        throw invalid_argument("period");
+
+    // Channels of the same device share its handles.
+    size_t i = 0;
+    while (i < _devices.size() && _devices[i]->_path != d._path) ++i;
+
+    if (i == _devices.size()) {
+        unique_ptr<device> copy(new device);
+        copy->_path         = d._path;
+        copy->_device_index = d._device_index;
+        _devices.push_back(move(copy));
+    }
+
+    unique_ptr<channel_state> c(new channel_state);
+    c->dev    = i;
+    c->slot   = slot;
+    c->period = period;
+    c->seq    = 0;
+    c->stamp  = 0;
+    c->value  = 0;
+    c->dropped = 0;
+
+    _channels.push_back(move(c));
+    return _channels.size() - 1;
+}
 
 //-----------------------------------------------------------------------------
-motor::motor(address_type address) {
-    connect({{ "address", { address } }});
+size_t sampler::add_value(const sensor &s, unsigned index, std::chrono::microseconds period) {
+    if (index > 7)
+        throw std::invalid_argument("index");
+    return add(s, static_cast<device::attr_slot>(device::attr_value0 + index), period);
 }
 
 //-----------------------------------------------------------------------------
-motor::motor(address_type address, const motor_type &t) {
-    connect({{ "address", { address } }, { "driver_name", { t }}});
+size_t sampler::add_position(const motor &m, std::chrono::microseconds period) {
+    return add(m, device::attr_position, period);
 }
 
 //-----------------------------------------------------------------------------
-bool motor::connect(const std::map<std::string, std::set<std::string>> &match) noexcept
-{
-    static const std::string _strClassDir { SYS_ROOT "/tacho-motor/" };
-    static const std::string _strPattern  { "motor" };
+size_t sampler::add_speed(const motor &m, std::chrono::microseconds period) {
+    return add(m, device::attr_speed, period);
+}
 
-    try {
-        return device::connect(_strClassDir, _strPattern, match);
-    } catch (...) { }
+//-----------------------------------------------------------------------------
+void sampler::start() {
+    using namespace std;
 
-    _path.clear();
+    if (_thread.joinable()) return;
 
-    return false;
+    _wakeup = eventfd(0, EFD_CLOEXEC);
+    if (_wakeup < 0)
+        throw system_error(error_code(errno, system_category()), "eventfd");
+
+    _error = nullptr;
+
+    const auto now = clock::now();
+    for(auto &c : _channels) c->due = now;
+
+    _thread = thread([this]() {
+            try {
+                run();
+            } catch(...) {
+                _error = current_exception();
+            }
+            });
 }
 
 //-----------------------------------------------------------------------------
-medium_motor::medium_motor(address_type address)
-    : motor(address, motor_medium)
-{ }
+void sampler::stop() {
+    if (!_thread.joinable()) return;
+
+    const uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one))) {}
+
+    _thread.join();
+    ::close(_wakeup);
+    _wakeup = -1;
+
+    if (_error) {
+        std::exception_ptr e = _error;
+        _error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
 
 //-----------------------------------------------------------------------------
-large_motor::large_motor(address_type address)
-    : motor(address, motor_large)
-{ }
+void sampler::run() {
+    using namespace std;
+
+    // steady_clock is CLOCK_MONOTONIC, so the due times serve as absolute
+    // expirations of the timer as they are.
+    const int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer < 0)
+        throw system_error(error_code(errno, system_category()), "timerfd_create");
+
+    struct timer_guard {
+        int fd;
+        ~timer_guard() { ::close(fd); }
+    } guard = { timer };
+
+    vector<channel_state*>       due;
+    vector<device::attr_request> reads;
+    vector<device::attr_reads>   batch;
+
+    for(;;) {
+        auto next = clock::time_point::max();
+        for(const auto &c : _channels) next = min(next, c->due);
+
+        if (next != clock::time_point::max()) {
+            const auto ns = chrono::duration_cast<chrono::nanoseconds>(
+                    next.time_since_epoch()).count();
+
+            itimerspec its = {};
+            its.it_value.tv_sec  = ns / 1000000000;
+            its.it_value.tv_nsec = ns % 1000000000;
+            // A zero expiration would disarm the timer.
+            if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+                its.it_value.tv_nsec = 1;
+
+            if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, nullptr) < 0)
+                throw system_error(error_code(errno, system_category()), "timerfd_settime");
+        }
+
+        pollfd p[2] = { { timer, POLLIN, 0 }, { _wakeup, POLLIN, 0 } };
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            throw system_error(error_code(errno, system_category()), "poll");
+        }
+        if (p[1].revents) return;
+
+        if (p[0].revents) {
+            uint64_t expirations;
+            if (read(timer, &expirations, sizeof(expirations))) {}
+        }
+
+        // All the channels that are due are read in one batch.
+        const auto now = clock::now();
+
+        due.clear();
+        for(const auto &c : _channels)
+            if (c->due <= now) due.push_back(c.get());
+        if (due.empty()) continue;
+
+        reads.resize(due.size());
+        batch.clear();
+        for(size_t i = 0; i < due.size(); ++i) {
+            reads[i].slot = due[i]->slot;
+            batch.push_back(device::attr_reads{_devices[due[i]->dev].get(), &reads[i], 1});
+        }
+
+        const auto timestamp = device::read_attrs(batch.data(), batch.size());
+        const long long stamp = chrono::duration_cast<clock::duration>(
+                timestamp.time_since_epoch()).count();
+
+        for(size_t i = 0; i < due.size(); ++i) {
+            channel_state &c = *due[i];
+            const device::attr_request &r = reads[i];
+
+            int value;
+            if (!parse_int(r.data, r.data + r.size, value))
+                throw system_error(make_error_code(errc::invalid_argument),
+                        _devices[c.dev]->_path + attr_slot_names[r.slot]);
+
+            const unsigned seq = c.seq.load(memory_order_relaxed);
+            c.seq.store(seq + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            c.stamp.store(stamp, memory_order_relaxed);
+            c.value.store(value, memory_order_relaxed);
+            c.seq.store(seq + 2, memory_order_release);
+
+            if (!c.ring.push(sample{timestamp, value}))
+                c.dropped.fetch_add(1, memory_order_relaxed);
+
+            // Keep to the period; skip the ticks that were missed.
+            c.due += c.period;
+            if (c.due <= now) c.due = now + c.period;
+        }
+    }
+}
 
 //-----------------------------------------------------------------------------
-nxt_motor::nxt_motor(address_type address)
-    : motor(address, motor_nxt)
-{ }
+bool sampler::latest(size_t channel, sample &s) const {
+    using namespace std;
+
+    const auto &c = *_channels.at(channel);
+
+    for(;;) {
+        const unsigned seq = c.seq.load(memory_order_acquire);
+        if (seq == 0) return false;
+        if (seq & 1) continue;
+
+        const long long stamp = c.stamp.load(memory_order_relaxed);
+        const int       value = c.value.load(memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (c.seq.load(memory_order_relaxed) != seq) continue;
+
+        s.timestamp = clock::time_point(clock::duration(stamp));
+        s.value     = value;
+        return true;
+    }
+}
 
 //-----------------------------------------------------------------------------
 dc_motor::dc_motor(address_type address) {
@@ -863,42 +3876,189 @@ power_supply::power_supply(std::string name) {
 }
 
 //-----------------------------------------------------------------------------
-button::file_descriptor::file_descriptor(const char *path, int flags)
-    : _fd(open(path, flags))
-{ }
+// The input device of the EV3 buttons. It is opened once for all buttons and
+// read as a stream of input_event records, which keeps the key state and
+// the last events. The consumers read the events with cursors of their own:
+// sequence numbers, of which `first` is that of the oldest event kept.
+class button::input_device {
+    public:
+        input_device()
+            : _fd(open(BUTTON_DEVICE, O_RDONLY | O_NONBLOCK | O_CLOEXEC)),
+              _keys((KEY_CNT + bits_per_long - 1) / bits_per_long)
+        {
+#ifndef NO_LINUX_HEADERS
+            if (_fd < 0) return;
+
+            // Stamp the events with the clock of std::chrono::steady_clock.
+            int clock = CLOCK_MONOTONIC;
+            _monotonic = ioctl(_fd, EVIOCSCLOCKID, &clock) == 0;
+
+            ioctl(_fd, EVIOCGKEY(_keys.size() * sizeof(long)), _keys.data());
+#endif
+        }
+
+        ~input_device() {
+            if (_fd >= 0) ::close(_fd);
+        }
+
+        int fd() const { return _fd; }
+
+        std::mutex& mutex() { return _mx; }
+
+        // Reads the pending input events. Must be called with the mutex held.
+        void drain();
+
+        bool key(int code) const {
+            return _keys[code / bits_per_long] & (1ul << (code % bits_per_long));
+        }
+
+        // Takes the event at `cursor` and moves it on. Must be called with
+        // the mutex held. Returns false if there is none.
+        bool next(unsigned long long &cursor, event &e) {
+            if (cursor < first) cursor = first;
+            if (cursor - first >= queue.size()) return false;
+
+            e = queue[cursor++ - first];
+            return true;
+        }
+
+        // The cursor past the last event.
+        unsigned long long end() const { return first + queue.size(); }
+
+    private:
+        static const size_t max_queue = 64;
+
+        void set_key(int code, bool state);
+        void push(int code, event::event_type type,
+                std::chrono::steady_clock::time_point timestamp);
+
+        std::deque<event>  queue;
+        unsigned long long first = 0;
 
-button::file_descriptor::~file_descriptor() {
-    if (_fd != -1) close(_fd);
+        int  _fd;
+        bool _monotonic = false;
+        bool _dropped   = false; // the kernel lost events, skip to SYN_REPORT
+        std::vector<unsigned long> _keys;
+        std::mutex _mx;
+};
+
+void button::input_device::drain() {
+#ifndef NO_LINUX_HEADERS
+    if (_fd < 0) return;
+
+    input_event buf[16];
+    for(;;) {
+        const ssize_t n = read(_fd, buf, sizeof(buf));
+        if (n <= 0) break;
+
+        for(const input_event *ev = buf; ev < buf + n / sizeof(input_event); ++ev) {
+            if (ev->type == EV_SYN) {
+                if (ev->code == SYN_DROPPED) {
+                    _dropped = true;
+                } else if (ev->code == SYN_REPORT && _dropped) {
+                    // Recover from the lost events: report the keys whose
+                    // state differs from what we have seen.
+                    _dropped = false;
+
+                    std::vector<unsigned long> keys(_keys.size());
+                    ioctl(_fd, EVIOCGKEY(keys.size() * sizeof(long)), keys.data());
+
+                    const auto now = std::chrono::steady_clock::now();
+                    for(int code = 0; code < KEY_CNT; ++code) {
+                        const bool state = keys[code / bits_per_long] & (1ul << (code % bits_per_long));
+                        if (state != key(code))
+                            push(code, state ? event::press : event::release, now);
+                    }
+                    _keys.swap(keys);
+                }
+                continue;
+            }
+
+            if (ev->type != EV_KEY || _dropped || ev->code >= KEY_CNT) continue;
+
+#ifdef input_event_sec
+            const long sec = ev->input_event_sec, usec = ev->input_event_usec;
+#else
+            const long sec = ev->time.tv_sec, usec = ev->time.tv_usec;
+#endif
+            const auto timestamp = _monotonic
+                ? std::chrono::steady_clock::time_point(
+                        std::chrono::seconds(sec) + std::chrono::microseconds(usec))
+                : std::chrono::steady_clock::now();
+
+            push(ev->code, static_cast<event::event_type>(ev->value), timestamp);
+        }
+
+        if (static_cast<size_t>(n) < sizeof(buf)) break;
+    }
+#endif
+}
+
+void button::input_device::set_key(int code, bool state) {
+    if (state)
+        _keys[code / bits_per_long] |=  (1ul << (code % bits_per_long));
+    else
+        _keys[code / bits_per_long] &= ~(1ul << (code % bits_per_long));
+}
+
+void button::input_device::push(int code, event::event_type type,
+        std::chrono::steady_clock::time_point timestamp)
+{
+    if (type != event::repeat) set_key(code, type == event::press);
+
+    if (queue.size() == max_queue) {
+        queue.pop_front();
+        ++first;
+    }
+    queue.push_back(event{timestamp, code, type});
 }
 
 //-----------------------------------------------------------------------------
-button::button(int bit)
-    : _bit(bit),
-      _buf((KEY_CNT + bits_per_long - 1) / bits_per_long),
-      _fd( new file_descriptor("/dev/input/by-path/platform-gpio_keys-event", O_RDONLY) )
-{ }
+button::input_device& button::input() {
+    static input_device dev;
+    return dev;
+}
+
+//-----------------------------------------------------------------------------
+button::button(int bit) : _bit(bit) { }
 
 //-----------------------------------------------------------------------------
 bool button::pressed() const {
-#ifndef NO_LINUX_HEADERS
-    if (ioctl(*_fd, EVIOCGKEY(_buf.size()), _buf.data()) < 0) {
-        // handle error
-    }
-#endif
-    return (_buf[_bit / bits_per_long] & 1 << (_bit % bits_per_long));
+    input_device &dev = input();
+    std::lock_guard<std::mutex> lock(dev.mutex());
+
+    dev.drain();
+    return dev.key(_bit);
 }
 
 //-----------------------------------------------------------------------------
 bool button::process() {
-    bool new_state = pressed();
-
-    if (new_state != _state) {
-        _state = new_state;
-        if (onclick) onclick(new_state);
-        return true;
+    // Read the events of this button since the last call and collect every
+    // edge. The callbacks run once the lock is released, so that they may
+    // use the buttons themselves.
+    std::vector<bool> edges;
+    {
+        input_device &dev = input();
+        std::lock_guard<std::mutex> lock(dev.mutex());
+
+        dev.drain();
+
+        event e;
+        while (dev.next(_next, e)) {
+            if (e.code != _bit) continue;
+
+            const bool new_state = e.type != event::release;
+            if (new_state != _state) {
+                _state = new_state;
+                edges.push_back(new_state);
+            }
+        }
     }
 
-    return false;
+    if (onclick)
+        for(bool state : edges) onclick(state);
+
+    return !edges.empty();
 }
 
 //-----------------------------------------------------------------------------
@@ -924,6 +4084,255 @@ bool button::process_all() {
     return std::any_of(changed.begin(), changed.end(), [](bool c){ return c; });
 }
 
+//-----------------------------------------------------------------------------
+bool button::next_event(event &e) {
+    static unsigned long long cursor = 0;
+
+    input_device &dev = input();
+    std::lock_guard<std::mutex> lock(dev.mutex());
+
+    dev.drain();
+    return dev.next(cursor, e);
+}
+
+//-----------------------------------------------------------------------------
+button::event_reader::event_reader() {
+    input_device &dev = input();
+    std::lock_guard<std::mutex> lock(dev.mutex());
+
+    _next = dev.end();
+}
+
+//-----------------------------------------------------------------------------
+bool button::event_reader::next(event &e) {
+    input_device &dev = input();
+    std::lock_guard<std::mutex> lock(dev.mutex());
+
+    dev.drain();
+    return dev.next(_next, e);
+}
+
+//-----------------------------------------------------------------------------
+button_events::button_events() : button_events(timing()) {}
+
+button_events::button_events(const timing &t) : _timing(t), _dropped(0) {
+#ifndef NO_LINUX_HEADERS
+    const int codes[] = { KEY_BACKSPACE, KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_ENTER };
+    for(unsigned k = 0; k < 6; ++k) _keys[k].code = codes[k];
+#endif
+}
+
+button_events::~button_events() {
+    stop();
+}
+
+//-----------------------------------------------------------------------------
+void button_events::emit(event_type type, unsigned buttons, time_point t) {
+    if (!_queue.push(event{t, type, buttons}))
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+    _emitted = true;
+}
+
+//-----------------------------------------------------------------------------
+void button_events::on_press(unsigned k, time_point t) {
+    key_state &key = _keys[k];
+
+    // A press soon after a release means the contact bounced.
+    if (key.release_pending) {
+        key.release_pending = false;
+        return;
+    }
+
+    if (key.down) return;
+
+    key.down       = true;
+    key.pressed    = t;
+    key.long_fired = false;
+    key.in_chord   = false;
+    emit(press, 1u << k, t);
+
+    if (!_chord_open) {
+        _chord_open  = true;
+        _chord_start = t;
+        _chord       = 0;
+    }
+    _chord |= 1u << k;
+}
+
+//-----------------------------------------------------------------------------
+void button_events::on_release(unsigned k, time_point t) {
+    key_state &key = _keys[k];
+    if (!key.down || key.release_pending) return;
+
+    // Reported by expire() once the debounce time has passed.
+    key.release_pending = true;
+    key.released        = t;
+}
+
+//-----------------------------------------------------------------------------
+void button_events::expire(time_point now) {
+    // Handle the timed transitions that are due, in the order of their times.
+    for(;;) {
+        enum { none, release_due, long_press_due, chord_due } what = none;
+        unsigned   key = 0;
+        time_point when = now;
+
+        for(unsigned k = 0; k < 6; ++k) {
+            const key_state &s = _keys[k];
+            if (s.release_pending && s.released + _timing.debounce <= when) {
+                what = release_due;
+                key  = k;
+                when = s.released + _timing.debounce;
+            } else if (s.down && !s.release_pending && !s.long_fired && !s.in_chord &&
+                    s.pressed + _timing.long_press <= when)
+            {
+                what = long_press_due;
+                key  = k;
+                when = s.pressed + _timing.long_press;
+            }
+        }
+
+        if (_chord_open && _chord_start + _timing.chord <= when) {
+            what = chord_due;
+            when = _chord_start + _timing.chord;
+        }
+
+        if (what == none) return;
+
+        if (what == chord_due) {
+            _chord_open = false;
+            if (_chord & (_chord - 1)) {
+                for(unsigned k = 0; k < 6; ++k)
+                    if (_chord & (1u << k)) _keys[k].in_chord = true;
+                emit(chord, _chord, when);
+            }
+            continue;
+        }
+
+        key_state &s = _keys[key];
+        const unsigned bit = 1u << key;
+
+        if (what == long_press_due) {
+            s.long_fired = true;
+            emit(long_press, bit, when);
+            continue;
+        }
+
+        // The release, stamped with the time the button was let go.
+        s.down = false;
+        s.release_pending = false;
+        _chord &= ~bit;
+        emit(release, bit, s.released);
+
+        if (s.in_chord || s.long_fired) continue;
+
+        emit(click, bit, s.released);
+        if (s.clicked && s.pressed - s.last_click <= _timing.double_click) {
+            emit(double_click, bit, s.released);
+            s.clicked = false;
+        } else {
+            s.clicked    = true;
+            s.last_click = s.released;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+void button_events::feed(const button::event &e) {
+    for(unsigned k = 0; k < 6; ++k) {
+        if (_keys[k].code != e.code) continue;
+
+        expire(e.timestamp);
+        if (e.type == button::event::press)
+            on_press(k, e.timestamp);
+        else if (e.type == button::event::release)
+            on_release(k, e.timestamp);
+    }
+}
+
+//-----------------------------------------------------------------------------
+bool button_events::update() {
+    _emitted = false;
+
+    button::event e;
+    while (_reader.next(e)) feed(e);
+
+    expire(std::chrono::steady_clock::now());
+    return _emitted;
+}
+
+//-----------------------------------------------------------------------------
+bool button_events::update(const button::event *events, size_t count, time_point now) {
+    _emitted = false;
+
+    for(size_t i = 0; i < count; ++i) feed(events[i]);
+
+    expire(now);
+    return _emitted;
+}
+
+//-----------------------------------------------------------------------------
+std::chrono::steady_clock::time_point button_events::deadline() const {
+    time_point t = time_point::max();
+
+    for(const auto &s : _keys) {
+        if (s.release_pending)
+            t = std::min(t, s.released + _timing.debounce);
+        else if (s.down && !s.long_fired && !s.in_chord)
+            t = std::min(t, s.pressed + _timing.long_press);
+    }
+
+    if (_chord_open)
+        t = std::min(t, _chord_start + _timing.chord);
+
+    return t;
+}
+
+//-----------------------------------------------------------------------------
+void button_events::start() {
+    using namespace std;
+
+    if (_thread.joinable()) return;
+
+    const int fd = button::input().fd();
+    if (fd < 0)
+        throw system_error(make_error_code(errc::no_such_device), BUTTON_DEVICE);
+
+    _wakeup = eventfd(0, EFD_CLOEXEC);
+    if (_wakeup < 0)
+        throw system_error(error_code(errno, system_category()), "eventfd");
+
+    _thread = thread([this, fd]() {
+            for(;;) {
+                int timeout = -1;
+                const auto d = deadline();
+                if (d != time_point::max()) {
+                    const auto ms = chrono::duration_cast<chrono::milliseconds>(
+                            d - chrono::steady_clock::now()).count();
+                    timeout = static_cast<int>(max<decltype(ms)>(0, min<decltype(ms)>(ms + 1, INT_MAX)));
+                }
+
+                pollfd p[2] = { { fd, POLLIN, 0 }, { _wakeup, POLLIN, 0 } };
+                if (poll(p, 2, timeout) < 0 && errno != EINTR) break;
+                if (p[1].revents) break;
+
+                update();
+            }
+            });
+}
+
+//-----------------------------------------------------------------------------
+void button_events::stop() {
+    if (!_thread.joinable()) return;
+
+    const uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one))) {}
+
+    _thread.join();
+    ::close(_wakeup);
+    _wakeup = -1;
+}
+
 //-----------------------------------------------------------------------------
 void sound::beep(const std::string &args, bool bSynchronous) {
     std::ostringstream cmd;
@@ -1163,6 +4572,341 @@ void remote_control::on_value_changed(int value) {
     _state = new_state;
 }
 
+//-----------------------------------------------------------------------------
+const uint32_t recorder::version;
+
+//-----------------------------------------------------------------------------
+recorder::recorder() : _closing(false) {
+    _current.data = nullptr;
+    _current.used = 0;
+}
+
+//-----------------------------------------------------------------------------
+recorder::~recorder() {
+    try {
+        close();
+    } catch(...) {
+    }
+}
+
+//-----------------------------------------------------------------------------
+size_t recorder::add(channel_kind kind, unsigned index, const device *dev, device::attr_slot slot) {
+    if (_fd >= 0)
+        throw std::logic_error("recorder is open");
+
+    channel_info c;
+    memset(&c, 0, sizeof(c));
+    c.kind  = kind;
+    c.index = index;
+
+    if (dev) {
+        if (dev->_path.empty())
+            throw std::system_error(std::make_error_code(std::errc::function_not_supported), "no device connected");
+
+        strncpy(c.address, dev->get_attr_string("address").c_str(),     sizeof(c.address) - 1);
+        strncpy(c.driver,  dev->get_attr_string("driver_name").c_str(), sizeof(c.driver)  - 1);
+    }
+
+    _channels.push_back(c);
+
+    const uint32_t channel = static_cast<uint32_t>(_channels.size() - 1);
+    if (slot != device::attr_slot_count)
+        _sources.push_back(source{dev, slot, channel});
+
+    return channel;
+}
+
+//-----------------------------------------------------------------------------
+size_t recorder::add_value(const sensor &s, unsigned index) {
+    if (index > 7)
+        throw std::invalid_argument("index");
+    return add(kind_sensor_value, index, &s, static_cast<device::attr_slot>(device::attr_value0 + index));
+}
+
+//-----------------------------------------------------------------------------
+size_t recorder::add_position(const motor &m) {
+    return add(kind_motor_position, 0, &m, device::attr_position);
+}
+
+//-----------------------------------------------------------------------------
+size_t recorder::add_speed(const motor &m) {
+    return add(kind_motor_speed, 0, &m, device::attr_speed);
+}
+
+//-----------------------------------------------------------------------------
+size_t recorder::add_duty_cycle(const motor &m) {
+    return add(kind_motor_duty_cycle, 0, &m, device::attr_duty_cycle);
+}
+
+//-----------------------------------------------------------------------------
+size_t recorder::add_buttons() {
+    const size_t c = add(kind_buttons, 0, nullptr, device::attr_slot_count);
+    strncpy(_channels[c].address, "buttons", sizeof(_channels[c].address) - 1);
+    return c;
+}
+
+//-----------------------------------------------------------------------------
+size_t recorder::add_remote(const infrared_sensor &s, unsigned channel) {
+    return add(kind_remote, channel, &s, device::attr_slot_count);
+}
+
+//-----------------------------------------------------------------------------
+size_t recorder::add_user(const std::string &name) {
+    const size_t c = add(kind_user, 0, nullptr, device::attr_slot_count);
+    strncpy(_channels[c].address, name.c_str(), sizeof(_channels[c].address) - 1);
+    return c;
+}
+
+//-----------------------------------------------------------------------------
+void recorder::open(const std::string &path) {
+    using namespace std;
+
+    if (_fd >= 0)
+        throw logic_error("recorder is open");
+
+    // The records start on a page, so that segments can be mapped.
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t size = sizeof(file_header) + _channels.size() * sizeof(channel_info);
+    _header_size = (size + page - 1) / page * page;
+
+    vector<char> head(_header_size, 0);
+
+    file_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, log_magic, sizeof(h.magic));
+    h.version       = version;
+    h.header_size   = static_cast<uint32_t>(_header_size);
+    h.record_size   = sizeof(record);
+    h.channel_count = static_cast<uint32_t>(_channels.size());
+
+    memcpy(head.data(), &h, sizeof(h));
+    if (!_channels.empty())
+        memcpy(head.data() + sizeof(h), _channels.data(), _channels.size() * sizeof(channel_info));
+
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw system_error(error_code(errno, system_category()), path);
+
+    if (pwrite(fd, head.data(), head.size(), 0) != static_cast<ssize_t>(head.size())) {
+        const int err = errno;
+        ::close(fd);
+        throw system_error(error_code(err, system_category()), path);
+    }
+
+    _wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_wakeup < 0) {
+        const int err = errno;
+        ::close(fd);
+        throw system_error(error_code(err, system_category()), "eventfd");
+    }
+
+    _fd           = fd;
+    _mapped       = _header_size;
+    _records      = 0;
+    _dropped      = 0;
+    _current.data = nullptr;
+    _current.used = 0;
+    _error        = nullptr;
+    _closing      = false;
+
+    // The first segments are ready before the first record.
+    try {
+        while (_ready.size() < log_segments_ahead) map_segment();
+    } catch(...) {
+        segment s;
+        while (_ready.pop(s)) unmap_segment(s.data);
+        ::close(_fd);
+        ::close(_wakeup);
+        _fd     = -1;
+        _wakeup = -1;
+        throw;
+    }
+
+    _writer = thread([this]() {
+            try {
+                run_writer();
+            } catch(...) {
+                _error = current_exception();
+            }
+            });
+}
+
+//-----------------------------------------------------------------------------
+void recorder::close() {
+    using namespace std;
+
+    if (_fd < 0) return;
+
+    if (_current.data) {
+        _full.push(_current);
+        _current.data = nullptr;
+    }
+
+    _closing.store(true, memory_order_release);
+
+    const uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one))) {}
+    _writer.join();
+
+    // The writer is gone; whatever it left is cleaned up here.
+    segment s;
+    while (_full.pop(s))  unmap_segment(s.data);
+    while (_ready.pop(s)) unmap_segment(s.data);
+
+    const int err = ftruncate(_fd, _header_size + _records * sizeof(record)) < 0 ? errno : 0;
+
+    ::close(_fd);
+    ::close(_wakeup);
+    _fd     = -1;
+    _wakeup = -1;
+
+    if (_error) {
+        exception_ptr e = _error;
+        _error = nullptr;
+        rethrow_exception(e);
+    }
+
+    if (err)
+        throw system_error(error_code(err, system_category()), "ftruncate");
+}
+
+//-----------------------------------------------------------------------------
+bool recorder::capture() {
+    if (_sources.empty()) return true;
+
+    _reads.resize(_sources.size());
+    _batch.clear();
+    for(size_t i = 0; i < _sources.size(); ++i) {
+        _reads[i].slot = _sources[i].slot;
+        _batch.push_back(device::attr_reads{_sources[i].dev, &_reads[i], 1});
+    }
+
+    const auto timestamp = device::read_attrs(_batch.data(), _batch.size());
+
+    bool ok = true;
+    for(size_t i = 0; i < _sources.size(); ++i) {
+        const device::attr_request &r = _reads[i];
+
+        int value;
+        if (!parse_int(r.data, r.data + r.size, value))
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                    _sources[i].dev->_path + attr_slot_names[r.slot]);
+
+        ok = log(_sources[i].channel, timestamp, value) && ok;
+    }
+
+    return ok;
+}
+
+//-----------------------------------------------------------------------------
+bool recorder::log(size_t channel, std::chrono::steady_clock::time_point t, int value) {
+    if (channel >= _channels.size())
+        throw std::out_of_range("channel");
+
+    if (_fd < 0)
+        throw std::logic_error("recorder is not open");
+
+    if ((!_current.data || _current.used == log_segment_size / sizeof(record)) && !next_segment()) {
+        ++_dropped;
+        return false;
+    }
+
+    record &r = _current.data[_current.used++];
+    r.channel   = static_cast<uint32_t>(channel);
+    r.value     = value;
+    r.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+
+    ++_records;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+bool recorder::next_segment() {
+    segment s;
+    if (!_ready.pop(s)) return false;
+
+    if (_current.data) _full.push(_current);
+    _current = s;
+
+    // Let the writer retire the full segment and map another one. The
+    // eventfd is non-blocking, and its counter cannot overflow here.
+    const uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one))) {}
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+void recorder::map_segment() {
+    using namespace std;
+
+    const int err = posix_fallocate(_fd, _mapped, log_segment_size);
+    if (err)
+        throw system_error(error_code(err, system_category()), "posix_fallocate");
+
+    void *p = mmap(nullptr, log_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _mapped);
+    if (p == MAP_FAILED)
+        throw system_error(error_code(errno, system_category()), "mmap");
+
+    // Take the page faults here rather than in the thread that logs.
+    const size_t page = sysconf(_SC_PAGESIZE);
+    volatile char *c = static_cast<volatile char*>(p);
+    for(size_t i = 0; i < log_segment_size; i += page) c[i] = 0;
+
+    _ready.push(segment{static_cast<record*>(p), 0});
+    _mapped += log_segment_size;
+}
+
+//-----------------------------------------------------------------------------
+void recorder::run_writer() {
+    using namespace std;
+
+    for(;;) {
+        segment s;
+        while (_full.pop(s)) unmap_segment(s.data);
+
+        if (_closing.load(memory_order_acquire)) return;
+
+        while (_ready.size() < log_segments_ahead) map_segment();
+
+        pollfd p = { _wakeup, POLLIN, 0 };
+        if (poll(&p, 1, -1) < 0 && errno != EINTR)
+            throw system_error(error_code(errno, system_category()), "poll");
+
+        uint64_t n;
+        if (read(_wakeup, &n, sizeof(n))) {}
+    }
+}
+
+//-----------------------------------------------------------------------------
+void recorder::load(const std::string &path,
+        std::vector<channel_info> &channels, std::vector<record> &records)
+{
+    using namespace std;
+
+    ifstream is(path, ios::binary);
+    if (!is)
+        throw system_error(make_error_code(errc::no_such_file_or_directory), path);
+
+    file_header h;
+    if (!is.read(reinterpret_cast<char*>(&h), sizeof(h)) ||
+            memcmp(h.magic, log_magic, sizeof(h.magic)) != 0 ||
+            h.version != version || h.record_size != sizeof(record))
+        throw system_error(make_error_code(errc::invalid_argument), path);
+
+    channels.resize(h.channel_count);
+    if (!channels.empty() && !is.read(reinterpret_cast<char*>(channels.data()),
+                channels.size() * sizeof(channel_info)))
+        throw system_error(make_error_code(errc::invalid_argument), path);
+
+    is.seekg(h.header_size);
+
+    records.clear();
+    record r;
+    while (is.read(reinterpret_cast<char*>(&r), sizeof(r)) && r.timestamp != 0)
+        records.push_back(r);
+}
+
 //-----------------------------------------------------------------------------
 lego_port::lego_port(address_type address) {
     connect({{ "address", { address } }});
@@ -1183,4 +4927,337 @@ bool lego_port::connect(const std::map<std::string, std::set<std::string>> &matc
     return false;
 }
 
+//-----------------------------------------------------------------------------
+event_loop::event_loop() : _stop(false) {
+    using namespace std;
+
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll < 0)
+        throw system_error(error_code(errno, system_category()), "epoll_create1");
+
+    _wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wakeup < 0) {
+        const int err = errno;
+        ::close(_epoll);
+        throw system_error(error_code(err, system_category()), "eventfd");
+    }
+
+    epoll_event ev = {};
+    ev.events  = EPOLLIN;
+    ev.data.u32 = 0; // no handle is 0
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &ev);
+}
+
+event_loop::~event_loop() {
+    for(auto &w : _watches)
+        if (w.second.owns_fd) ::close(w.second.fd);
+
+    ::close(_wakeup);
+    ::close(_epoll);
+}
+
+//-----------------------------------------------------------------------------
+event_loop::handle event_loop::add(
+        int fd, bool owns_fd, unsigned events, std::function<bool()> dispatch)
+{
+    using namespace std;
+
+    const handle h = ++_last;
+
+    if (fd >= 0) {
+        epoll_event ev = {};
+        ev.events  = events;
+        ev.data.u32 = h;
+        if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            const int err = errno;
+            if (owns_fd) ::close(fd);
+            throw system_error(error_code(err, system_category()), "epoll_ctl");
+        }
+    }
+
+    watch &w = _watches[h];
+    w.fd       = fd;
+    w.owns_fd  = owns_fd;
+    w.dispatch = move(dispatch);
+    w.interval = attr_poll_min;
+    w.next     = chrono::steady_clock::now();
+
+    return h;
+}
+
+//-----------------------------------------------------------------------------
+event_loop::handle event_loop::add_attr(
+        const device &d, device::attr_slot slot, std::function<bool()> dispatch)
+{
+    if (!d.connected())
+        throw std::system_error(std::make_error_code(std::errc::function_not_supported), "no device connected");
+
+    int fd = -1;
+
+#if !defined(EV3DEV_ATTR_IO_FSTREAM)
+    // Sysfs attributes report changes with EPOLLPRI if the driver notifies
+    // them. Files that cannot be watched at all are only polled.
+    fd = d.slot_handle(slot, false);
+
+    epoll_event ev = {};
+    ev.events = EPOLLPRI;
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) == 0)
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, &ev);
+    else
+        fd = -1;
+#endif
+
+    const handle h = add(fd, false, EPOLLPRI, std::move(dispatch));
+
+    watch &w = _watches[h];
+    w.notifies  = &d._handles.notifies[slot];
+    w.polled    = true;
+    w.dev       = &d;
+    w.slot      = slot;
+    w.handle_fd = fd;
+
+    return h;
+}
+
+//-----------------------------------------------------------------------------
+void event_loop::rewatch(handle h, watch &w) {
+#if !defined(EV3DEV_ATTR_IO_FSTREAM)
+    // Attributes that could not be watched stay polled.
+    if (w.fd < 0) return;
+
+    const int fd = w.dev->_handles.rd[w.slot].load(std::memory_order_acquire);
+    if (fd < 0 || fd == w.handle_fd) return;
+
+    // The old handle may be closed already, which removed it from the set.
+    epoll_event ev = {};
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, w.fd, &ev);
+
+    ev.events   = EPOLLPRI;
+    ev.data.u32 = h;
+    w.fd        = epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) == 0 ? fd : -1;
+    w.handle_fd = fd;
+#else
+    // Streams keep no handles to follow.
+    (void)h;
+    (void)w;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+event_loop::handle event_loop::add_buttons() {
+#ifndef NO_LINUX_HEADERS
+    const int fd = button::input().fd();
+    if (fd < 0)
+        throw std::system_error(std::make_error_code(std::errc::no_such_device), BUTTON_DEVICE);
+
+    // process_all() reads the input events.
+    return add(fd, false, EPOLLIN, []() { return button::process_all(); });
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "buttons");
+#endif
+}
+
+//-----------------------------------------------------------------------------
+event_loop::handle event_loop::add_value(
+        const sensor &s, unsigned index, std::function<void(int)> f)
+{
+    using namespace std;
+
+    if (index >= 8)
+        throw invalid_argument("index");
+
+    const device::attr_slot slot = static_cast<device::attr_slot>(device::attr_value0 + index);
+    const sensor *ps = &s;
+    int last = s.get_attr_int(slot);
+
+    return add_attr(s, slot, [ps, slot, last, f]() mutable {
+            const int value = ps->get_attr_int(slot);
+            if (value == last) return false;
+            last = value;
+            f(value);
+            return true;
+            });
+}
+
+//-----------------------------------------------------------------------------
+event_loop::handle event_loop::add_state(
+        const motor &m, std::function<void(const mode_set&)> f)
+{
+    const motor *pm = &m;
+    motor_state last = m.get_attr_state(device::attr_state);
+
+    return add_attr(m, device::attr_state, [pm, last, f]() mutable {
+            const motor_state state = pm->get_attr_state(device::attr_state);
+            if (state == last) return false;
+            last = state;
+            f(state.to_set());
+            return true;
+            });
+}
+
+//-----------------------------------------------------------------------------
+event_loop::handle event_loop::add_timer(
+        std::chrono::nanoseconds period, std::function<void()> f)
+{
+    using namespace std;
+
+    if (period.count() <= 0)
+        throw invalid_argument("period");
+
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        throw system_error(error_code(errno, system_category()), "timerfd_create");
+
+    itimerspec spec;
+    spec.it_interval.tv_sec  = period.count() / 1000000000;
+    spec.it_interval.tv_nsec = period.count() % 1000000000;
+    spec.it_value = spec.it_interval;
+
+    if (timerfd_settime(fd, 0, &spec, nullptr) < 0) {
+        const int err = errno;
+        ::close(fd);
+        throw system_error(error_code(err, system_category()), "timerfd_settime");
+    }
+
+    return add(fd, true, EPOLLIN, [fd, f]() {
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                return false;
+            f();
+            return true;
+            });
+}
+
+//-----------------------------------------------------------------------------
+event_loop::handle event_loop::add_signal(int signo, std::function<void(int)> f) {
+    using namespace std;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+
+    int err = pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    if (err != 0)
+        throw system_error(error_code(err, system_category()), "pthread_sigmask");
+
+    const int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        throw system_error(error_code(errno, system_category()), "signalfd");
+
+    return add(fd, true, EPOLLIN, [fd, f]() {
+            signalfd_siginfo info;
+            bool called = false;
+            while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+                f(info.ssi_signo);
+                called = true;
+            }
+            return called;
+            });
+}
+
+//-----------------------------------------------------------------------------
+event_loop::handle event_loop::add_fd(int fd, std::function<void()> f) {
+    return add(fd, false, EPOLLIN, [f]() { f(); return true; });
+}
+
+//-----------------------------------------------------------------------------
+void event_loop::remove(handle h) {
+    auto w = _watches.find(h);
+    if (w == _watches.end() || w->second.dead) return;
+
+    // The watch may be dispatching right now; run_once() erases it later.
+    w->second.dead = true;
+    if (w->second.fd >= 0) {
+        epoll_event ev = {};
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, w->second.fd, &ev);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void event_loop::run() {
+    _stop = false;
+    while (!_stop) run_once();
+}
+
+//-----------------------------------------------------------------------------
+int event_loop::run_once(std::chrono::milliseconds timeout) {
+    using namespace std;
+
+    // Sleep no longer than until the next polled attribute is due.
+    auto now = chrono::steady_clock::now();
+    for(const auto &w : _watches) {
+        if (!w.second.polled || w.second.dead) continue;
+
+        auto due = chrono::duration_cast<chrono::milliseconds>(w.second.next - now);
+        if (due.count() < 0) due = chrono::milliseconds(0);
+        if (timeout.count() < 0 || due < timeout) timeout = due;
+    }
+
+    epoll_event events[16];
+    const int n = epoll_wait(_epoll, events, 16, timeout.count() < 0 ? -1 :
+            static_cast<int>(min<chrono::milliseconds::rep>(timeout.count(), INT_MAX)));
+
+    if (n < 0 && errno != EINTR)
+        throw system_error(error_code(errno, system_category()), "epoll_wait");
+
+    int called = 0;
+
+    for(int i = 0; i < n; ++i) {
+        if (events[i].data.u32 == 0) {
+            uint64_t v;
+            if (read(_wakeup, &v, sizeof(v))) {}
+            continue;
+        }
+
+        auto w = _watches.find(events[i].data.u32);
+        if (w == _watches.end() || w->second.dead) continue;
+
+        if (w->second.notifies && (events[i].events & (EPOLLPRI | EPOLLERR)))
+            w->second.notifies->store(true, memory_order_relaxed);
+
+        if (w->second.dispatch()) ++called;
+        if (w->second.dev) rewatch(w->first, w->second);
+    }
+
+    now = chrono::steady_clock::now();
+    for(auto &w : _watches) {
+        watch &p = w.second;
+        if (!p.polled || p.dead || p.next > now) continue;
+
+        // The driver may notify only some changes. One found by polling
+        // means it does not notify them all, so poll at the adaptive rate.
+        const bool notifies = p.notifies->load(memory_order_relaxed);
+
+        if (p.dispatch()) {
+            ++called;
+            if (notifies) p.notifies->store(false, memory_order_relaxed);
+            p.interval = attr_poll_min;
+        } else {
+            p.interval = notifies ? attr_notify_poll : min(p.interval * 2, attr_poll_max);
+        }
+        p.next = now + p.interval;
+
+        rewatch(w.first, p);
+    }
+
+    for(auto w = _watches.begin(); w != _watches.end(); ) {
+        if (w->second.dead) {
+            if (w->second.owns_fd) ::close(w->second.fd);
+            w = _watches.erase(w);
+        } else {
+            ++w;
+        }
+    }
+
+    return called;
+}
+
+//-----------------------------------------------------------------------------
+void event_loop::stop() {
+    _stop = true;
+
+    const uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one))) {}
+}
+
 } // namespace ev3dev
@@ -26,6 +26,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <map>
 #include <set>
 #include <string>
@@ -33,7 +34,13 @@
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <iterator>
+#include <future>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
 
 namespace ev3dev {
 
@@ -89,6 +96,371 @@ constexpr char OUTPUT_C[] = "ev3-ports:outC"; //!< Motor port C
 constexpr char OUTPUT_D[] = "ev3-ports:outD"; //!< Motor port D
 #endif
 
+//-----------------------------------------------------------------------------
+// A bounded lock-free queue that passes values from one producer thread to
+// one consumer thread. N must be a power of two.
+//-----------------------------------------------------------------------------
+template <class T, size_t N>
+class spsc_ring {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+    public:
+        spsc_ring() : _head(0), _tail(0) {}
+
+        spsc_ring(const spsc_ring&) = delete;
+        spsc_ring& operator=(const spsc_ring&) = delete;
+
+        // Producer: appends a value. Returns false if the ring is full.
+        bool push(const T &v) {
+            const size_t t = _tail.load(std::memory_order_relaxed);
+            if (t - _head.load(std::memory_order_acquire) == N) return false;
+
+            _buf[t & (N - 1)] = v;
+            _tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer: takes the oldest value. Returns false if the ring is empty.
+        bool pop(T &v) {
+            const size_t h = _head.load(std::memory_order_relaxed);
+            if (h == _tail.load(std::memory_order_acquire)) return false;
+
+            v = _buf[h & (N - 1)];
+            _head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool   empty() const { return size() == 0; }
+        size_t size()  const {
+            return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+        }
+
+        static constexpr size_t capacity() { return N; }
+
+    private:
+        T _buf[N];
+
+        // Kept apart, so that the two threads do not share a cache line.
+        alignas(64) std::atomic<size_t> _head; // next value to pop
+        alignas(64) std::atomic<size_t> _tail; // next slot to push
+};
+
+//-----------------------------------------------------------------------------
+// The space separated tokens of an attribute such as `modes` or `trigger`,
+// sorted and kept in a single buffer. Lookups and iteration do not allocate,
+// and assigning new contents reuses the buffers. A token in square brackets
+// is the selected one; it is stored without the brackets.
+//-----------------------------------------------------------------------------
+class token_set {
+    public:
+        class const_iterator {
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef const char*               value_type;
+                typedef std::ptrdiff_t            difference_type;
+                typedef const char* const*        pointer;
+                typedef const char*               reference;
+
+                const char* operator*() const { return _s->_text.data() + _s->_tokens[_i]; }
+                const_iterator& operator++() { ++_i; return *this; }
+                bool operator==(const const_iterator &i) const { return _i == i._i; }
+                bool operator!=(const const_iterator &i) const { return _i != i._i; }
+
+            private:
+                friend class token_set;
+                const_iterator(const token_set *s, size_t i) : _s(s), _i(i) {}
+
+                const token_set *_s;
+                size_t           _i;
+        };
+
+        token_set() {}
+        token_set(const char *s, const char *end) { assign(s, end); }
+
+        void assign(const char *s, const char *end);
+        void clear() { _text.clear(); _tokens.clear(); _selected = -1; }
+
+        size_t size()  const { return _tokens.size(); }
+        bool   empty() const { return _tokens.empty(); }
+
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end()   const { return const_iterator(this, _tokens.size()); }
+
+        size_t count(const char *token) const;
+        size_t count(const std::string &token) const { return count(token.c_str()); }
+
+        // The selected token, nullptr if there is none.
+        const char* selected() const {
+            return _selected < 0 ? nullptr : _text.data() + _selected;
+        }
+
+        // Compatibility with the `mode_set` these attributes used to be.
+        mode_set to_set() const { return mode_set(begin(), end()); }
+        operator mode_set() const { return to_set(); }
+
+        bool operator==(const token_set &s) const;
+        bool operator!=(const token_set &s) const { return !(*this == s); }
+        bool operator==(const mode_set &s) const;
+        bool operator!=(const mode_set &s) const { return !(*this == s); }
+
+    private:
+        std::string                 _text;   // the tokens, each followed by '\0'
+        std::vector<unsigned short> _tokens; // their offsets in _text, sorted
+        int                         _selected = -1;
+};
+
+//-----------------------------------------------------------------------------
+// The flags of the `state` attribute of a tacho, DC or servo motor as a bit
+// mask.
+//-----------------------------------------------------------------------------
+class motor_state {
+    public:
+        enum flag : unsigned {
+            running    = (1 << 0),
+            ramping    = (1 << 1),
+            holding    = (1 << 2),
+            overloaded = (1 << 3),
+            stalled    = (1 << 4)
+        };
+
+        motor_state(unsigned bits = 0) : _bits(bits) {}
+
+        unsigned bits() const { return _bits; }
+
+        // True if any of the flags in `mask` is set.
+        bool has(unsigned mask) const { return (_bits & mask) != 0; }
+
+        bool operator==(motor_state s) const { return _bits == s._bits; }
+        bool operator!=(motor_state s) const { return _bits != s._bits; }
+
+        // Parses the contents of a `state` attribute without allocating.
+        // Unknown flags are ignored.
+        static motor_state parse(const char *s, const char *end);
+
+        // Interoperation with the `mode_set` that state() returns.
+        bool   empty() const { return _bits == 0; }
+        size_t count(const std::string &flag) const;
+
+        mode_set to_set() const;
+        operator mode_set() const { return to_set(); }
+
+        bool operator==(const mode_set &s) const { return to_set() == s; }
+        bool operator!=(const mode_set &s) const { return to_set() != s; }
+
+    private:
+        unsigned _bits;
+};
+
+//-----------------------------------------------------------------------------
+// Where devices read and write their attributes instead of sysfs, see
+// device::set_backend(). Paths are the sysfs paths the device would use.
+// Implementations must be safe to call from several threads.
+//-----------------------------------------------------------------------------
+class attr_backend {
+    public:
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        virtual ~attr_backend() {}
+
+        // The entries of a class directory, e.g. SYS_ROOT "/tacho-motor/".
+        virtual std::vector<std::string> list(const std::string &dir) = 0;
+
+        // Read and write the attribute at `path` as a whole, like sysfs.
+        virtual size_t read (const std::string &path, char *buf, size_t size) = 0;
+        virtual void   write(const std::string &path, const char *buf, size_t size) = 0;
+
+        // Waits until the attribute may have changed, or until `deadline`.
+        // Returns false if the deadline passed.
+        virtual bool wait(const std::string &path, time_point deadline) = 0;
+
+        // The clock that wait() deadlines refer to.
+        virtual time_point now() = 0;
+};
+
+//-----------------------------------------------------------------------------
+// Sysfs as an attribute backend, under SYS_ROOT or under a root chosen at run
+// time, such as a copy of /sys/class. Devices go to sysfs directly, and
+// faster, while no backend is set; this one serves to pick the root, or as
+// the target of trace_recorder.
+//-----------------------------------------------------------------------------
+class sysfs_backend : public attr_backend {
+    public:
+        sysfs_backend();
+        explicit sysfs_backend(const std::string &root);
+        virtual ~sysfs_backend();
+
+        virtual std::vector<std::string> list(const std::string &dir);
+        virtual size_t     read (const std::string &path, char *buf, size_t size);
+        virtual void       write(const std::string &path, const char *buf, size_t size);
+        virtual bool       wait (const std::string &path, time_point deadline);
+        virtual time_point now  ();
+
+    private:
+        class state;
+        std::unique_ptr<state> _s;
+};
+
+//-----------------------------------------------------------------------------
+// An attribute backend that keeps the attributes in memory, so that tests
+// and benchmarks need neither sysfs nor the fake-sys scripts:
+//
+//     ev3::memory_backend mem;
+//     mem.add_device("tacho-motor", "motor0", {
+//             {"address", "ev3-ports:outA"}, {"driver_name", "lego-ev3-m-motor"},
+//             {"position", "0"}, {"speed_sp", "0"}, {"command", ""}});
+//     ev3::device::set_backend(&mem);
+//     ev3::medium_motor m;
+//
+// Devices store their writes as they are. set() changes an attribute from
+// the outside, like a driver, and wakes up whoever waits on the store. Only
+// attributes that were added can be read and written.
+//-----------------------------------------------------------------------------
+class memory_backend : public attr_backend {
+    public:
+        memory_backend();
+        virtual ~memory_backend();
+
+        // Adds the device `name` (e.g. "motor0") to the class `cls` (e.g.
+        // "tacho-motor") with the given attributes. Returns its path.
+        std::string add_device(const std::string &cls, const std::string &name,
+                const std::map<std::string, std::string> &attrs);
+
+        // Set and get an attribute, given without the final newline.
+        void        set(const std::string &path, const std::string &value);
+        std::string get(const std::string &path) const;
+
+        virtual std::vector<std::string> list(const std::string &dir);
+        virtual size_t     read (const std::string &path, char *buf, size_t size);
+        virtual void       write(const std::string &path, const char *buf, size_t size);
+        virtual bool       wait (const std::string &path, time_point deadline);
+        virtual time_point now  ();
+
+    private:
+        class state;
+        std::unique_ptr<state> _s;
+};
+
+//-----------------------------------------------------------------------------
+// An attribute backend that passes the accesses on to another one (sysfs by
+// default) and records them in a trace for trace_replay. Each line of the
+// trace holds the time in nanoseconds since the recorder was created, the
+// operation (`r`ead, `w`rite or `l`ist), the path and the value, with
+// backslashes and newlines escaped. A listing holds the names of the
+// entries, separated by spaces.
+//-----------------------------------------------------------------------------
+class trace_recorder : public attr_backend {
+    public:
+        explicit trace_recorder(const std::string &path);
+        trace_recorder(const std::string &path, attr_backend &target);
+        virtual ~trace_recorder();
+
+        virtual std::vector<std::string> list(const std::string &dir);
+        virtual size_t     read (const std::string &path, char *buf, size_t size);
+        virtual void       write(const std::string &path, const char *buf, size_t size);
+        virtual bool       wait (const std::string &path, time_point deadline);
+        virtual time_point now  ();
+
+    private:
+        class state;
+        std::unique_ptr<state> _s;
+};
+
+//-----------------------------------------------------------------------------
+// An attribute backend that plays a trace of trace_recorder back, on a clock
+// of its own that starts at zero. A read of an attribute is answered with
+// the next value read from it in the trace, skipping those that lie behind
+// the clock, and advances the clock to the time of that value; once they
+// are used up the last value is repeated. Waits advance the clock to the
+// next read of the attribute or to their deadline, without sleeping, so
+// control code runs faster than real time. Writes are kept for comparison
+// with those of the trace.
+//
+// Once the clock has passed the end of the trace, a read or wait that the
+// trace cannot answer throws std::system_error with
+// std::errc::no_message_available.
+//-----------------------------------------------------------------------------
+class trace_replay : public attr_backend {
+    public:
+        struct entry {
+            std::chrono::nanoseconds time;  // since the start of the trace
+            std::string              path;
+            std::string              value; // without the final newline
+        };
+
+        explicit trace_replay(const std::string &path);
+        virtual ~trace_replay();
+
+        virtual std::vector<std::string> list(const std::string &dir);
+        virtual size_t     read (const std::string &path, char *buf, size_t size);
+        virtual void       write(const std::string &path, const char *buf, size_t size);
+        virtual bool       wait (const std::string &path, time_point deadline);
+        virtual time_point now  ();
+
+        // The writes of the trace, and those received so far.
+        std::vector<entry> recorded_writes() const;
+        std::vector<entry> writes() const;
+
+        // Whether the replay ran past the end of the trace.
+        bool finished() const;
+
+    private:
+        class state;
+        std::unique_ptr<state> _s;
+};
+
+//-----------------------------------------------------------------------------
+// A memory_backend with simulated tacho motors, on a clock of its own that
+// starts at zero. The motors take the attributes and commands of the kernel
+// driver and regulate their speed and position with `speed_pid` and
+// `hold_pid` the way it does, driving a model with inertia, friction and
+// a load.
+//
+// The clock moves in steps of the simulation only: waits step it until
+// their attribute changes or their deadline is reached, and sleep_for()
+// steps it by a given time. Neither sleeps, so controllers and motions run
+// far faster than real time. Other threads may read and write attributes
+// between the steps. A wait without a deadline once all motors have come
+// to rest, and nothing has been written for a second of the simulation and
+// 100 ms of real time, throws std::system_error with
+// std::errc::resource_deadlock_would_occur.
+//-----------------------------------------------------------------------------
+class motor_simulator : public memory_backend {
+    public:
+        // The physics of a motor.
+        struct model {
+            std::string driver_name;
+            int         count_per_rot;
+            int         max_speed;     // in counts/s, without load at full duty cycle
+            double      time_constant; // of the speed, in seconds
+            double      friction;      // the duty cycle it takes to start turning
+        };
+
+        static model lego_ev3_l_motor();
+        static model lego_ev3_m_motor();
+
+        explicit motor_simulator(std::chrono::microseconds step = std::chrono::milliseconds(1));
+        virtual ~motor_simulator();
+
+        // Adds a motor on the port `address`, e.g. "ev3-ports:outA". Returns
+        // its path.
+        std::string add_motor(const std::string &address, const model &m);
+
+        // Sets the load on the motor at `path`, as the duty cycle it takes on
+        // top of the friction to overcome it. Loads above 100 stall the motor.
+        void set_load(const std::string &path, double load);
+
+        // Steps the simulation by `d`.
+        void sleep_for(std::chrono::nanoseconds d);
+
+        virtual void       write(const std::string &path, const char *buf, size_t size);
+        virtual bool       wait (const std::string &path, time_point deadline);
+        virtual time_point now  ();
+
+    private:
+        class sim;
+        std::unique_ptr<sim> _sim;
+};
+
 //-----------------------------------------------------------------------------
 // Generic device class.
 //-----------------------------------------------------------------------------
@@ -115,9 +487,307 @@ class device {
 
         std::string get_attr_from_set(const std::string &name) const;
 
+        // Reads the tokens of the attribute into `tokens`, reusing its
+        // buffers. Returns `tokens`.
+        const token_set& get_attr_tokens(const std::string &name, token_set &tokens) const;
+
+        // Asynchronous versions of the above. They are carried out one after
+        // another, in the order they were issued, by a dedicated I/O thread,
+        // so slow attributes do not block the caller. The device may go away
+        // before the futures are ready. Errors are reported by future::get().
+        std::future<int>         async_get_attr_int     (const std::string &name) const;
+        std::future<std::string> async_get_attr_string  (const std::string &name) const;
+        std::future<std::string> async_get_attr_line    (const std::string &name) const;
+        std::future<mode_set>    async_get_attr_set     (const std::string &name) const;
+        std::future<std::string> async_get_attr_from_set(const std::string &name) const;
+        std::future<void>        async_set_attr_int     (const std::string &name, int value);
+        std::future<void>        async_set_attr_string  (const std::string &name,
+                const std::string &value);
+
+        // Attributes accessed by name go through small per-thread caches of
+        // open file handles. These are their counters, summed over all threads.
+        struct attr_cache_stats {
+            unsigned long hits;
+            unsigned long misses;
+            unsigned long evictions;
+        };
+
+        static attr_cache_stats cache_stats();
+
+        // Sends the attribute I/O of all devices to `b` (sysfs_backend,
+        // memory_backend, trace_recorder, trace_replay or one of your own)
+        // instead of sysfs, or back to sysfs if `b` is null. Without a
+        // backend, devices access sysfs directly, at the cost of one pointer
+        // test. Set the backend before creating the devices that use it, and
+        // before starting threads that use them; it must outlive its use.
+        // event_loop always watches sysfs.
+        static void set_backend(attr_backend *b) { _backend.store(b, std::memory_order_relaxed); }
+        static attr_backend* backend() { return _backend.load(std::memory_order_relaxed); }
+
+        // Shadow registers. When enabled, the device remembers the last value
+        // written to (or read from) each setpoint, `stop_action` and `mode`.
+        // Writing the remembered value again is skipped, and reading it is
+        // answered from memory. Only enable this if no other program changes
+        // these attributes; call invalidate_shadow() if one might have. The
+        // shadow is dropped on reconnect and when a `reset` command is sent.
+        // Like the rest of a device, it is not meant for concurrent use.
+        void set_shadowing(bool enable);
+        bool shadowing() const { return !_shadow.empty(); }
+        void invalidate_shadow();
+
     protected:
+        // Queues f(device) to the I/O thread, with a device of its own
+        // connected to the same path. The thread keeps that device, and its
+        // open handles, for later operations on the path.
+        template <class T>
+        std::future<T> async_call(std::function<T(device&)> f) const;
+
+        // Attributes that are accessed in tight control loops. Their file
+        // handles are opened once per device and kept in a table, so
+        // accessing them needs neither a path concatenation nor a lookup in
+        // the shared cache.
+        enum attr_slot {
+            attr_position,
+            attr_position_sp,
+            attr_speed,
+            attr_speed_sp,
+            attr_duty_cycle,
+            attr_duty_cycle_sp,
+            attr_state,
+            attr_command,
+            attr_stop_action,
+            attr_mode,
+            attr_value0,
+            attr_value1,
+            attr_value2,
+            attr_value3,
+            attr_value4,
+            attr_value5,
+            attr_value6,
+            attr_value7,
+            attr_slot_count
+        };
+
+        int         get_attr_int   (attr_slot slot) const;
+        void        set_attr_int   (attr_slot slot, int value);
+        std::string get_attr_line  (attr_slot slot) const;
+        void        set_attr_string(attr_slot slot, const std::string &value);
+        mode_set    get_attr_set   (attr_slot slot) const;
+        motor_state get_attr_state (attr_slot slot) const;
+
+        std::future<motor_state> async_get_attr_state(attr_slot slot) const;
+
+        // A read request of a batch: the slot to read and room for its value.
+        struct attr_request {
+            attr_slot slot;
+            size_t    size;
+            char      data[64];
+        };
+
+        // Reads a batch of slots back to back. Returns the time at which the
+        // batch was issued, which serves as the timestamp of all the values.
+        std::chrono::steady_clock::time_point read_attrs(
+                attr_request *reads, size_t count) const;
+
+        // The read requests of one device within a batch of several devices.
+        struct attr_reads {
+            const device *dev;
+            attr_request *reads;
+            size_t        count;
+        };
+
+        // Reads the requests of several devices as one batch, with a single
+        // system call when built with the io_uring backend.
+        static std::chrono::steady_clock::time_point read_attrs(
+                const attr_reads *batch, size_t count);
+
+        // Reads the slot until `done` accepts its contents or the timeout
+        // expires; a negative timeout waits forever. Sleeps in poll() on
+        // POLLPRI if the driver notifies changes of the attribute. Otherwise
+        // rereads it for a short while, then polls at an adaptive rate.
+        // Returns false on timeout.
+        bool wait_attr(attr_slot slot,
+                const std::function<bool(const char *data, size_t size)> &done,
+                std::chrono::milliseconds timeout) const;
+
+        // Attributes that do not change while the device stays connected.
+        // They are read on first use and served from memory afterwards; the
+        // references stay valid until the device reconnects.
+        enum const_attr {
+            const_address,
+            const_driver_name,
+            const_commands,
+            const_stop_actions,
+            const_modes,
+            const_count_per_rot,
+            const_count_per_m,
+            const_full_travel_count,
+            const_max_speed,
+            const_max_brightness,
+            const_attr_count
+        };
+
+        int                get_attr_int   (const_attr attr) const;
+        const std::string& get_attr_string(const_attr attr) const;
+        const token_set&   get_attr_set   (const_attr attr) const;
+
+        // Attribute values collected for a single commit_attrs() call.
+        // Setting the same attribute again replaces the earlier value.
+        class attr_batch {
+            public:
+                void set(attr_slot slot, int value);
+                void set(attr_slot slot, const std::string &value);
+                void set(const char *name, int value);
+                void set(const char *name, const std::string &value);
+
+                bool empty() const { return _items.empty(); }
+                void clear() { _items.clear(); }
+
+            private:
+                friend class device;
+
+                struct item {
+                    attr_slot   slot; // attr_slot_count if not in the handle table
+                    const char *name;
+                    std::string value;
+                };
+
+                void set(attr_slot slot, const char *name, std::string value);
+
+                std::vector<item> _items;
+        };
+
+        // Stores the values of the batch in order, each with a single write.
+        // Stops at the first failure and reports it with one exception that
+        // names the attribute; the values after it are not written.
+        void commit_attrs(const attr_batch &batch);
+
+        // The common part of the command batches of the motor classes, which
+        // pass their own type as `Batch` so that the setters chain. Collects
+        // attribute values and a command and commits them in one go, the
+        // command last.
+        template <class Batch>
+        class command_batch_base {
+            public:
+                Batch& set_polarity(std::string v) { _batch.set("polarity", v); return self(); }
+                Batch& set_command(std::string v)  { _command = std::move(v);   return self(); }
+
+                // Stores the collected setpoints and the command (if any).
+                void commit() {
+                    if (!_command.empty()) _batch.set(attr_command, _command);
+                    _device.commit_attrs(_batch);
+                    _batch.clear();
+                    _command.clear();
+                }
+
+            protected:
+                explicit command_batch_base(device &d) : _device(d) {}
+
+                Batch& self() { return static_cast<Batch&>(*this); }
+
+                device      &_device;
+                attr_batch   _batch;
+                std::string  _command;
+        };
+
         std::string _path;
         mutable int _device_index = -1;
+
+    private:
+        // Open file descriptors of the attribute slots, -1 if not opened yet.
+        // A copy of a device opens its own handles on first use.
+        //
+        // Another thread may still be using a descriptor that is dropped,
+        // and its number may be reused by the next open(). So dropped
+        // descriptors are retired, and closed once no thread holds a user.
+        struct handle_table {
+            std::atomic<int> rd[attr_slot_count];
+            std::atomic<int> wr[attr_slot_count];
+
+            // Set once the driver was seen to notify changes of the slot.
+            std::atomic<bool> notifies[attr_slot_count];
+
+            std::atomic<int>  users;
+            std::atomic<bool> pending; // whether `retired` has descriptors
+            std::mutex        retired_lock;
+            std::vector<int>  retired;
+
+            // Keeps the descriptors it sees open while it exists.
+            class user {
+                public:
+                    explicit user(handle_table &t) : _t(t) { ++_t.users; }
+                    ~user() { if (--_t.users == 0 && _t.pending) _t.collect(); }
+
+                    user(const user&) = delete;
+                    user& operator=(const user&) = delete;
+
+                private:
+                    handle_table &_t;
+            };
+
+            handle_table();
+            handle_table(const handle_table&);
+            handle_table& operator=(const handle_table&);
+            ~handle_table();
+
+            // Drops the descriptor `fd` of `handle`, unless it was replaced.
+            void drop(std::atomic<int> &handle, int fd);
+
+            // Drops all descriptors.
+            void close();
+
+            // Closes the retired descriptors if nobody uses any.
+            void collect();
+        };
+
+        struct shadow_entry {
+            bool        valid = false;
+            std::string value;
+        };
+
+        // Values of the constant attributes. A copy of a device loads its own.
+        struct const_table {
+            enum { empty, loading, ready };
+
+            struct entry {
+                std::atomic<int> state;
+                int              num;
+                std::string      str;
+                token_set        set;
+            };
+
+            entry e[const_attr_count];
+
+            const_table();
+            const_table(const const_table&);
+            const_table& operator=(const const_table&);
+
+            void clear();
+        };
+
+        const const_table::entry& load_const(const_attr attr) const;
+
+        int    slot_handle(attr_slot slot, bool write) const;
+        size_t read_attr (attr_slot slot, char *buf, size_t size) const;
+        void   write_attr(attr_slot slot, const char *buf, size_t size);
+
+        // Same as read_attr() and write_attr(), but go through the shadow.
+        shadow_entry* shadow(attr_slot slot) const;
+        size_t load_attr (attr_slot slot, char *buf, size_t size) const;
+        void   store_attr(attr_slot slot, const char *buf, size_t size);
+
+        mutable handle_table _handles;
+        mutable const_table  _consts;
+
+        static std::atomic<attr_backend*> _backend;
+
+        friend class event_loop;
+        friend class sample_group;
+        friend class sampler;
+        friend class recorder;
+
+        // Empty unless shadowing is enabled, one entry per slot otherwise.
+        mutable std::vector<shadow_entry> _shadow;
 };
 
 //-----------------------------------------------------------------------------
@@ -158,6 +828,9 @@ class sensor : protected device {
 
         using device::connected;
         using device::device_index;
+        using device::set_shadowing;
+        using device::shadowing;
+        using device::invalidate_shadow;
 
         // Returns the value or values measured by the sensor. Check `num_values` to
         // see how many values there are. Values with index >= num_values will return
@@ -168,6 +841,31 @@ class sensor : protected device {
         // The value converted to float using `decimals`.
         float float_value(unsigned index=0) const;
 
+        // value() and float_value() read by the I/O thread of the async
+        // attribute functions, for sensors that are slow to answer (analog
+        // and I2C sensors, single shot modes). The mode is not changed.
+        std::future<int>   async_value(unsigned index=0) const;
+        std::future<float> async_float_value(unsigned index=0) const;
+
+        // Values (and optionally the mode) of the sensor, read in one batch.
+        struct sample {
+            std::chrono::steady_clock::time_point timestamp;
+            std::string mode;
+            unsigned    num_values;
+            int         values[8];
+        };
+
+        // Reads `value0` to `value<count-1>` in one batch, and the current
+        // mode if `with_mode` is set. All values share one timestamp.
+        sample snapshot(unsigned count = 1, bool with_mode = false) const;
+
+        // Blocks until `value<index>` differs from `value` or the timeout
+        // expires, then stores the current value in `value`. Returns true if
+        // the value changed. Sleeps on sysfs change notifications where the
+        // driver sends them, and polls at an adaptive rate otherwise.
+        bool wait_value_change(int &value, unsigned index = 0,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) const;
+
         // Human-readable name of the connected sensor.
         std::string type_name() const;
 
@@ -182,7 +880,7 @@ class sensor : protected device {
         //    - `s16_be`: Signed 16-bit integer, big endian
         //    - `s32`: Signed 32-bit integer (int)
         //    - `float`: IEEE 754 32-bit floating point (float)
-        std::string bin_data_format() const { return get_attr_string("bin_data_format"); };
+        const std::string& bin_data_format() const { return mode_desc().bin_data_format; };
 
         // Bin Data: read-only
         // Returns the unscaled raw values in the `value<N>` attributes as raw byte
@@ -203,7 +901,7 @@ class sensor : protected device {
         // Address: read-only
         // Returns the name of the port that the sensor is connected to, e.g. `ev3:in1`.
         // I2C sensors also include the I2C address (decimal), e.g. `ev3:in1:i2c8`.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_string(const_address); }
 
         // Command: write-only
         // Sends a command to the sensor.
@@ -215,47 +913,123 @@ class sensor : protected device {
         // Commands: read-only
         // Returns a list of the valid commands for the sensor.
         // Returns -EOPNOTSUPP if no commands are supported.
-        mode_set commands() const { return get_attr_set("commands"); }
+        // The set is kept by the device until it reconnects or is assigned to.
+        const token_set& commands() const { return get_attr_set(const_commands); }
 
         // Decimals: read-only
         // Returns the number of decimal places for the values in the `value<N>`
         // attributes of the current mode.
-        int decimals() const { return get_attr_int("decimals"); }
+        int decimals() const { return mode_desc().decimals; }
 
         // Driver Name: read-only
         // Returns the name of the sensor device/driver. See the list of [supported
         // sensors] for a complete list of drivers.
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_string(const_driver_name); }
 
         // Mode: read/write
         // Returns the current mode. Writing one of the values returned by `modes`
         // sets the sensor to that mode.
-        std::string mode() const { return get_attr_string("mode"); }
-        sensor& set_mode(std::string v) {
-            set_attr_string("mode", v);
-            return *this;
-        }
+        std::string mode() const { return get_attr_line(attr_mode); }
+        std::future<std::string> async_mode() const { return async_get_attr_line("mode"); }
+        sensor& set_mode(std::string v);
 
         // Modes: read-only
         // Returns a list of the valid modes for the sensor.
-        mode_set modes() const { return get_attr_set("modes"); }
+        // The set is kept by the device until it reconnects or is assigned to.
+        const token_set& modes() const { return get_attr_set(const_modes); }
 
         // Num Values: read-only
         // Returns the number of `value<N>` attributes that will return a valid value
         // for the current mode.
-        int num_values() const { return get_attr_int("num_values"); }
+        int num_values() const { return mode_desc().num_values; }
 
         // Units: read-only
         // Returns the units of the measured value for the current mode. May return
         // empty string
-        std::string units() const { return get_attr_string("units"); }
+        const std::string& units() const { return mode_desc().units; }
+
+        // Pins the sensor to a mode for the lifetime of the lock. While it is
+        // pinned, the value getters of that mode (e.g. `angle()` of the gyro
+        // sensor) read without rewriting `mode`, and the getters of other
+        // modes throw. If another sensor object of this program switches the
+        // same sensor to another mode, the pinned mode is restored before the
+        // next read. Locks nest; the outer mode comes back with the outer lock.
+        //
+        //     ev3::color_sensor::mode_lock lock(cs, ev3::color_sensor::mode_col_reflect);
+        //     while (follow) steer(cs.reflected_light_intensity());
+        //
+        // Single-shot modes such as `US-SI-CM` measure when the mode is
+        // written, so they should not be pinned.
+        class mode_lock {
+            public:
+                mode_lock(sensor &s, std::string mode);
+                ~mode_lock();
+
+                mode_lock(const mode_lock&) = delete;
+                mode_lock& operator=(const mode_lock&) = delete;
+
+            private:
+                sensor     &_sensor;
+                std::string _outer;
+        };
 
     protected:
         sensor() {}
 
+        // Used by the value getters: switches to the mode unless the sensor
+        // is pinned to it already, and throws EBUSY if it is pinned to
+        // another one. With `rewrite` the mode is written in any case, for
+        // the single shot modes that measure on every write.
+        void require_mode(const char *mode, bool rewrite = false);
+
         bool connect(const std::map<std::string, std::set<std::string>>&) noexcept;
 
+        // Properties of a sensor mode. They are read when the sensor switches
+        // to the mode for the first time and kept until it reconnects. A mode
+        // change made outside of set_mode() is not noticed.
+        struct mode_descriptor {
+            std::string mode;
+            int         decimals;
+            int         num_values;
+            std::string bin_data_format;
+            std::string units;
+            float       scale;      // 10^-decimals
+            size_t      value_size; // size of a value in bin_data
+        };
+
+        const mode_descriptor& mode_desc() const;
+
         mutable std::vector<char> _bin_data;
+
+    private:
+        size_t load_mode_desc(const std::string &mode) const;
+
+        // The two halves of snapshot(), also used by sample_group.
+        size_t sample_reads(unsigned count, bool with_mode, attr_request *reads) const;
+        void   parse_sample(const attr_request *reads, unsigned count, bool with_mode, sample &s) const;
+
+        // The mode pinned by a mode_lock, with the number of mode changes of
+        // the sensor seen since. A copy of a sensor is not pinned.
+        struct pin {
+            std::string mode;
+            unsigned    epoch = 0;
+
+            pin() {}
+            pin(const pin&) {}
+            pin& operator=(const pin&) { mode.clear(); return *this; }
+        };
+
+        std::atomic<unsigned>& mode_epoch() const;
+
+        pin _pin;
+
+        mutable std::vector<mode_descriptor> _mode_descs;
+        mutable int _mode_desc = -1; // index of the current mode, -1 if unknown
+
+        friend class event_loop;
+        friend class sample_group;
+        friend class sampler;
+        friend class recorder;
 };
 
 //-----------------------------------------------------------------------------
@@ -272,6 +1046,7 @@ class i2c_sensor : public sensor {
         // Returns the firmware version of the sensor if available. Currently only
         // I2C/NXT sensors support this.
         std::string fw_version() const { return get_attr_string("fw_version"); }
+        std::future<std::string> async_fw_version() const { return async_get_attr_string("fw_version"); }
 
         // Poll MS: read/write
         // Returns the polling period of the sensor in milliseconds. Writing sets the
@@ -279,6 +1054,7 @@ class i2c_sensor : public sensor {
         // coded as 50 msec. Returns -EOPNOTSUPP if changing polling is not supported.
         // Currently only I2C/NXT sensors support changing the polling period.
         int poll_ms() const { return get_attr_int("poll_ms"); }
+        std::future<int> async_poll_ms() const { return async_get_attr_int("poll_ms"); }
         i2c_sensor& set_poll_ms(int v) {
             set_attr_int("poll_ms", v);
             return *this;
@@ -299,7 +1075,7 @@ class touch_sensor : public sensor {
         // A boolean indicating whether the current touch sensor is being
         // pressed.
         bool is_pressed(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_touch);
+            if (do_set_mode) require_mode(mode_touch);
             return value(0);
         }
 };
@@ -353,15 +1129,23 @@ class color_sensor : public sensor {
 
         // Reflected light intensity as a percentage. Light on sensor is red.
         int reflected_light_intensity(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_col_reflect);
+            if (do_set_mode) require_mode(mode_col_reflect);
             return value(0);
         }
+        std::future<int> async_reflected_light_intensity(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_col_reflect);
+            return async_value(0);
+        }
 
         // Ambient light intensity. Light on sensor is dimly lit blue.
         int ambient_light_intensity(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_col_ambient);
+            if (do_set_mode) require_mode(mode_col_ambient);
             return value(0);
         }
+        std::future<int> async_ambient_light_intensity(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_col_ambient);
+            return async_value(0);
+        }
 
         // Color detected by the sensor, categorized by overall value.
         //   - 0: No color
@@ -373,33 +1157,49 @@ class color_sensor : public sensor {
         //   - 6: White
         //   - 7: Brown
         int color(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_col_color);
+            if (do_set_mode) require_mode(mode_col_color);
             return value(0);
         }
+        std::future<int> async_color(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_col_color);
+            return async_value(0);
+        }
 
         // Red, green, and blue components of the detected color, in the range 0-1020.
         std::tuple<int, int, int> raw(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_rgb_raw);
+            if (do_set_mode) require_mode(mode_rgb_raw);
             return std::make_tuple( value(0), value(1), value(2) );
         }
 
         // Red component of the detected color, in the range 0-1020.
         int red(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_rgb_raw);
+            if (do_set_mode) require_mode(mode_rgb_raw);
             return value(0);
         }
+        std::future<int> async_red(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_rgb_raw);
+            return async_value(0);
+        }
 
         // Green component of the detected color, in the range 0-1020.
         int green(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_rgb_raw);
+            if (do_set_mode) require_mode(mode_rgb_raw);
             return value(1);
         }
+        std::future<int> async_green(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_rgb_raw);
+            return async_value(1);
+        }
 
         // Blue component of the detected color, in the range 0-1020.
         int blue(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_rgb_raw);
+            if (do_set_mode) require_mode(mode_rgb_raw);
             return value(2);
         }
+        std::future<int> async_blue(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_rgb_raw);
+            return async_value(2);
+        }
 };
 
 //-----------------------------------------------------------------------------
@@ -430,23 +1230,42 @@ class ultrasonic_sensor : public sensor {
         // Measurement of the distance detected by the sensor,
         // in centimeters.
         float distance_centimeters(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_us_dist_cm);
+            if (do_set_mode) require_mode(mode_us_dist_cm);
             return float_value(0);
         }
+        std::future<float> async_distance_centimeters(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_us_dist_cm);
+            return async_float_value(0);
+        }
 
         // Measurement of the distance detected by the sensor,
         // in inches.
         float distance_inches(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_us_dist_in);
+            if (do_set_mode) require_mode(mode_us_dist_in);
             return float_value(0);
         }
+        std::future<float> async_distance_inches(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_us_dist_in);
+            return async_float_value(0);
+        }
+
+        // Starts a single measurement, in centimeters or inches, and reads
+        // its result on the I/O thread.
+        std::future<float> async_distance_centimeters_ping() { return async_ping(mode_us_si_cm); }
+        std::future<float> async_distance_inches_ping()      { return async_ping(mode_us_si_in); }
 
         // Value indicating whether another ultrasonic sensor could
         // be heard nearby.
         bool other_sensor_present(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_us_listen);
+            if (do_set_mode) require_mode(mode_us_listen);
             return value(0);
         }
+
+    private:
+        std::future<float> async_ping(const char *mode) {
+            require_mode(mode, true);
+            return async_float_value(0);
+        }
 };
 
 //-----------------------------------------------------------------------------
@@ -481,32 +1300,48 @@ class gyro_sensor : public sensor {
         // The number of degrees that the sensor has been rotated
         // since it was put into this mode.
         int angle(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_gyro_ang);
+            if (do_set_mode) require_mode(mode_gyro_ang);
             return value(0);
         }
+        std::future<int> async_angle(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_gyro_ang);
+            return async_value(0);
+        }
 
         // The rate at which the sensor is rotating, in degrees/second.
         int rate(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_gyro_rate);
+            if (do_set_mode) require_mode(mode_gyro_rate);
             return value(0);
         }
+        std::future<int> async_rate(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_gyro_rate);
+            return async_value(0);
+        }
 
         // Angle (degrees) and Rotational Speed (degrees/second).
         std::tuple<int, int> rate_and_angle(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_gyro_g_a);
+            if (do_set_mode) require_mode(mode_gyro_g_a);
             return std::make_tuple( value(0), value(1) );
         }
 
         int tilt_angle(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_tilt_ang);
+            if (do_set_mode) require_mode(mode_tilt_ang);
             return value(0);
         }
+        std::future<int> async_tilt_angle(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_tilt_ang);
+            return async_value(0);
+        }
 
         // The rate at which the sensor is rotating, in degrees/second.
         int tilt_rate(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_tilt_rate);
+            if (do_set_mode) require_mode(mode_tilt_rate);
             return value(0);
         }
+        std::future<int> async_tilt_rate(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_tilt_rate);
+            return async_value(0);
+        }
 };
 
 //-----------------------------------------------------------------------------
@@ -535,9 +1370,13 @@ class infrared_sensor : public sensor {
         // A measurement of the distance between the sensor and the remote,
         // as a percentage. 100% is approximately 70cm/27in.
         int proximity(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_ir_prox);
+            if (do_set_mode) require_mode(mode_ir_prox);
             return value(0);
         }
+        std::future<int> async_proximity(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_ir_prox);
+            return async_value(0);
+        }
 };
 
 //-----------------------------------------------------------------------------
@@ -557,16 +1396,24 @@ class sound_sensor : public sensor {
         // A measurement of the measured sound pressure level, as a
         // percent. Uses a flat weighting.
         float sound_pressure(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_db);
+            if (do_set_mode) require_mode(mode_db);
             return float_value(0);
         }
+        std::future<float> async_sound_pressure(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_db);
+            return async_float_value(0);
+        }
 
         // A measurement of the measured sound pressure level, as a
         // percent. Uses A-weighting, which focuses on levels up to 55 dB.
         float sound_pressure_low(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_dba);
+            if (do_set_mode) require_mode(mode_dba);
             return float_value(0);
         }
+        std::future<float> async_sound_pressure_low(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_dba);
+            return async_float_value(0);
+        }
 };
 
 //-----------------------------------------------------------------------------
@@ -585,15 +1432,23 @@ class light_sensor : public sensor {
 
         // A measurement of the reflected light intensity, as a percentage.
         float reflected_light_intensity(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_reflect);
+            if (do_set_mode) require_mode(mode_reflect);
             return float_value(0);
         }
+        std::future<float> async_reflected_light_intensity(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_reflect);
+            return async_float_value(0);
+        }
 
         // A measurement of the ambient light intensity, as a percentage.
         float ambient_light_intensity(bool do_set_mode = true) {
-            if (do_set_mode) set_mode(mode_ambient);
+            if (do_set_mode) require_mode(mode_ambient);
             return float_value(0);
         }
+        std::future<float> async_ambient_light_intensity(bool do_set_mode = true) {
+            if (do_set_mode) require_mode(mode_ambient);
+            return async_float_value(0);
+        }
 };
 
 //-----------------------------------------------------------------------------
@@ -620,6 +1475,9 @@ class motor : protected device {
 
         using device::connected;
         using device::device_index;
+        using device::set_shadowing;
+        using device::shadowing;
+        using device::invalidate_shadow;
 
         // Run the motor until another command is sent.
         static char command_run_forever[];
@@ -694,15 +1552,91 @@ class motor : protected device {
         // will `push back` to maintain its position.
         static char stop_action_hold[];
 
+        // Fields of a motor sample.
+        enum sample_field {
+            sample_position   = (1 << 0),
+            sample_speed      = (1 << 1),
+            sample_duty_cycle = (1 << 2),
+            sample_state      = (1 << 3),
+            sample_all        = sample_position | sample_speed |
+                                sample_duty_cycle | sample_state
+        };
+
+        // Feedback of the motor, read in one batch. Fields that were not
+        // requested are left zero/empty.
+        struct sample {
+            std::chrono::steady_clock::time_point timestamp;
+            int         position;
+            int         speed;
+            int         duty_cycle;
+            motor_state state;
+        };
+
+        // Reads the requested `sample_field`s in one batch. All fields share
+        // one timestamp.
+        sample snapshot(unsigned fields = sample_all) const;
+
+        // Blocks until the `state` attribute differs from `state` or the timeout
+        // expires, then stores the current state in `state`. Returns true if
+        // the state changed. Sleeps on sysfs change notifications where the
+        // driver sends them, and polls at an adaptive rate otherwise.
+        bool wait_state_change(mode_set &state,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) const;
+
+        // Block until any of the `motor_state` flags in `mask` is set, or
+        // until none of them is set, or until the timeout expires. Return
+        // false on timeout. They sleep on sysfs change notifications where
+        // the driver sends them, rereading the state every 50 ms in case it
+        // misses some. Otherwise they reread the state for a short while and
+        // then poll with a growing interval, starting well below a
+        // millisecond:
+        //
+        //     m.run_to_rel_pos();
+        //     m.wait_while(ev3::motor_state::running);
+        bool wait_until(unsigned mask,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) const;
+        bool wait_while(unsigned mask,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) const;
+
+        // Collects setpoints and a command and stores them in one go, the
+        // command last, so the motor starts with all of its new setpoints.
+        // Nothing is written before commit() or one of the run commands:
+        //
+        //     m.batch().set_position_sp(x).set_speed_sp(s).run_to_rel_pos();
+        class command_batch : public command_batch_base<command_batch> {
+            public:
+                command_batch& set_duty_cycle_sp(int v)         { _batch.set(attr_duty_cycle_sp, v); return *this; }
+                command_batch& set_position_sp(int v)           { _batch.set(attr_position_sp,   v); return *this; }
+                command_batch& set_speed_sp(int v)              { _batch.set(attr_speed_sp,      v); return *this; }
+                command_batch& set_ramp_up_sp(int v)            { _batch.set("ramp_up_sp",       v); return *this; }
+                command_batch& set_ramp_down_sp(int v)          { _batch.set("ramp_down_sp",     v); return *this; }
+                command_batch& set_stop_action(std::string v)   { _batch.set(attr_stop_action,   v); return *this; }
+                command_batch& set_time_sp(int v)               { _batch.set("time_sp",          v); return *this; }
+
+                void run_forever()    { set_command("run-forever");    commit(); }
+                void run_to_abs_pos() { set_command("run-to-abs-pos"); commit(); }
+                void run_to_rel_pos() { set_command("run-to-rel-pos"); commit(); }
+                void run_timed()      { set_command("run-timed");      commit(); }
+                void run_direct()     { set_command("run-direct");     commit(); }
+                void stop()           { set_command("stop");           commit(); }
+
+            private:
+                friend class motor;
+
+                explicit command_batch(motor &m) : command_batch_base(m) {}
+        };
+
+        command_batch batch() { return command_batch(*this); }
+
         // Address: read-only
         // Returns the name of the port that this motor is connected to.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_string(const_address); }
 
         // Command: write-only
         // Sends a command to the motor controller. See `commands` for a list of
         // possible values.
         motor& set_command(std::string v) {
-            set_attr_string("command", v);
+            set_attr_string(attr_command, v);
             return *this;
         }
 
@@ -726,36 +1660,39 @@ class motor : protected device {
         //   action specified by `stop_action`.
         // - `reset` will reset all of the motor parameter attributes to their default value.
         //   This will also have the effect of stopping the motor.
-        mode_set commands() const { return get_attr_set("commands"); }
+        // The set is kept by the device until it reconnects or is assigned to.
+        const token_set& commands() const { return get_attr_set(const_commands); }
 
         // Count Per Rot: read-only
         // Returns the number of tacho counts in one rotation of the motor. Tacho counts
         // are used by the position and speed attributes, so you can use this value
         // to convert rotations or degrees to tacho counts. (rotation motors only)
-        int count_per_rot() const { return get_attr_int("count_per_rot"); }
+        int count_per_rot() const { return get_attr_int(const_count_per_rot); }
 
         // Count Per M: read-only
         // Returns the number of tacho counts in one meter of travel of the motor. Tacho
         // counts are used by the position and speed attributes, so you can use this
         // value to convert from distance to tacho counts. (linear motors only)
-        int count_per_m() const { return get_attr_int("count_per_m"); }
+        int count_per_m() const { return get_attr_int(const_count_per_m); }
 
         // Driver Name: read-only
         // Returns the name of the driver that provides this tacho motor device.
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_string(const_driver_name); }
 
         // Duty Cycle: read-only
         // Returns the current duty cycle of the motor. Units are percent. Values
         // are -100 to 100.
-        int duty_cycle() const { return get_attr_int("duty_cycle"); }
+        int duty_cycle() const { return get_attr_int(attr_duty_cycle); }
+        std::future<int> async_duty_cycle() const { return async_get_attr_int("duty_cycle"); }
 
         // Duty Cycle SP: read/write
         // Writing sets the duty cycle setpoint. Reading returns the current value.
         // Units are in percent. Valid values are -100 to 100. A negative value causes
         // the motor to rotate in reverse.
-        int duty_cycle_sp() const { return get_attr_int("duty_cycle_sp"); }
+        int duty_cycle_sp() const { return get_attr_int(attr_duty_cycle_sp); }
+        std::future<int> async_duty_cycle_sp() const { return async_get_attr_int("duty_cycle_sp"); }
         motor& set_duty_cycle_sp(int v) {
-            set_attr_int("duty_cycle_sp", v);
+            set_attr_int(attr_duty_cycle_sp, v);
             return *this;
         }
 
@@ -763,7 +1700,7 @@ class motor : protected device {
         // Returns the number of tacho counts in the full travel of the motor. When
         // combined with the `count_per_m` atribute, you can use this value to
         // calculate the maximum travel distance of the motor. (linear motors only)
-        int full_travel_count() const { return get_attr_int("full_travel_count"); }
+        int full_travel_count() const { return get_attr_int(const_full_travel_count); }
 
         // Polarity: read/write
         // Sets the polarity of the motor. With `normal` polarity, a positive duty
@@ -771,6 +1708,7 @@ class motor : protected device {
         // a positive duty cycle will cause the motor to rotate counter-clockwise.
         // Valid values are `normal` and `inversed`.
         std::string polarity() const { return get_attr_string("polarity"); }
+        std::future<std::string> async_polarity() const { return async_get_attr_string("polarity"); }
         motor& set_polarity(std::string v) {
             set_attr_string("polarity", v);
             return *this;
@@ -781,7 +1719,8 @@ class motor : protected device {
         // encoder. When the motor rotates clockwise, the position will increase.
         // Likewise, rotating counter-clockwise causes the position to decrease.
         // Writing will set the position to that value.
-        int position() const { return get_attr_int("position"); }
+        int position() const { return get_attr_int(attr_position); }
+        std::future<int> async_position() const { return async_get_attr_int("position"); }
         motor& set_position(int v) {
             set_attr_int("position", v);
             return *this;
@@ -790,6 +1729,7 @@ class motor : protected device {
         // Position P: read/write
         // The proportional constant for the position PID.
         int position_p() const { return get_attr_int("hold_pid/Kp"); }
+        std::future<int> async_position_p() const { return async_get_attr_int("hold_pid/Kp"); }
         motor& set_position_p(int v) {
             set_attr_int("hold_pid/Kp", v);
             return *this;
@@ -798,6 +1738,7 @@ class motor : protected device {
         // Position I: read/write
         // The integral constant for the position PID.
         int position_i() const { return get_attr_int("hold_pid/Ki"); }
+        std::future<int> async_position_i() const { return async_get_attr_int("hold_pid/Ki"); }
         motor& set_position_i(int v) {
             set_attr_int("hold_pid/Ki", v);
             return *this;
@@ -806,6 +1747,7 @@ class motor : protected device {
         // Position D: read/write
         // The derivative constant for the position PID.
         int position_d() const { return get_attr_int("hold_pid/Kd"); }
+        std::future<int> async_position_d() const { return async_get_attr_int("hold_pid/Kd"); }
         motor& set_position_d(int v) {
             set_attr_int("hold_pid/Kd", v);
             return *this;
@@ -816,9 +1758,10 @@ class motor : protected device {
         // commands. Reading returns the current value. Units are in tacho counts. You
         // can use the value returned by `counts_per_rot` to convert tacho counts to/from
         // rotations or degrees.
-        int position_sp() const { return get_attr_int("position_sp"); }
+        int position_sp() const { return get_attr_int(attr_position_sp); }
+        std::future<int> async_position_sp() const { return async_get_attr_int("position_sp"); }
         motor& set_position_sp(int v) {
-            set_attr_int("position_sp", v);
+            set_attr_int(attr_position_sp, v);
             return *this;
         }
 
@@ -826,13 +1769,14 @@ class motor : protected device {
         // Returns the maximum value that is accepted by the `speed_sp` attribute. This
         // may be slightly different than the maximum speed that a particular motor can
         // reach - it's the maximum theoretical speed.
-        int max_speed() const { return get_attr_int("max_speed"); }
+        int max_speed() const { return get_attr_int(const_max_speed); }
 
         // Speed: read-only
         // Returns the current motor speed in tacho counts per second. Note, this is
         // not necessarily degrees (although it is for LEGO motors). Use the `count_per_rot`
         // attribute to convert this value to RPM or deg/sec.
-        int speed() const { return get_attr_int("speed"); }
+        int speed() const { return get_attr_int(attr_speed); }
+        std::future<int> async_speed() const { return async_get_attr_int("speed"); }
 
         // Speed SP: read/write
         // Writing sets the target speed in tacho counts per second used for all `run-*`
@@ -841,9 +1785,10 @@ class motor : protected device {
         // commands where the sign is ignored. Use the `count_per_rot` attribute to convert
         // RPM or deg/sec to tacho counts per second. Use the `count_per_m` attribute to
         // convert m/s to tacho counts per second.
-        int speed_sp() const { return get_attr_int("speed_sp"); }
+        int speed_sp() const { return get_attr_int(attr_speed_sp); }
+        std::future<int> async_speed_sp() const { return async_get_attr_int("speed_sp"); }
         motor& set_speed_sp(int v) {
-            set_attr_int("speed_sp", v);
+            set_attr_int(attr_speed_sp, v);
             return *this;
         }
 
@@ -854,6 +1799,7 @@ class motor : protected device {
         // setpoint. The actual ramp time is the ratio of the difference between the
         // `speed_sp` and the current `speed` and max_speed multiplied by `ramp_up_sp`.
         int ramp_up_sp() const { return get_attr_int("ramp_up_sp"); }
+        std::future<int> async_ramp_up_sp() const { return async_get_attr_int("ramp_up_sp"); }
         motor& set_ramp_up_sp(int v) {
             set_attr_int("ramp_up_sp", v);
             return *this;
@@ -866,6 +1812,7 @@ class motor : protected device {
         // setpoint. The actual ramp time is the ratio of the difference between the
         // `speed_sp` and the current `speed` and max_speed multiplied by `ramp_down_sp`.
         int ramp_down_sp() const { return get_attr_int("ramp_down_sp"); }
+        std::future<int> async_ramp_down_sp() const { return async_get_attr_int("ramp_down_sp"); }
         motor& set_ramp_down_sp(int v) {
             set_attr_int("ramp_down_sp", v);
             return *this;
@@ -874,6 +1821,7 @@ class motor : protected device {
         // Speed P: read/write
         // The proportional constant for the speed regulation PID.
         int speed_p() const { return get_attr_int("speed_pid/Kp"); }
+        std::future<int> async_speed_p() const { return async_get_attr_int("speed_pid/Kp"); }
         motor& set_speed_p(int v) {
             set_attr_int("speed_pid/Kp", v);
             return *this;
@@ -882,6 +1830,7 @@ class motor : protected device {
         // Speed I: read/write
         // The integral constant for the speed regulation PID.
         int speed_i() const { return get_attr_int("speed_pid/Ki"); }
+        std::future<int> async_speed_i() const { return async_get_attr_int("speed_pid/Ki"); }
         motor& set_speed_i(int v) {
             set_attr_int("speed_pid/Ki", v);
             return *this;
@@ -890,6 +1839,7 @@ class motor : protected device {
         // Speed D: read/write
         // The derivative constant for the speed regulation PID.
         int speed_d() const { return get_attr_int("speed_pid/Kd"); }
+        std::future<int> async_speed_d() const { return async_get_attr_int("speed_pid/Kd"); }
         motor& set_speed_d(int v) {
             set_attr_int("speed_pid/Kd", v);
             return *this;
@@ -898,16 +1848,22 @@ class motor : protected device {
         // State: read-only
         // Reading returns a list of state flags. Possible flags are
         // `running`, `ramping`, `holding`, `overloaded` and `stalled`.
-        mode_set state() const { return get_attr_set("state"); }
+        mode_set state() const { return get_attr_set(attr_state); }
+        std::future<mode_set> async_state() const { return async_get_attr_set("state"); }
+
+        // The same flags as a bit mask, read without allocating.
+        motor_state state_bits() const { return get_attr_state(attr_state); }
+        std::future<motor_state> async_state_bits() const { return async_get_attr_state(attr_state); }
 
         // Stop Action: read/write
         // Reading returns the current stop action. Writing sets the stop action.
         // The value determines the motors behavior when `command` is set to `stop`.
         // Also, it determines the motors behavior when a run command completes. See
         // `stop_actions` for a list of possible values.
-        std::string stop_action() const { return get_attr_string("stop_action"); }
+        std::string stop_action() const { return get_attr_line(attr_stop_action); }
+        std::future<std::string> async_stop_action() const { return async_get_attr_line("stop_action"); }
         motor& set_stop_action(std::string v) {
-            set_attr_string("stop_action", v);
+            set_attr_string(attr_stop_action, v);
             return *this;
         }
 
@@ -922,13 +1878,15 @@ class motor : protected device {
         // power from the motor. Instead it actively tries to hold the motor at the current
         // position. If an external force tries to turn the motor, the motor will 'push
         // back' to maintain its position.
-        mode_set stop_actions() const { return get_attr_set("stop_actions"); }
+        // The set is kept by the device until it reconnects or is assigned to.
+        const token_set& stop_actions() const { return get_attr_set(const_stop_actions); }
 
         // Time SP: read/write
         // Writing specifies the amount of time the motor will run when using the
         // `run-timed` command. Reading returns the current value. Units are in
         // milliseconds.
         int time_sp() const { return get_attr_int("time_sp"); }
+        std::future<int> async_time_sp() const { return async_get_attr_int("time_sp"); }
         motor& set_time_sp(int v) {
             set_attr_int("time_sp", v);
             return *this;
@@ -968,6 +1926,16 @@ class motor : protected device {
         motor() {}
 
         bool connect(const std::map<std::string, std::set<std::string>>&) noexcept;
+
+    private:
+        // The two halves of snapshot(), also used by sample_group.
+        size_t sample_reads(unsigned fields, attr_request *reads) const;
+        void   parse_sample(const attr_request *reads, size_t count, sample &s) const;
+
+        friend class event_loop;
+        friend class sample_group;
+        friend class sampler;
+        friend class recorder;
 };
 
 //-----------------------------------------------------------------------------
@@ -994,6 +1962,153 @@ class nxt_motor : public motor {
         nxt_motor(address_type address = OUTPUT_AUTO);
 };
 
+//-----------------------------------------------------------------------------
+// Samples several motors and sensors at once, typically once per control
+// tick. All the attributes are read in one batch; with the io_uring backend
+// that is a single system call. The devices must outlive the group:
+//
+//     ev3::sample_group tick;
+//     const size_t l = tick.add(left_motor), g = tick.add(gyro, 2);
+//
+//     for(;;) {
+//         tick.read();
+//         int pos  = tick.motor_sample(l).position;
+//         int rate = tick.sensor_sample(g).values[1];
+//     }
+//-----------------------------------------------------------------------------
+class sample_group {
+    public:
+        // Add a motor with the `motor::sample_field`s to read, or a sensor
+        // with the number of values to read. Return the index of the sample.
+        size_t add(const motor &m, unsigned fields = motor::sample_all);
+        size_t add(const sensor &s, unsigned count = 1, bool with_mode = false);
+
+        // Reads all the samples. Returns their common timestamp.
+        std::chrono::steady_clock::time_point read();
+
+        const motor::sample&  motor_sample (size_t index) const { return _motors[index].s; }
+        const sensor::sample& sensor_sample(size_t index) const { return _sensors[index].s; }
+
+    private:
+        struct motor_entry {
+            const motor   *dev;
+            unsigned       fields;
+            size_t         first, count;
+            motor::sample  s;
+        };
+
+        struct sensor_entry {
+            const sensor   *dev;
+            unsigned        num_values;
+            bool            with_mode;
+            size_t          first, count;
+            sensor::sample  s;
+        };
+
+        std::vector<motor_entry>  _motors;
+        std::vector<sensor_entry> _sensors;
+
+        std::vector<device::attr_request> _reads;
+        std::vector<device::attr_reads>   _batch;
+};
+
+//-----------------------------------------------------------------------------
+// Samples sensor values and motor position and speed on a thread of its own,
+// each channel at its own rate. Every sample is stamped with the monotonic
+// clock (steady_clock) and queued in a ring of its channel, so that control
+// code reads the latest values from memory instead of sysfs:
+//
+//     ev3::sampler s;
+//     const size_t pos  = s.add_position(m, std::chrono::milliseconds(2));
+//     const size_t dist = s.add_value(ir, 0, std::chrono::milliseconds(20));
+//     s.start();
+//
+//     ev3::sampler::sample v;
+//     if (s.latest(pos, v)) ...  // the newest sample
+//     while (s.pop(dist, v)) ... // the history, oldest first
+//
+// Channels are added before start(). latest() may be called from any thread,
+// pop() from one thread per channel. The devices are read through handles of
+// the sampler's own and must stay connected while it runs.
+//-----------------------------------------------------------------------------
+class sampler {
+    public:
+        struct sample {
+            std::chrono::steady_clock::time_point timestamp;
+            int value;
+        };
+
+        // Samples kept per channel until they are popped.
+        static constexpr size_t history = 256;
+
+        sampler() {}
+        ~sampler();
+
+        sampler(const sampler&) = delete;
+        sampler& operator=(const sampler&) = delete;
+
+        // Add a channel sampled every `period`. Return its index.
+        size_t add_value   (const sensor &s, unsigned index, std::chrono::microseconds period);
+        size_t add_position(const motor  &m, std::chrono::microseconds period);
+        size_t add_speed   (const motor  &m, std::chrono::microseconds period);
+
+        // Starts the sampling thread.
+        void start();
+
+        // Stops the sampling thread. Rethrows the error that stopped it, if
+        // any (a device that went away, for instance).
+        void stop();
+
+        bool running() const { return _thread.joinable(); }
+
+        // The newest sample of the channel. Returns false if there is none yet.
+        bool latest(size_t channel, sample &s) const;
+
+        // Takes the oldest queued sample. Returns false if there is none.
+        bool pop(size_t channel, sample &s) { return _channels.at(channel)->ring.pop(s); }
+
+        // Number of samples not queued because the ring of the channel was
+        // full. latest() sees them all the same.
+        unsigned long dropped(size_t channel) const {
+            return _channels.at(channel)->dropped.load(std::memory_order_relaxed);
+        }
+
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct channel_state {
+            size_t            dev;  // index into _devices
+            device::attr_slot slot;
+            clock::duration   period;
+            clock::time_point due;
+
+            // The latest sample, under a sequence lock: odd while written.
+            std::atomic<unsigned>  seq;
+            std::atomic<long long> stamp;
+            std::atomic<int>       value;
+
+            std::atomic<unsigned long>  dropped;
+            spsc_ring<sample, history>  ring;
+
+#ifndef __cpp_aligned_new
+            // The ring is aligned beyond what plain new guarantees before
+            // C++17; from then on new honours the alignment by itself.
+            static void* operator new(size_t size);
+            static void  operator delete(void *p);
+#endif
+        };
+
+        size_t add(const device &d, device::attr_slot slot, std::chrono::microseconds period);
+        void   run();
+
+        std::vector<std::unique_ptr<device>>        _devices;
+        std::vector<std::unique_ptr<channel_state>> _channels;
+
+        std::thread        _thread;
+        int                _wakeup = -1;
+        std::exception_ptr _error;
+};
+
 //-----------------------------------------------------------------------------
 // The DC motor class provides a uniform interface for using regular DC motors
 // with no fancy controls or feedback. This includes LEGO MINDSTORMS RCX motors
@@ -1005,6 +2120,9 @@ class dc_motor : protected device {
 
         using device::connected;
         using device::device_index;
+        using device::set_shadowing;
+        using device::shadowing;
+        using device::invalidate_shadow;
 
         // Run the motor until another command is sent.
         static char command_run_forever[];
@@ -1039,47 +2157,75 @@ class dc_motor : protected device {
         // cause the motor to stop more quickly than coasting.
         static char stop_action_brake[];
 
+        // Collects setpoints and a command and stores them in one go, the
+        // command last. Nothing is written before commit() or one of the
+        // run commands.
+        class command_batch : public command_batch_base<command_batch> {
+            public:
+                command_batch& set_duty_cycle_sp(int v)         { _batch.set(attr_duty_cycle_sp, v); return *this; }
+                command_batch& set_ramp_up_sp(int v)            { _batch.set("ramp_up_sp",       v); return *this; }
+                command_batch& set_ramp_down_sp(int v)          { _batch.set("ramp_down_sp",     v); return *this; }
+                command_batch& set_stop_action(std::string v)   { _batch.set(attr_stop_action,   v); return *this; }
+                command_batch& set_time_sp(int v)               { _batch.set("time_sp",          v); return *this; }
+
+                void run_forever() { set_command("run-forever"); commit(); }
+                void run_timed()   { set_command("run-timed");   commit(); }
+                void run_direct()  { set_command("run-direct");  commit(); }
+                void stop()        { set_command("stop");        commit(); }
+
+            private:
+                friend class dc_motor;
+
+                explicit command_batch(dc_motor &m) : command_batch_base(m) {}
+        };
+
+        command_batch batch() { return command_batch(*this); }
+
         // Address: read-only
         // Returns the name of the port that this motor is connected to.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_string(const_address); }
 
         // Command: write-only
         // Sets the command for the motor. Possible values are `run-forever`, `run-timed` and
         // `stop`. Not all commands may be supported, so be sure to check the contents
         // of the `commands` attribute.
         dc_motor& set_command(std::string v) {
-            set_attr_string("command", v);
+            set_attr_string(attr_command, v);
             return *this;
         }
 
         // Commands: read-only
         // Returns a list of commands supported by the motor
         // controller.
-        mode_set commands() const { return get_attr_set("commands"); }
+        // The set is kept by the device until it reconnects or is assigned to.
+        const token_set& commands() const { return get_attr_set(const_commands); }
 
         // Driver Name: read-only
         // Returns the name of the motor driver that loaded this device. See the list
         // of [supported devices] for a list of drivers.
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_string(const_driver_name); }
 
         // Duty Cycle: read-only
         // Shows the current duty cycle of the PWM signal sent to the motor. Values
         // are -100 to 100 (-100% to 100%).
-        int duty_cycle() const { return get_attr_int("duty_cycle"); }
+        int duty_cycle() const { return get_attr_int(attr_duty_cycle); }
+        std::future<int> async_duty_cycle() const { return async_get_attr_int("duty_cycle"); }
 
         // Duty Cycle SP: read/write
         // Writing sets the duty cycle setpoint of the PWM signal sent to the motor.
         // Valid values are -100 to 100 (-100% to 100%). Reading returns the current
         // setpoint.
-        int duty_cycle_sp() const { return get_attr_int("duty_cycle_sp"); }
+        int duty_cycle_sp() const { return get_attr_int(attr_duty_cycle_sp); }
+        std::future<int> async_duty_cycle_sp() const { return async_get_attr_int("duty_cycle_sp"); }
         dc_motor& set_duty_cycle_sp(int v) {
-            set_attr_int("duty_cycle_sp", v);
+            set_attr_int(attr_duty_cycle_sp, v);
             return *this;
         }
 
         // Polarity: read/write
         // Sets the polarity of the motor. Valid values are `normal` and `inversed`.
         std::string polarity() const { return get_attr_string("polarity"); }
+        std::future<std::string> async_polarity() const { return async_get_attr_string("polarity"); }
         dc_motor& set_polarity(std::string v) {
             set_attr_string("polarity", v);
             return *this;
@@ -1089,6 +2235,7 @@ class dc_motor : protected device {
         // Sets the time in milliseconds that it take the motor to ramp down from 100%
         // to 0%. Valid values are 0 to 10000 (10 seconds). Default is 0.
         int ramp_down_sp() const { return get_attr_int("ramp_down_sp"); }
+        std::future<int> async_ramp_down_sp() const { return async_get_attr_int("ramp_down_sp"); }
         dc_motor& set_ramp_down_sp(int v) {
             set_attr_int("ramp_down_sp", v);
             return *this;
@@ -1098,6 +2245,7 @@ class dc_motor : protected device {
         // Sets the time in milliseconds that it take the motor to up ramp from 0% to
         // 100%. Valid values are 0 to 10000 (10 seconds). Default is 0.
         int ramp_up_sp() const { return get_attr_int("ramp_up_sp"); }
+        std::future<int> async_ramp_up_sp() const { return async_get_attr_int("ramp_up_sp"); }
         dc_motor& set_ramp_up_sp(int v) {
             set_attr_int("ramp_up_sp", v);
             return *this;
@@ -1108,26 +2256,33 @@ class dc_motor : protected device {
         // flags are `running` and `ramping`. `running` indicates that the motor is
         // powered. `ramping` indicates that the motor has not yet reached the
         // `duty_cycle_sp`.
-        mode_set state() const { return get_attr_set("state"); }
+        mode_set state() const { return get_attr_set(attr_state); }
+        std::future<mode_set> async_state() const { return async_get_attr_set("state"); }
+
+        // The same flags as a bit mask, read without allocating.
+        motor_state state_bits() const { return get_attr_state(attr_state); }
+        std::future<motor_state> async_state_bits() const { return async_get_attr_state(attr_state); }
 
         // Stop Action: write-only
         // Sets the stop action that will be used when the motor stops. Read
         // `stop_actions` to get the list of valid values.
         dc_motor& set_stop_action(std::string v) {
-            set_attr_string("stop_action", v);
+            set_attr_string(attr_stop_action, v);
             return *this;
         }
 
         // Stop Actions: read-only
         // Gets a list of stop actions. Valid values are `coast`
         // and `brake`.
-        mode_set stop_actions() const { return get_attr_set("stop_actions"); }
+        // The set is kept by the device until it reconnects or is assigned to.
+        const token_set& stop_actions() const { return get_attr_set(const_stop_actions); }
 
         // Time SP: read/write
         // Writing specifies the amount of time the motor will run when using the
         // `run-timed` command. Reading returns the current value. Units are in
         // milliseconds.
         int time_sp() const { return get_attr_int("time_sp"); }
+        std::future<int> async_time_sp() const { return async_get_attr_int("time_sp"); }
         dc_motor& set_time_sp(int v) {
             set_attr_int("time_sp", v);
             return *this;
@@ -1165,6 +2320,9 @@ class servo_motor : protected device {
 
         using device::connected;
         using device::device_index;
+        using device::set_shadowing;
+        using device::shadowing;
+        using device::invalidate_shadow;
 
         // Drive servo to the position set in the `position_sp` attribute.
         static char command_run[];
@@ -1180,23 +2338,45 @@ class servo_motor : protected device {
         // cause the motor to rotate counter-clockwise.
         static char polarity_inversed[];
 
+        // Collects setpoints and a command and stores them in one go, the
+        // command last. Nothing is written before commit() or one of the
+        // commands.
+        class command_batch : public command_batch_base<command_batch> {
+            public:
+                command_batch& set_max_pulse_sp(int v)          { _batch.set("max_pulse_sp",     v); return *this; }
+                command_batch& set_mid_pulse_sp(int v)          { _batch.set("mid_pulse_sp",     v); return *this; }
+                command_batch& set_min_pulse_sp(int v)          { _batch.set("min_pulse_sp",     v); return *this; }
+                command_batch& set_position_sp(int v)           { _batch.set(attr_position_sp,   v); return *this; }
+                command_batch& set_rate_sp(int v)               { _batch.set("rate_sp",          v); return *this; }
+
+                void run()    { set_command("run");   commit(); }
+                void float_() { set_command("float"); commit(); }
+
+            private:
+                friend class servo_motor;
+
+                explicit command_batch(servo_motor &m) : command_batch_base(m) {}
+        };
+
+        command_batch batch() { return command_batch(*this); }
+
         // Address: read-only
         // Returns the name of the port that this motor is connected to.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_string(const_address); }
 
         // Command: write-only
         // Sets the command for the servo. Valid values are `run` and `float`. Setting
         // to `run` will cause the servo to be driven to the position_sp set in the
         // `position_sp` attribute. Setting to `float` will remove power from the motor.
         servo_motor& set_command(std::string v) {
-            set_attr_string("command", v);
+            set_attr_string(attr_command, v);
             return *this;
         }
 
         // Driver Name: read-only
         // Returns the name of the motor driver that loaded this device. See the list
         // of [supported devices] for a list of drivers.
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_string(const_driver_name); }
 
         // Max Pulse SP: read/write
         // Used to set the pulse size in milliseconds for the signal that tells the
@@ -1204,6 +2384,7 @@ class servo_motor : protected device {
         // Valid values are 2300 to 2700. You must write to the position_sp attribute for
         // changes to this attribute to take effect.
         int max_pulse_sp() const { return get_attr_int("max_pulse_sp"); }
+        std::future<int> async_max_pulse_sp() const { return async_get_attr_int("max_pulse_sp"); }
         servo_motor& set_max_pulse_sp(int v) {
             set_attr_int("max_pulse_sp", v);
             return *this;
@@ -1217,6 +2398,7 @@ class servo_motor : protected device {
         // where the motor does not turn. You must write to the position_sp attribute for
         // changes to this attribute to take effect.
         int mid_pulse_sp() const { return get_attr_int("mid_pulse_sp"); }
+        std::future<int> async_mid_pulse_sp() const { return async_get_attr_int("mid_pulse_sp"); }
         servo_motor& set_mid_pulse_sp(int v) {
             set_attr_int("mid_pulse_sp", v);
             return *this;
@@ -1228,6 +2410,7 @@ class servo_motor : protected device {
         // is 600. Valid values are 300 to 700. You must write to the position_sp
         // attribute for changes to this attribute to take effect.
         int min_pulse_sp() const { return get_attr_int("min_pulse_sp"); }
+        std::future<int> async_min_pulse_sp() const { return async_get_attr_int("min_pulse_sp"); }
         servo_motor& set_min_pulse_sp(int v) {
             set_attr_int("min_pulse_sp", v);
             return *this;
@@ -1239,6 +2422,7 @@ class servo_motor : protected device {
         // inversed. i.e `-100` will correspond to `max_pulse_sp`, and `100` will
         // correspond to `min_pulse_sp`.
         std::string polarity() const { return get_attr_string("polarity"); }
+        std::future<std::string> async_polarity() const { return async_get_attr_string("polarity"); }
         servo_motor& set_polarity(std::string v) {
             set_attr_string("polarity", v);
             return *this;
@@ -1249,9 +2433,10 @@ class servo_motor : protected device {
         // servo to move to the specified position_sp. Units are percent. Valid values
         // are -100 to 100 (-100% to 100%) where `-100` corresponds to `min_pulse_sp`,
         // `0` corresponds to `mid_pulse_sp` and `100` corresponds to `max_pulse_sp`.
-        int position_sp() const { return get_attr_int("position_sp"); }
+        int position_sp() const { return get_attr_int(attr_position_sp); }
+        std::future<int> async_position_sp() const { return async_get_attr_int("position_sp"); }
         servo_motor& set_position_sp(int v) {
-            set_attr_int("position_sp", v);
+            set_attr_int(attr_position_sp, v);
             return *this;
         }
 
@@ -1263,6 +2448,7 @@ class servo_motor : protected device {
         // case reading and writing will fail with `-EOPNOTSUPP`. In continuous rotation
         // servos, this value will affect the rate_sp at which the speed ramps up or down.
         int rate_sp() const { return get_attr_int("rate_sp"); }
+        std::future<int> async_rate_sp() const { return async_get_attr_int("rate_sp"); }
         servo_motor& set_rate_sp(int v) {
             set_attr_int("rate_sp", v);
             return *this;
@@ -1272,7 +2458,12 @@ class servo_motor : protected device {
         // Returns a list of flags indicating the state of the servo.
         // Possible values are:
         // * `running`: Indicates that the motor is powered.
-        mode_set state() const { return get_attr_set("state"); }
+        mode_set state() const { return get_attr_set(attr_state); }
+        std::future<mode_set> async_state() const { return async_get_attr_set("state"); }
+
+        // The same flags as a bit mask, read without allocating.
+        motor_state state_bits() const { return get_attr_state(attr_state); }
+        std::future<motor_state> async_state_bits() const { return async_get_attr_state(attr_state); }
 
 
         // Drive servo to the position set in the `position_sp` attribute.
@@ -1295,11 +2486,12 @@ class led : protected device {
 
         // Max Brightness: read-only
         // Returns the maximum allowable brightness value.
-        int max_brightness() const { return get_attr_int("max_brightness"); }
+        int max_brightness() const { return get_attr_int(const_max_brightness); }
 
         // Brightness: read/write
         // Sets the brightness level. Possible values are from 0 to `max_brightness`.
         int brightness() const { return get_attr_int("brightness"); }
+        std::future<int> async_brightness() const { return async_get_attr_int("brightness"); }
         led set_brightness(int v) {
             set_attr_int("brightness", v);
             return *this;
@@ -1307,7 +2499,12 @@ class led : protected device {
 
         // Triggers: read-only
         // Returns a list of available triggers.
-        mode_set triggers() const { return get_attr_set("trigger"); }
+        token_set triggers() const { token_set t; get_attr_tokens("trigger", t); return t; }
+        std::future<mode_set> async_triggers() const { return async_get_attr_set("trigger"); }
+
+        // Rereads the available triggers into `tokens`, reusing its buffers,
+        // so a UI refreshing the list allocates nothing once they have grown.
+        const token_set& triggers(token_set &tokens) const { return get_attr_tokens("trigger", tokens); }
 
         // Trigger: read/write
         // Sets the led trigger. A trigger
@@ -1325,6 +2522,7 @@ class led : protected device {
         // trigger. However, if you set the brightness value to 0 it will
         // also disable the `timer` trigger.
         std::string trigger() const { return get_attr_from_set("trigger"); }
+        std::future<std::string> async_trigger() const { return async_get_attr_from_set("trigger"); }
         led set_trigger(std::string v) {
             set_attr_string("trigger", v);
             return *this;
@@ -1335,6 +2533,7 @@ class led : protected device {
         // 0 and the current brightness setting. The `on` time can
         // be specified via `delay_on` attribute in milliseconds.
         int delay_on() const { return get_attr_int("delay_on"); }
+        std::future<int> async_delay_on() const { return async_get_attr_int("delay_on"); }
         led set_delay_on(int v) {
             set_attr_int("delay_on", v);
             return *this;
@@ -1345,6 +2544,7 @@ class led : protected device {
         // 0 and the current brightness setting. The `off` time can
         // be specified via `delay_off` attribute in milliseconds.
         int delay_off() const { return get_attr_int("delay_off"); }
+        std::future<int> async_delay_off() const { return async_get_attr_int("delay_off"); }
         led set_delay_off(int v) {
             set_attr_int("delay_off", v);
             return *this;
@@ -1430,9 +2630,6 @@ class led : protected device {
         static void set_color(const std::vector<led*> &group, const std::vector<float> &color);
 
         static void all_off();
-
-    protected:
-        int _max_brightness = 0;
 };
 
 //-----------------------------------------------------------------------------
@@ -1448,22 +2645,28 @@ class power_supply : protected device {
         // Measured Current: read-only
         // The measured current that the battery is supplying (in microamps)
         int measured_current() const { return get_attr_int("current_now"); }
+        std::future<int> async_measured_current() const { return async_get_attr_int("current_now"); }
 
         // Measured Voltage: read-only
         // The measured voltage that the battery is supplying (in microvolts)
         int measured_voltage() const { return get_attr_int("voltage_now"); }
+        std::future<int> async_measured_voltage() const { return async_get_attr_int("voltage_now"); }
 
         // Max Voltage: read-only
         int max_voltage() const { return get_attr_int("voltage_max_design"); }
+        std::future<int> async_max_voltage() const { return async_get_attr_int("voltage_max_design"); }
 
         // Min Voltage: read-only
         int min_voltage() const { return get_attr_int("voltage_min_design"); }
+        std::future<int> async_min_voltage() const { return async_get_attr_int("voltage_min_design"); }
 
         // Technology: read-only
         std::string technology() const { return get_attr_string("technology"); }
+        std::future<std::string> async_technology() const { return async_get_attr_string("technology"); }
 
         // Type: read-only
         std::string type() const { return get_attr_string("type"); }
+        std::future<std::string> async_type() const { return async_get_attr_string("type"); }
 
         float measured_amps()       const { return measured_current() / 1000000.f; }
         float measured_volts()      const { return measured_voltage() / 1000000.f; }
@@ -1478,6 +2681,9 @@ class button {
     public:
         button(int bit);
 
+        // The key code of the button, e.g. KEY_ENTER.
+        int code() const { return _bit; }
+
         // Check if the button is pressed.
         bool pressed() const;
 
@@ -1501,20 +2707,167 @@ class button {
         // Returns true if any of the states have changed since the last call.
         static bool process_all();
 
+        // A key event of the EV3 buttons, stamped with the time the kernel
+        // saw it.
+        struct event {
+            enum event_type { release = 0, press = 1, repeat = 2 };
+
+            std::chrono::steady_clock::time_point timestamp;
+            int        code;
+            event_type type;
+        };
+
+        // All buttons share one input device, which is read as a stream of
+        // events. The last 64 events are kept, so that no press is lost
+        // between polls. Every consumer reads the stream with a cursor of its
+        // own: each button for process(), next_event(), and each
+        // event_reader, so they see the same events and may be mixed.
+        //
+        // A reader of the events of all keys, from the time it was created.
+        // A reader that falls more than 64 events behind skips the oldest.
+        class event_reader {
+            public:
+                event_reader();
+
+                // Takes the next event. Returns false if there is none.
+                bool next(event &e);
+
+            private:
+                unsigned long long _next;
+        };
+
+        // Takes the oldest event of any key not yet taken by next_event().
+        // Returns false if there is no event.
+        static bool next_event(event &e);
+
     private:
         int _bit;
         bool _state = false;
-        std::vector<unsigned long> _buf;
+        unsigned long long _next = 0; // the cursor of process()
+
+        class input_device;
+        static input_device& input();
+
+        friend class event_loop;
+        friend class button_events;
+};
 
-        struct file_descriptor {
-            int _fd;
+//-----------------------------------------------------------------------------
+// Recognizes presses, releases, clicks, double clicks, long presses and
+// chords of the EV3 buttons from the kernel timestamps of their key events.
+// The events are handed from a producer, which reads the buttons, to a
+// consumer through a lock-free queue:
+//
+//     ev3::button_events buttons;
+//     buttons.start(); // or call update() regularly
+//
+//     ev3::button_events::event e;
+//     while (buttons.next(e))
+//         if (e.type == ev3::button_events::long_press && e.buttons == ev3::button_events::enter)
+//             menu();
+//
+// A release closer than `debounce` to the next press of the same button is
+// ignored as bounce. A release after a press shorter than `long_press` is
+// also a click; a click that starts within `double_click` after the end of
+// the previous click of the button is also a double click. Buttons pressed
+// within `chord` of each other and held together form a chord; they produce
+// no clicks or long presses of their own. The key events are read with a
+// button::event_reader of its own, so this may be mixed with
+// button::process() and the other readers.
+//-----------------------------------------------------------------------------
+class button_events {
+    public:
+        struct timing {
+            std::chrono::milliseconds debounce     = std::chrono::milliseconds(20);
+            std::chrono::milliseconds long_press   = std::chrono::milliseconds(600);
+            std::chrono::milliseconds double_click = std::chrono::milliseconds(300);
+            std::chrono::milliseconds chord        = std::chrono::milliseconds(60);
+        };
+
+        enum event_type { press, release, click, double_click, long_press, chord };
+
+        // Bits of event::buttons.
+        enum button_bits {
+            back  = 1 << 0,
+            left  = 1 << 1,
+            right = 1 << 2,
+            up    = 1 << 3,
+            down  = 1 << 4,
+            enter = 1 << 5
+        };
 
-            file_descriptor(const char *path, int flags);
-            ~file_descriptor();
-            operator int() { return _fd; }
+        struct event {
+            std::chrono::steady_clock::time_point timestamp;
+            event_type type;
+            unsigned   buttons;
         };
 
-        std::shared_ptr<file_descriptor> _fd;
+        button_events();
+        explicit button_events(const timing &t);
+        ~button_events();
+
+        button_events(const button_events&) = delete;
+        button_events& operator=(const button_events&) = delete;
+
+        // Producer: reads the pending key events and queues the events
+        // recognized up to now. Returns true if any were queued. Must be
+        // called again by deadline() for timed events to be reported on time.
+        bool update();
+
+        // Producer: recognizes the key events `events`, stamped as read from
+        // the buttons, and the timed events up to `now`, instead of reading
+        // the buttons. Lets other sources and tests drive the recognizer.
+        bool update(const button::event *events, size_t count,
+                std::chrono::steady_clock::time_point now);
+
+        // The time of the next event that depends on time alone (long
+        // press, end of a chord or bounce window), time_point::max() if none.
+        std::chrono::steady_clock::time_point deadline() const;
+
+        // Starts a thread that sleeps on the buttons and calls update().
+        void start();
+
+        // Stops the thread started by start().
+        void stop();
+
+        // Consumer: takes the oldest event. Returns false if there is none.
+        bool next(event &e) { return _queue.pop(e); }
+
+        // Number of events dropped because the queue was full.
+        unsigned long dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+    private:
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        struct key_state {
+            int        code = -1;
+            bool       down = false;
+            bool       release_pending = false;
+            bool       long_fired = false;
+            bool       in_chord = false;
+            bool       clicked = false;
+            time_point pressed, released, last_click;
+        };
+
+        void feed(const button::event &e);
+        void on_press  (unsigned k, time_point t);
+        void on_release(unsigned k, time_point t);
+        void expire(time_point now);
+        void emit(event_type type, unsigned buttons, time_point t);
+
+        timing    _timing;
+        key_state _keys[6];
+        unsigned   _chord = 0;
+        bool       _chord_open = false;
+        time_point _chord_start;
+        bool       _emitted = false;
+
+        button::event_reader       _reader;
+        spsc_ring<event, 64>       _queue;
+        std::atomic<unsigned long> _dropped;
+
+        std::thread _thread;
+        int         _wakeup = -1;
 };
 
 //-----------------------------------------------------------------------------
@@ -1603,6 +2956,150 @@ class remote_control {
         int              _state = 0;
 };
 
+//-----------------------------------------------------------------------------
+// Records telemetry into an append-only binary log that is memory mapped. The
+// log starts with a header that describes each channel, followed by records
+// of a fixed size:
+//
+//     ev3::recorder rec;
+//     const size_t pos  = rec.add_position(m);
+//     const size_t keys = rec.add_buttons();
+//     rec.open("/home/robot/run.log");
+//
+//     for(;;) {
+//         rec.capture(); // all the device channels, read in one batch
+//         while (buttons.next(e)) rec.log(keys, e);
+//         ...
+//     }
+//
+// Records are written directly into segments of the file that a writer thread
+// has allocated and mapped ahead of time, so capture() and log() never wait
+// for the disk. Should the writer fall behind, records are dropped and
+// counted. Channels are added before open(); capture() and log() are called
+// from one thread, and the devices must outlive the recorder.
+//-----------------------------------------------------------------------------
+class recorder {
+    public:
+        enum channel_kind : uint32_t {
+            kind_sensor_value,
+            kind_motor_position,
+            kind_motor_speed,
+            kind_motor_duty_cycle,
+            kind_buttons,  // button_events: event type << 8 | buttons
+            kind_remote,   // remote_control: the state (a remote_control::buttons mask)
+            kind_user      // values logged by the program
+        };
+
+        // The layout of the file, in the byte order of the host.
+        struct file_header {
+            char     magic[8];      // "EV3TLOG"
+            uint32_t version;
+            uint32_t header_size;   // offset of the first record
+            uint32_t record_size;
+            uint32_t channel_count; // channel_info entries that follow
+        };
+
+        struct channel_info {
+            uint32_t kind;
+            uint32_t index;       // value index (sensor values), IR channel (remote)
+            char     address[32]; // port of the device, or a name for kind_user
+            char     driver[24];
+        };
+
+        // A zero timestamp marks the end of the records: a log that was not
+        // closed extends past the last record.
+        struct record {
+            int64_t  timestamp; // steady_clock (CLOCK_MONOTONIC), in nanoseconds
+            uint32_t channel;
+            int32_t  value;
+        };
+
+        static const uint32_t version = 1;
+
+        recorder();
+        ~recorder();
+
+        recorder(const recorder&) = delete;
+        recorder& operator=(const recorder&) = delete;
+
+        // Add a channel. Return its number, as stored in the records.
+        size_t add_value       (const sensor &s, unsigned index = 0);
+        size_t add_position    (const motor &m);
+        size_t add_speed       (const motor &m);
+        size_t add_duty_cycle  (const motor &m);
+        size_t add_buttons     ();
+        size_t add_remote      (const infrared_sensor &s, unsigned channel = 1);
+        size_t add_user        (const std::string &name);
+
+        // Creates the log, writes its header and starts the writer thread.
+        void open(const std::string &path);
+
+        // Stops the writer thread and cuts the file after the last record.
+        // Rethrows the error that stopped the writer, if any.
+        void close();
+
+        bool is_open() const { return _fd >= 0; }
+
+        // Reads the sensor and motor channels in one batch and logs them
+        // with its timestamp. Returns false if records were dropped.
+        bool capture();
+
+        // Log a value of a channel. Return false if it was dropped.
+        bool log(size_t channel, int value) {
+            return log(channel, std::chrono::steady_clock::now(), value);
+        }
+        bool log(size_t channel, std::chrono::steady_clock::time_point t, int value);
+        bool log(size_t channel, const button_events::event &e) {
+            return log(channel, e.timestamp, static_cast<int>(e.type) << 8 | static_cast<int>(e.buttons));
+        }
+
+        unsigned long dropped() const { return _dropped; }
+
+        // Reads a log back.
+        static void load(const std::string &path,
+                std::vector<channel_info> &channels, std::vector<record> &records);
+
+    private:
+        struct segment {
+            record *data;
+            size_t  used;
+        };
+
+        struct source {
+            const device     *dev;
+            device::attr_slot slot;
+            uint32_t          channel;
+        };
+
+        size_t add(channel_kind kind, unsigned index, const device *dev, device::attr_slot slot);
+        bool   next_segment();
+        void   map_segment();
+        void   run_writer();
+
+        std::vector<channel_info>         _channels;
+        std::vector<source>               _sources;
+        std::vector<device::attr_request> _reads;
+        std::vector<device::attr_reads>   _batch;
+
+        int    _fd = -1;
+        size_t _header_size = 0;
+        size_t _mapped = 0;  // end of the segments mapped so far
+        size_t _records = 0;
+
+        // The segment being written, owned by the calling thread.
+        segment       _current;
+        unsigned long _dropped = 0;
+
+        // Mapped segments on their way to the caller, and back.
+        spsc_ring<segment, 16> _ready;
+        spsc_ring<segment, 16> _full;
+
+        std::thread        _writer;
+        int                _wakeup = -1;
+        std::atomic<bool>  _closing;
+        std::exception_ptr _error;
+};
+
 //-----------------------------------------------------------------------------
 // The `lego-port` class provides an interface for working with input and
 // output ports that are compatible with LEGO MINDSTORMS RCX/NXT/EV3, LEGO
@@ -1640,16 +3137,17 @@ class lego_port : protected device {
         // Address: read-only
         // Returns the name of the port. See individual driver documentation for
         // the name that will be returned.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_string(const_address); }
 
         // Driver Name: read-only
         // Returns the name of the driver that loaded this device. You can find the
         // complete list of drivers in the [list of port drivers].
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_string(const_driver_name); }
 
         // Modes: read-only
         // Returns a list of the available modes of the port.
-        mode_set modes() const { return get_attr_set("modes"); }
+        // The set is kept by the device until it reconnects or is assigned to.
+        const token_set& modes() const { return get_attr_set(const_modes); }
 
         // Mode: read/write
         // Reading returns the currently selected mode. Writing sets the mode.
@@ -1657,6 +3155,7 @@ class lego_port : protected device {
         // associated with the port will be removed new ones loaded, however this
         // this will depend on the individual driver implementing this class.
         std::string mode() const { return get_attr_string("mode"); }
+        std::future<std::string> async_mode() const { return async_get_attr_string("mode"); }
         lego_port set_mode(std::string v) {
             set_attr_string("mode", v);
             return *this;
@@ -1679,6 +3178,7 @@ class lego_port : protected device {
         // such as `no-device` or `error`. See individual port driver documentation
         // for the full list of possible values.
         std::string status() const { return get_attr_string("status"); }
+        std::future<std::string> async_status() const { return async_get_attr_string("status"); }
 
     protected:
         lego_port() {}
@@ -1686,4 +3186,111 @@ class lego_port : protected device {
         bool connect(const std::map<std::string, std::set<std::string>>&) noexcept;
 };
 
+//-----------------------------------------------------------------------------
+// Serves buttons, sensor values, motor states, timers and signals from one
+// thread. The loop sleeps in epoll_wait() until one of them has something
+// to report and then calls the registered callbacks, one at a time, on the
+// thread that runs the loop:
+//
+//     ev3::event_loop loop;
+//     loop.add_buttons();
+//     loop.add_value(ir, 0, [&](int d) { if (d < 20) m.stop(); });
+//     loop.add_timer(std::chrono::milliseconds(50), [&]() { update(); });
+//     loop.add_signal(SIGINT, [&](int) { loop.stop(); });
+//     loop.run();
+//
+// Attributes are watched through sysfs change notifications where the driver
+// sends them, and reread every 50 ms in case it misses some. They are polled
+// at an adaptive rate where it does not. Watched devices must stay connected
+// while they are registered.
+//-----------------------------------------------------------------------------
+class event_loop {
+    public:
+        // Identifies a registration for remove().
+        typedef int handle;
+
+        event_loop();
+        ~event_loop();
+
+        event_loop(const event_loop&) = delete;
+        event_loop& operator=(const event_loop&) = delete;
+
+        // Runs button::process_all() whenever the EV3 buttons send input
+        // events, so that their `onclick` callbacks are called from the loop.
+        // button_events and other readers of the buttons still see every
+        // event.
+        handle add_buttons();
+
+        // Calls `f` with the new value whenever `value<index>` of the sensor
+        // changes.
+        handle add_value(const sensor &s, unsigned index,
+                std::function<void(int)> f);
+
+        // Calls `f` with the new state whenever the state of the motor changes.
+        handle add_state(const motor &m,
+                std::function<void(const mode_set&)> f);
+
+        // Calls `f` every `period`, starting one period from now. Missed
+        // periods are reported once.
+        handle add_timer(std::chrono::nanoseconds period, std::function<void()> f);
+
+        // Calls `f` when the process receives `signo`. The signal is blocked
+        // in the calling thread, which should be the one that runs the loop
+        // (threads started afterwards inherit the mask).
+        handle add_signal(int signo, std::function<void(int)> f);
+
+        // Calls `f` whenever `fd` becomes readable. The loop does not own `fd`.
+        handle add_fd(int fd, std::function<void()> f);
+
+        // Cancels a registration. May be called from a callback.
+        void remove(handle h);
+
+        // Dispatches events until stop() is called.
+        void run();
+
+        // Waits at most `timeout` for events (forever if negative) and
+        // dispatches them. Returns the number of callbacks called.
+        int run_once(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+
+        // Makes run() return. May be called from any thread.
+        void stop();
+
+    private:
+        struct watch {
+            int  fd;       // -1 if the source can not be watched with epoll
+            bool owns_fd;
+            bool dead = false;
+
+            // Reads the source and calls the user callback if there is news.
+            // Returns true if the callback was called.
+            std::function<bool()> dispatch;
+
+            // Attributes are polled at an adaptive rate, and only now and
+            // then once their driver is seen to notify changes; the flag is
+            // shared with the device handle table.
+            std::atomic<bool> *notifies = nullptr;
+            bool polled = false;
+            std::chrono::milliseconds             interval;
+            std::chrono::steady_clock::time_point next;
+
+            // The attribute, and the handle of it the watch was set up with.
+            // Reads reopen the handle when the attribute is recreated.
+            const device      *dev = nullptr;
+            device::attr_slot  slot;
+            int                handle_fd = -1;
+        };
+
+        handle add(int fd, bool owns_fd, unsigned events, std::function<bool()> dispatch);
+        handle add_attr(const device &d, device::attr_slot slot, std::function<bool()> dispatch);
+
+        // Moves the epoll watch of an attribute to its current handle.
+        void rewatch(handle h, watch &w);
+
+        int _epoll;
+        int _wakeup;
+        handle _last = 0;
+        std::atomic<bool> _stop;
+        std::map<handle, watch> _watches;
+};
+
 } // namespace ev3dev
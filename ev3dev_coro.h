@@ -0,0 +1,334 @@
+/*
+ * C++20 coroutines for the ev3dev C++ API
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// An optional layer on top of ev3dev.h that runs behaviors as coroutines on
+// one thread. The coroutines wait for motors, sensors and timers through a
+// scheduler built on event_loop, so they need neither threads of their own
+// nor sleep loops:
+//
+//     ev3::coro::scheduler sched;
+//
+//     ev3::coro::task square(ev3::coro::scheduler &s, ev3::large_motor &m) {
+//         for(int i = 0; i < 4; ++i) {
+//             co_await s.run_to_rel_pos(m, 360, 500);
+//             co_await s.sleep_for(std::chrono::milliseconds(200));
+//         }
+//     }
+//
+//     sched.spawn(square(sched, left));
+//     sched.spawn(square(sched, right));
+//     sched.run();
+//
+// Only this header needs C++20; the library itself stays C++11.
+
+#pragma once
+
+#if __cplusplus < 202002L
+#  error "ev3dev_coro.h needs C++20"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <list>
+#include <string>
+#include <utility>
+
+#include "ev3dev.h"
+
+namespace ev3dev {
+namespace coro {
+
+//-----------------------------------------------------------------------------
+// A coroutine that returns nothing. It starts when it is spawned on a
+// scheduler or awaited by another task, and an exception that escapes it is
+// rethrown to whoever awaits it (scheduler::run() for spawned tasks).
+//-----------------------------------------------------------------------------
+class task {
+    public:
+        struct promise_type {
+            std::coroutine_handle<> continuation;
+            std::exception_ptr      error;
+
+            task get_return_object() {
+                return task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            // Resumes the awaiting task, if any.
+            struct final_awaiter {
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(
+                        std::coroutine_handle<promise_type> h) noexcept
+                {
+                    auto c = h.promise().continuation;
+                    return c ? c : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            final_awaiter final_suspend() noexcept { return {}; }
+
+            void return_void() {}
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        typedef std::coroutine_handle<promise_type> handle_type;
+
+        task(task &&t) noexcept : _h(std::exchange(t._h, nullptr)) {}
+        ~task() { if (_h) _h.destroy(); }
+
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+
+        bool await_ready() const noexcept { return !_h || _h.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+            _h.promise().continuation = c;
+            return _h;
+        }
+
+        void await_resume() {
+            if (_h.promise().error) std::rethrow_exception(_h.promise().error);
+        }
+
+    private:
+        friend class scheduler;
+
+        explicit task(handle_type h) : _h(h) {}
+
+        handle_type _h;
+};
+
+//-----------------------------------------------------------------------------
+// Runs tasks on the calling thread. The awaitables below suspend a task
+// until an event_loop callback sees its condition met; the task then
+// continues from run(), not from the callback.
+//-----------------------------------------------------------------------------
+class scheduler {
+    public:
+        scheduler() {}
+
+        ~scheduler() {
+            for(auto h : _tasks) h.destroy();
+        }
+
+        scheduler(const scheduler&) = delete;
+        scheduler& operator=(const scheduler&) = delete;
+
+        // The loop the scheduler waits in. Other sources may be added to it.
+        event_loop& loop() { return _loop; }
+
+        // Takes over the task and starts it from run().
+        void spawn(task t) {
+            auto h = std::exchange(t._h, nullptr);
+            _tasks.push_back(h);
+            _ready.push_back(h);
+        }
+
+        // Runs until all spawned tasks have finished. Rethrows the first
+        // exception that escapes a spawned task.
+        void run() {
+            while (!_tasks.empty()) {
+                while (!_ready.empty()) {
+                    auto h = _ready.front();
+                    _ready.pop_front();
+                    h.resume();
+                }
+
+                for(auto t = _tasks.begin(); t != _tasks.end(); ) {
+                    if (!t->done()) {
+                        ++t;
+                        continue;
+                    }
+
+                    std::exception_ptr error = t->promise().error;
+                    t->destroy();
+                    t = _tasks.erase(t);
+
+                    if (error) std::rethrow_exception(error);
+                }
+
+                if (!_tasks.empty() && _ready.empty()) _loop.run_once();
+            }
+        }
+
+        //---------------------------------------------------------------------
+        // Awaitables.
+        //---------------------------------------------------------------------
+
+        // Resumes after `d`.
+        class sleep_awaiter {
+            public:
+                bool await_ready() const { return _d.count() <= 0; }
+
+                void await_suspend(std::coroutine_handle<> h) {
+                    _watch = _s._loop.add_timer(_d, [this, h]() {
+                            _s._loop.remove(_watch);
+                            _s._ready.push_back(h);
+                            });
+                }
+
+                void await_resume() {}
+
+            private:
+                friend class scheduler;
+                sleep_awaiter(scheduler &s, std::chrono::nanoseconds d) : _s(s), _d(d) {}
+
+                scheduler               &_s;
+                std::chrono::nanoseconds _d;
+                event_loop::handle       _watch = 0;
+        };
+
+        // Resumes once `done` accepts the state of the motor. Returns the
+        // state it accepted.
+        class state_awaiter {
+            public:
+                bool await_ready() { return test(_m.state()); }
+
+                bool await_suspend(std::coroutine_handle<> h) {
+                    _watch = _s._loop.add_state(_m, [this, h](const mode_set &state) {
+                            if (!test(state)) return;
+                            _s._loop.remove(_watch);
+                            _s._ready.push_back(h);
+                            });
+
+                    // The state may have changed before the watch was set up.
+                    if (!test(_m.state())) return true;
+
+                    _s._loop.remove(_watch);
+                    return false;
+                }
+
+                mode_set await_resume() { return std::move(_state); }
+
+            private:
+                friend class scheduler;
+                state_awaiter(scheduler &s, const motor &m, std::function<bool(const mode_set&)> done)
+                    : _s(s), _m(m), _done(std::move(done)) {}
+
+                bool test(const mode_set &state) {
+                    if (!_done(state)) return false;
+                    _state = state;
+                    return true;
+                }
+
+                scheduler                            &_s;
+                const motor                          &_m;
+                std::function<bool(const mode_set&)>  _done;
+                mode_set                              _state;
+                event_loop::handle                    _watch = 0;
+        };
+
+        // Resumes once `done` accepts `value<index>` of the sensor. Returns
+        // the value it accepted.
+        class value_awaiter {
+            public:
+                bool await_ready() { return test(_sensor.value(_index)); }
+
+                bool await_suspend(std::coroutine_handle<> h) {
+                    _watch = _s._loop.add_value(_sensor, _index, [this, h](int v) {
+                            if (!test(v)) return;
+                            _s._loop.remove(_watch);
+                            _s._ready.push_back(h);
+                            });
+
+                    if (!test(_sensor.value(_index))) return true;
+
+                    _s._loop.remove(_watch);
+                    return false;
+                }
+
+                int await_resume() const { return _value; }
+
+            private:
+                friend class scheduler;
+                value_awaiter(scheduler &s, const sensor &sensor, unsigned index,
+                        std::function<bool(int)> done)
+                    : _s(s), _sensor(sensor), _index(index), _done(std::move(done)) {}
+
+                bool test(int v) {
+                    if (!_done(v)) return false;
+                    _value = v;
+                    return true;
+                }
+
+                scheduler               &_s;
+                const sensor            &_sensor;
+                unsigned                 _index;
+                std::function<bool(int)> _done;
+                int                      _value = 0;
+                event_loop::handle       _watch = 0;
+        };
+
+        sleep_awaiter sleep_for(std::chrono::nanoseconds d) {
+            return sleep_awaiter(*this, d);
+        }
+
+        state_awaiter until_state(const motor &m, std::function<bool(const mode_set&)> done) {
+            return state_awaiter(*this, m, std::move(done));
+        }
+
+        // Until the state of the motor includes `flag`, e.g. motor::state_holding.
+        state_awaiter until_state(const motor &m, const char *flag) {
+            std::string f = flag;
+            return until_state(m, [f](const mode_set &state) { return state.count(f) != 0; });
+        }
+
+        // Until the motor is no longer running.
+        state_awaiter until_stopped(const motor &m) {
+            return until_state(m, [](const mode_set &state) {
+                    return state.count(motor::state_running) == 0; });
+        }
+
+        value_awaiter until(const sensor &s, std::function<bool(int)> done, unsigned index = 0) {
+            return value_awaiter(*this, s, index, std::move(done));
+        }
+
+        //---------------------------------------------------------------------
+        // Motions that complete when the motor stops.
+        //---------------------------------------------------------------------
+        task run_to_rel_pos(motor &m, int position_sp, int speed_sp) {
+            m.batch().set_position_sp(position_sp).set_speed_sp(speed_sp).run_to_rel_pos();
+            co_await until_stopped(m);
+        }
+
+        task run_to_abs_pos(motor &m, int position_sp, int speed_sp) {
+            m.batch().set_position_sp(position_sp).set_speed_sp(speed_sp).run_to_abs_pos();
+            co_await until_stopped(m);
+        }
+
+        task run_timed(motor &m, std::chrono::milliseconds time_sp, int speed_sp) {
+            m.batch().set_time_sp(static_cast<int>(time_sp.count())).set_speed_sp(speed_sp).run_timed();
+            co_await until_stopped(m);
+        }
+
+    private:
+        event_loop _loop;
+
+        std::list<task::handle_type>         _tasks;
+        std::deque<std::coroutine_handle<>>  _ready;
+};
+
+} // namespace coro
+} // namespace ev3dev
@@ -3,8 +3,18 @@
 #include <vector>
 #include <sstream>
 #include <cstdlib>
+#include <cstdio>
+#include <csignal>
+#include <fstream>
+#include <system_error>
+#include <thread>
 #include <ev3dev.h>
 
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/input.h>
+
 namespace ev3 = ev3dev;
 
 void populate_arena(const std::vector<const char*> &devices) {
@@ -16,6 +26,13 @@ void populate_arena(const std::vector<const char*> &devices) {
     system(command.str().c_str());
 }
 
+// Sets an attribute backend for the lifetime of the guard. Devices must not
+// outlive the backend they use.
+struct backend_guard {
+    explicit backend_guard(ev3::attr_backend *b) { ev3::device::set_backend(b); }
+    ~backend_guard() { ev3::device::set_backend(nullptr); }
+};
+
 TEST_CASE( "Device" ) {
     populate_arena({"medium_motor:0@ev3-ports:outA", "infrared_sensor:0@ev3-ports:in1"});
 
@@ -112,3 +129,1101 @@ TEST_CASE("Infrared Sensor") {
     REQUIRE(v[0] == 16);
     REQUIRE(s.bin_data() == v);
 }
+
+void write_arena(const std::string &path, const std::string &value) {
+    std::ofstream(SYS_ROOT + path) << value;
+}
+
+TEST_CASE("Attribute I/O") {
+    // Use a fresh device node so that no handles cached by other tests apply.
+    populate_arena({"medium_motor:1@ev3-ports:outA"});
+
+    ev3::device d;
+    d.connect(SYS_ROOT "/tacho-motor/", "motor", {});
+    REQUIRE(d.connected());
+
+    // integers
+    REQUIRE(d.get_attr_int("position") == 42);
+
+    write_arena("/tacho-motor/motor1/position", "-1234\n");
+    REQUIRE(d.get_attr_int("position") == -1234);
+
+    write_arena("/tacho-motor/motor1/position", "  +7");
+    REQUIRE(d.get_attr_int("position") == 7);
+
+    // strings and lines
+    REQUIRE(d.get_attr_string("stop_actions") == "coast");
+    REQUIRE(d.get_attr_line("stop_actions") == "coast brake hold");
+
+    write_arena("/tacho-motor/motor1/polarity", "inversed\n");
+    REQUIRE(d.get_attr_string("polarity") == "inversed");
+
+    // selectors
+    write_arena("/tacho-motor/motor1/stop_action", "coast [brake] hold\n");
+
+    std::string cur;
+    REQUIRE(d.get_attr_set("stop_action", &cur) == ev3::mode_set({"coast", "brake", "hold"}));
+    REQUIRE(cur == "brake");
+    REQUIRE(d.get_attr_from_set("stop_action") == "brake");
+
+    // writes
+    d.set_attr_int("time_sp", -25);
+    REQUIRE(d.get_attr_int("time_sp") == -25);
+
+    d.set_attr_string("polarity", "normal");
+    REQUIRE(d.get_attr_string("polarity") == "normal");
+
+    // errors
+    REQUIRE_THROWS_AS(d.get_attr_int("no_such_attribute"), std::system_error);
+
+#if !defined(EV3DEV_ATTR_IO_FSTREAM)
+    REQUIRE_THROWS_AS(d.set_attr_int("no_such_attribute", 1), std::system_error);
+
+    // The error is that of the failed open().
+    try {
+        d.set_attr_int("no_such_attribute", 1);
+    } catch(const std::system_error &e) {
+        REQUIRE(e.code().value() == ENOENT);
+    }
+
+    write_arena("/tacho-motor/motor1/time_sp", "not a number\n");
+    REQUIRE_THROWS_AS(d.get_attr_int("time_sp"), std::system_error);
+#endif
+}
+
+TEST_CASE("Attribute handles") {
+    populate_arena({"medium_motor:2@ev3-ports:outA", "infrared_sensor:2@ev3-ports:in1"});
+
+    ev3::medium_motor m;
+    REQUIRE(m.connected());
+
+    REQUIRE(m.position() == 42);
+    write_arena("/tacho-motor/motor2/position", "100\n");
+    REQUIRE(m.position() == 100);
+
+    ev3::medium_motor copy = m;
+    REQUIRE(copy.position() == 100);
+
+#if !defined(EV3DEV_ATTR_IO_FSTREAM)
+    // Each value is stored with a single write at the start of the file.
+    m.set_duty_cycle_sp(-100);
+    REQUIRE(m.duty_cycle_sp() == -100);
+    m.set_duty_cycle_sp(5);
+    REQUIRE(m.duty_cycle_sp() == 5);
+#endif
+
+    ev3::infrared_sensor s;
+    REQUIRE(s.value(0) == 16);
+    write_arena("/lego-sensor/sensor2/value0", "-5\n");
+    REQUIRE(s.value(0) == -5);
+}
+
+TEST_CASE("Attribute cache") {
+    populate_arena({"medium_motor:3@ev3-ports:outA", "infrared_sensor:3@ev3-ports:in1"});
+
+    ev3::device m, s;
+    m.connect(SYS_ROOT "/tacho-motor/", "motor", {});
+    s.connect(SYS_ROOT "/lego-sensor/", "sensor", {});
+    REQUIRE(m.connected());
+    REQUIRE(s.connected());
+
+    auto before = ev3::device::cache_stats();
+    REQUIRE(m.get_attr_int("time_sp") == 1000);
+    REQUIRE(m.get_attr_int("time_sp") == 1000);
+    auto after = ev3::device::cache_stats();
+
+    REQUIRE(after.misses - before.misses == 1);
+    REQUIRE(after.hits   - before.hits   == 1);
+
+    // Every thread owns its cache, so threads may poll concurrently.
+    bool motor_ok = true, sensor_ok = true;
+    std::thread t1([&]() {
+        for(int i = 0; i < 1000; ++i) motor_ok = motor_ok && m.get_attr_int("time_sp") == 1000;
+    });
+    std::thread t2([&]() {
+        for(int i = 0; i < 1000; ++i) sensor_ok = sensor_ok && s.get_attr_int("value0") == 16;
+    });
+    t1.join();
+    t2.join();
+
+    REQUIRE(motor_ok);
+    REQUIRE(sensor_ok);
+    REQUIRE(ev3::device::cache_stats().hits - after.hits >= 1998);
+}
+
+TEST_CASE("Snapshots") {
+    populate_arena({"medium_motor:4@ev3-ports:outA", "infrared_sensor:4@ev3-ports:in1"});
+
+    ev3::medium_motor m;
+    REQUIRE(m.connected());
+
+    auto ms = m.snapshot();
+    REQUIRE(ms.position   == 42);
+    REQUIRE(ms.speed      == 0);
+    REQUIRE(ms.duty_cycle == 0);
+    REQUIRE(ms.state      == std::set<std::string>{"running"});
+
+    write_arena("/tacho-motor/motor4/position", "-7\n");
+    ms = m.snapshot(ev3::motor::sample_position);
+    REQUIRE(ms.position == -7);
+    REQUIRE(ms.state.empty());
+
+    ev3::infrared_sensor s;
+    REQUIRE(s.connected());
+
+    auto ss = s.snapshot(1, true);
+    REQUIRE(ss.num_values == 1);
+    REQUIRE(ss.values[0]  == 16);
+    REQUIRE(ss.mode       == "IR-PROX");
+    REQUIRE(ss.timestamp  <= std::chrono::steady_clock::now());
+}
+
+TEST_CASE("Sample groups") {
+    populate_arena({"medium_motor:12@ev3-ports:outA", "medium_motor:13@ev3-ports:outB",
+            "infrared_sensor:12@ev3-ports:in1"});
+
+    ev3::medium_motor a(ev3::OUTPUT_A), b(ev3::OUTPUT_B);
+    ev3::infrared_sensor s;
+    REQUIRE(a.connected());
+    REQUIRE(b.connected());
+    REQUIRE(s.connected());
+
+    write_arena("/tacho-motor/motor13/position", "-7\n");
+
+    ev3::sample_group tick;
+    const size_t ia = tick.add(a);
+    const size_t ib = tick.add(b, ev3::motor::sample_position);
+    const size_t is = tick.add(s, 1, true);
+
+    const auto t = tick.read();
+
+    REQUIRE(tick.motor_sample(ia).position  == 42);
+    REQUIRE(tick.motor_sample(ia).state     == std::set<std::string>{"running"});
+    REQUIRE(tick.motor_sample(ib).position  == -7);
+    REQUIRE(tick.motor_sample(ib).state.empty());
+    REQUIRE(tick.sensor_sample(is).values[0] == 16);
+    REQUIRE(tick.sensor_sample(is).mode     == "IR-PROX");
+    REQUIRE(tick.sensor_sample(is).timestamp == t);
+
+    write_arena("/tacho-motor/motor12/position", "360\n");
+    tick.read();
+    REQUIRE(tick.motor_sample(ia).position == 360);
+}
+
+TEST_CASE("Async attributes") {
+    populate_arena({"medium_motor:14@ev3-ports:outA", "infrared_sensor:14@ev3-ports:in1"});
+
+    ev3::medium_motor m;
+    ev3::infrared_sensor s;
+    REQUIRE(m.connected());
+    REQUIRE(s.connected());
+
+    auto position = m.async_position();
+    auto state    = m.async_state();
+    auto value    = s.async_value();
+    auto prox     = s.async_proximity();
+
+    REQUIRE(position.get() == 42);
+    REQUIRE(state.get()    == std::set<std::string>{"running"});
+    REQUIRE(value.get()    == 16);
+    REQUIRE(prox.get()     == 16);
+
+    // Operations are carried out in order.
+    ev3::device d;
+    d.connect(SYS_ROOT "/tacho-motor/", "motor", {});
+    REQUIRE(d.connected());
+    REQUIRE(d.get_attr_int("speed_sp") == 0);
+
+    auto set = d.async_set_attr_int("speed_sp", 300);
+    auto get = d.async_get_attr_int("speed_sp");
+    REQUIRE(get.get() == 300);
+    set.get();
+    REQUIRE(m.speed_sp() == 300);
+
+    auto missing = d.async_get_attr_int("no_such_attribute");
+    REQUIRE_THROWS_AS(missing.get(), const std::system_error&);
+
+    // Single shot measurements write their mode every time, unless another
+    // mode is pinned.
+    ev3::memory_backend mem;
+    backend_guard guard(&mem);
+
+    const std::string us = mem.add_device("lego-sensor", "sensor0", {
+            {"address", "ev3-ports:in2"}, {"driver_name", "lego-ev3-us"},
+            {"mode", "US-DIST-CM"}, {"num_values", "1"}, {"decimals", "1"},
+            {"bin_data_format", "u16"}, {"units", "cm"}, {"value0", "123"}});
+
+    ev3::ultrasonic_sensor u(ev3::INPUT_2);
+    REQUIRE(u.async_distance_centimeters_ping().get() == Approx(12.3));
+    mem.set(us + "mode", "US-DIST-CM");
+    REQUIRE(u.async_distance_centimeters_ping().get() == Approx(12.3));
+    REQUIRE(mem.get(us + "mode") == "US-SI-CM");
+
+    ev3::ultrasonic_sensor::mode_lock lock(u, ev3::ultrasonic_sensor::mode_us_dist_cm);
+    REQUIRE_THROWS_AS(u.async_distance_centimeters_ping(), const std::system_error&);
+}
+
+TEST_CASE("Command batches") {
+    populate_arena({"medium_motor:5@ev3-ports:outA"});
+
+    ev3::medium_motor m;
+    REQUIRE(m.connected());
+
+    m.batch().set_position_sp(90).set_speed_sp(500).set_speed_sp(-450).run_to_rel_pos();
+
+    REQUIRE(m.position_sp() == 90);
+    REQUIRE(m.speed_sp()    == -450);
+
+    ev3::device d;
+    d.connect(SYS_ROOT "/tacho-motor/", "motor", {});
+    REQUIRE(d.get_attr_line("command") == "run-to-rel-pos");
+
+    // Nothing is stored before commit.
+    auto b = m.batch();
+    b.set_time_sp(250).set_stop_action("hold");
+    REQUIRE(m.time_sp() == 1000);
+    b.commit();
+    REQUIRE(m.time_sp()     == 250);
+    REQUIRE(m.stop_action() == "hold");
+
+#if !defined(EV3DEV_ATTR_IO_FSTREAM)
+    // A failed setpoint is reported once and the command is not sent.
+    std::remove(SYS_ROOT "/tacho-motor/motor5/ramp_up_sp");
+    REQUIRE_THROWS_AS(m.batch().set_ramp_up_sp(100).run_forever(), const std::system_error&);
+    REQUIRE(d.get_attr_line("command") == "run-to-rel-pos");
+#endif
+}
+
+TEST_CASE("Shadow registers") {
+    populate_arena({"medium_motor:6@ev3-ports:outA", "infrared_sensor:6@ev3-ports:in1"});
+
+    ev3::medium_motor m;
+    REQUIRE(m.connected());
+    REQUIRE(!m.shadowing());
+
+    m.set_shadowing(true);
+    REQUIRE(m.shadowing());
+
+    m.set_speed_sp(100);
+    REQUIRE(m.speed_sp() == 100);
+
+    // The shadow answers reads and skips writes of unchanged values.
+    write_arena("/tacho-motor/motor6/speed_sp", "7\n");
+    REQUIRE(m.speed_sp() == 100);
+    m.set_speed_sp(100);
+
+    ev3::device d;
+    d.connect(SYS_ROOT "/tacho-motor/", "motor", {});
+    REQUIRE(d.get_attr_int("speed_sp") == 7);
+
+    // Reset sets all attributes to their defaults.
+    m.reset();
+    REQUIRE(m.speed_sp() == 7);
+    REQUIRE(m.stop_action() == "coast");
+
+    ev3::infrared_sensor s;
+    REQUIRE(s.connected());
+
+    s.set_shadowing(true);
+    REQUIRE(s.mode() == "IR-PROX");
+
+    write_arena("/lego-sensor/sensor6/mode", "IR-SEEK\n");
+    REQUIRE(s.mode() == "IR-PROX");
+
+    s.invalidate_shadow();
+    REQUIRE(s.mode() == "IR-SEEK");
+
+    s.set_shadowing(false);
+    write_arena("/lego-sensor/sensor6/mode", "IR-REMOTE\n");
+    REQUIRE(s.mode() == "IR-REMOTE");
+}
+
+TEST_CASE("Constant attributes") {
+    populate_arena({"medium_motor:7@ev3-ports:outA"});
+
+    ev3::medium_motor m;
+    REQUIRE(m.connected());
+
+    REQUIRE(m.driver_name()   == "lego-ev3-m-motor");
+    REQUIRE(m.count_per_rot() == 360);
+    REQUIRE(m.max_speed()     == 1560);
+    REQUIRE(m.stop_actions()  == ev3::mode_set({"coast", "brake", "hold"}));
+
+    // The values are read once and kept while the motor stays connected.
+    const ev3::token_set &commands = m.commands();
+    write_arena("/tacho-motor/motor7/count_per_rot", "180\n");
+    write_arena("/tacho-motor/motor7/commands", "stop\n");
+    REQUIRE(m.count_per_rot() == 360);
+    REQUIRE(&m.commands() == &commands);
+    REQUIRE(commands.count("run-forever") == 1);
+
+    // A copy reads its own values.
+    ev3::medium_motor c(m);
+    REQUIRE(c.count_per_rot() == 180);
+}
+
+TEST_CASE("Mode descriptors") {
+    populate_arena({"infrared_sensor:8@ev3-ports:in1"});
+
+    ev3::infrared_sensor s;
+    REQUIRE(s.connected());
+
+    REQUIRE(s.num_values()      == 1);
+    REQUIRE(s.decimals()        == 0);
+    REQUIRE(s.units()           == "pct");
+    REQUIRE(s.bin_data_format() == "s8");
+    REQUIRE(s.bin_data().size() == 1);
+
+    // The descriptor of a mode is read when the mode is selected.
+    write_arena("/lego-sensor/sensor8/num_values", "2\n");
+    write_arena("/lego-sensor/sensor8/decimals",   "1\n");
+    write_arena("/lego-sensor/sensor8/value1",     "-3\n");
+    REQUIRE(s.num_values() == 1);
+    REQUIRE_THROWS_AS(s.value(1), const std::invalid_argument&);
+
+    s.set_mode(ev3::infrared_sensor::mode_ir_seek);
+    REQUIRE(s.num_values()      == 2);
+    REQUIRE(s.value(1)          == -3);
+    REQUIRE(s.float_value(0)    == Approx(1.6f));
+    REQUIRE(s.bin_data().size() == 2);
+
+    s.set_mode(ev3::infrared_sensor::mode_ir_prox);
+    REQUIRE(s.num_values()      == 1);
+    REQUIRE(s.float_value(0)    == Approx(16.0f));
+    REQUIRE(s.bin_data().size() == 1);
+}
+
+TEST_CASE("Mode locks") {
+    populate_arena({"infrared_sensor:9@ev3-ports:in1"});
+
+    ev3::infrared_sensor s, other;
+    REQUIRE(s.connected());
+
+    ev3::device d;
+    d.connect(SYS_ROOT "/lego-sensor/", "sensor", {});
+
+    {
+        ev3::infrared_sensor::mode_lock lock(s, ev3::infrared_sensor::mode_ir_prox);
+        REQUIRE(s.proximity() == 16);
+
+        {
+            ev3::infrared_sensor::mode_lock inner(s, ev3::infrared_sensor::mode_ir_seek);
+            REQUIRE_THROWS_AS(s.proximity(), const std::system_error&);
+        }
+
+#if !defined(EV3DEV_ATTR_IO_FSTREAM)
+        // The outer mode is restored by the next read.
+        REQUIRE(d.get_attr_line("mode") == "IR-SEEK");
+        s.proximity();
+        REQUIRE(d.get_attr_line("mode") == "IR-PROX");
+
+        // Reads of the pinned mode do not write it.
+        write_arena("/lego-sensor/sensor9/mode", "IR-CAL\n");
+        s.proximity();
+        REQUIRE(d.get_attr_line("mode") == "IR-CAL");
+
+        // A mode change through another object is noticed.
+        other.set_mode(ev3::infrared_sensor::mode_ir_remote);
+        s.proximity();
+        REQUIRE(d.get_attr_line("mode") == "IR-PROX");
+
+        // Also when the shadow remembers the pinned mode.
+        s.set_shadowing(true);
+        s.set_mode(ev3::infrared_sensor::mode_ir_prox);
+        other.set_mode(ev3::infrared_sensor::mode_ir_remote);
+        s.proximity();
+        REQUIRE(d.get_attr_line("mode") == "IR-PROX");
+        s.set_shadowing(false);
+#endif
+    }
+
+    // Without a lock the getters select their mode on every call.
+    s.set_mode(ev3::infrared_sensor::mode_ir_seek);
+    REQUIRE(s.proximity() == 16);
+}
+
+TEST_CASE("Change notifications") {
+    populate_arena({"medium_motor:10@ev3-ports:outA", "infrared_sensor:10@ev3-ports:in1"});
+
+    ev3::infrared_sensor s;
+    ev3::medium_motor m;
+    REQUIRE(s.connected());
+    REQUIRE(m.connected());
+
+    // Regular files never notify, so this goes through the adaptive poller.
+    int value = 16;
+    REQUIRE(!s.wait_value_change(value, 0, std::chrono::milliseconds(30)));
+    REQUIRE(value == 16);
+
+    // The new values have the length of the old ones, so that the waiting
+    // threads never see a truncated file.
+    ev3::mode_set state = m.state();
+    std::thread writer([]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::fstream(SYS_ROOT "/lego-sensor/sensor10/value0") << "25\n";
+        std::fstream(SYS_ROOT "/tacho-motor/motor10/state")   << "holding\n";
+    });
+
+    REQUIRE(s.wait_value_change(value, 0, std::chrono::milliseconds(2000)));
+    REQUIRE(value == 25);
+
+    REQUIRE(m.wait_state_change(state, std::chrono::milliseconds(2000)));
+    REQUIRE(state == ev3::mode_set{"holding"});
+
+    writer.join();
+
+    REQUIRE_THROWS_AS(s.wait_value_change(value, 1), const std::invalid_argument&);
+}
+
+TEST_CASE("Waiting for motor states") {
+    populate_arena({"medium_motor:15@ev3-ports:outA"});
+
+    ev3::medium_motor m;
+    REQUIRE(m.connected());
+
+    const char state[] = "running stalled foo\n";
+    auto parsed = ev3::motor_state::parse(state, state + sizeof(state) - 1);
+    REQUIRE(parsed.bits() == (ev3::motor_state::running | ev3::motor_state::stalled));
+    REQUIRE(parsed.has(ev3::motor_state::stalled | ev3::motor_state::holding));
+    REQUIRE(!parsed.has(ev3::motor_state::holding));
+
+    // It interoperates with the string sets of state().
+    REQUIRE(parsed.count("stalled") == 1);
+    REQUIRE(parsed.count("holding") == 0);
+    REQUIRE(parsed == ev3::mode_set({"running", "stalled"}));
+    REQUIRE(m.state() == ev3::mode_set{"running"});
+    REQUIRE(m.state().find("running") != m.state().end());
+    REQUIRE(m.state_bits().has(ev3::motor_state::running));
+
+    REQUIRE(m.wait_until(ev3::motor_state::running, std::chrono::milliseconds(0)));
+    REQUIRE(!m.wait_while(ev3::motor_state::running, std::chrono::milliseconds(5)));
+
+    std::thread writer([]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::fstream(SYS_ROOT "/tacho-motor/motor15/state") << "holding\n";
+    });
+
+    REQUIRE(m.wait_while(ev3::motor_state::running, std::chrono::milliseconds(2000)));
+    REQUIRE(m.wait_until(ev3::motor_state::holding, std::chrono::milliseconds(0)));
+
+    writer.join();
+}
+
+TEST_CASE("Token sets") {
+    populate_arena({"medium_motor:16@ev3-ports:outA"});
+
+    const char text[] = "none timer [heartbeat] default-on\n";
+    ev3::token_set t(text, text + sizeof(text) - 1);
+
+    REQUIRE(t.size() == 4);
+    REQUIRE(t.count("heartbeat") == 1);
+    REQUIRE(t.count("[heartbeat]") == 0);
+    REQUIRE(t.count("heart") == 0);
+    REQUIRE(std::string(t.selected()) == "heartbeat");
+    REQUIRE(t == ev3::mode_set({"default-on", "heartbeat", "none", "timer"}));
+    REQUIRE(std::string(*t.begin()) == "default-on");
+
+    ev3::device d;
+    d.connect(SYS_ROOT "/tacho-motor/", "motor", {});
+    REQUIRE(d.connected());
+
+    write_arena("/tacho-motor/motor16/trigger", text);
+    REQUIRE(d.get_attr_from_set("trigger") == "heartbeat");
+
+    ev3::token_set u;
+    REQUIRE(&d.get_attr_tokens("trigger", u) == &u);
+    REQUIRE(u == t);
+
+    write_arena("/tacho-motor/motor16/trigger", "none timer\n");
+    REQUIRE(d.get_attr_from_set("trigger") == "none");
+    REQUIRE(d.get_attr_tokens("trigger", u).size() == 2);
+    REQUIRE(u.selected() == nullptr);
+}
+
+TEST_CASE("Event loop") {
+    populate_arena({"medium_motor:11@ev3-ports:outA", "infrared_sensor:11@ev3-ports:in1"});
+
+    ev3::infrared_sensor s;
+    ev3::medium_motor m;
+    REQUIRE(s.connected());
+    REQUIRE(m.connected());
+
+    ev3::event_loop loop;
+
+    int ticks = 0;
+    auto timer = loop.add_timer(std::chrono::milliseconds(5), [&]() { ++ticks; });
+
+    int signo = 0;
+    loop.add_signal(SIGUSR1, [&](int sig) { signo = sig; });
+    raise(SIGUSR1);
+
+    int value = 0;
+    loop.add_value(s, 0, [&](int v) { value = v; });
+
+    ev3::mode_set state;
+    loop.add_state(m, [&](const ev3::mode_set &st) { state = st; loop.stop(); });
+
+    std::thread writer([]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        std::fstream(SYS_ROOT "/lego-sensor/sensor11/value0") << "25\n";
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        std::fstream(SYS_ROOT "/tacho-motor/motor11/state")   << "holding\n";
+    });
+
+    loop.run();
+    writer.join();
+
+    REQUIRE(signo == SIGUSR1);
+    REQUIRE(value == 25);
+    REQUIRE(state == ev3::mode_set{"holding"});
+    REQUIRE(ticks >= 5);
+
+    loop.remove(timer);
+    const int seen = ticks;
+    loop.run_once(std::chrono::milliseconds(20));
+    REQUIRE(ticks == seen);
+}
+
+TEST_CASE("Button events") {
+    // The buttons read input_event records from a FIFO standing in for the
+    // evdev node.
+    unlink(BUTTON_DEVICE);
+    REQUIRE(mkfifo(BUTTON_DEVICE, 0600) == 0);
+
+    // The callbacks may use the buttons.
+    std::vector<int> clicks;
+    ev3::button::enter.onclick = [&](bool s) {
+        clicks.push_back(s);
+        ev3::button::up.pressed();
+    };
+    REQUIRE(!ev3::button::enter.pressed());
+
+    ev3::button::event_reader reader;
+
+    int fd = open(BUTTON_DEVICE, O_WRONLY);
+    REQUIRE(fd >= 0);
+
+    auto send = [fd](int code, int value) {
+        input_event ev[2] = {};
+        ev[0].type = EV_KEY; ev[0].code = code; ev[0].value = value;
+        ev[1].type = EV_SYN; ev[1].code = SYN_REPORT;
+        REQUIRE(write(fd, ev, sizeof(ev)) == sizeof(ev));
+    };
+
+    // A full click between two polls is not lost.
+    send(KEY_ENTER, 1);
+    send(KEY_ENTER, 2);
+    send(KEY_ENTER, 0);
+    send(KEY_UP,    1);
+
+    REQUIRE(ev3::button::up.pressed());
+    REQUIRE(!ev3::button::enter.pressed());
+
+    REQUIRE(ev3::button::enter.process());
+    REQUIRE(clicks == std::vector<int>({1, 0}));
+
+    // The other consumers see every event all the same.
+    typedef ev3::button::event be;
+    const std::vector<std::pair<int, int>> all({
+            {KEY_ENTER, be::press}, {KEY_ENTER, be::repeat}, {KEY_ENTER, be::release},
+            {KEY_UP, be::press}});
+
+    be e;
+    std::vector<std::pair<int, int>> v;
+    while (ev3::button::next_event(e)) v.emplace_back(e.code, e.type);
+    REQUIRE(v == all);
+
+    v.clear();
+    while (reader.next(e)) v.emplace_back(e.code, e.type);
+    REQUIRE(v == all);
+
+    REQUIRE(ev3::button::up.process());
+    REQUIRE(!ev3::button::enter.process());
+
+    close(fd);
+    ev3::button::enter.onclick = nullptr;
+}
+
+TEST_CASE("Button gestures") {
+    typedef ev3::button_events be;
+    typedef ev3::button::event key;
+
+    be::timing t;
+    t.debounce     = std::chrono::milliseconds(10);
+    t.long_press   = std::chrono::milliseconds(200);
+    t.double_click = std::chrono::milliseconds(1000);
+    t.chord        = std::chrono::milliseconds(30);
+
+    be buttons(t);
+
+    // The key events are fed with timestamps of their own, so the windows
+    // above are met exactly, whatever the load of the host.
+    const auto t0 = std::chrono::steady_clock::now();
+    auto at = [t0](int ms) { return t0 + std::chrono::milliseconds(ms); };
+
+    typedef std::vector<std::pair<int, unsigned>> seq;
+
+    auto events = [&](std::vector<key> keys, int now) {
+        buttons.update(keys.data(), keys.size(), at(now));
+        seq v;
+        be::event e;
+        while (buttons.next(e)) v.emplace_back(e.type, e.buttons);
+        return v;
+    };
+
+    // A bouncing contact is a single click.
+    REQUIRE(events({
+                {at(0), KEY_BACKSPACE, key::press},
+                {at(1), KEY_BACKSPACE, key::release},
+                {at(2), KEY_BACKSPACE, key::press}}, 40) == seq({{be::press, be::back}}));
+    REQUIRE(events({{at(42), KEY_BACKSPACE, key::release}}, 80) ==
+            seq({{be::release, be::back}, {be::click, be::back}}));
+
+    // Two clicks in a row.
+    REQUIRE(events({
+                {at(100), KEY_ENTER, key::press},
+                {at(101), KEY_ENTER, key::release},
+                {at(141), KEY_ENTER, key::press},
+                {at(142), KEY_ENTER, key::release}}, 180) == seq({
+                {be::press, be::enter}, {be::release, be::enter}, {be::click, be::enter},
+                {be::press, be::enter}, {be::release, be::enter}, {be::click, be::enter},
+                {be::double_click, be::enter}
+                }));
+
+    // Left and right together, no clicks.
+    REQUIRE(events({
+                {at(200), KEY_LEFT,  key::press},
+                {at(201), KEY_RIGHT, key::press}}, 260) == seq({
+                {be::press, be::left}, {be::press, be::right},
+                {be::chord, be::left | be::right}
+                }));
+    REQUIRE(events({
+                {at(261), KEY_LEFT,  key::release},
+                {at(262), KEY_RIGHT, key::release}}, 300) ==
+            seq({{be::release, be::left}, {be::release, be::right}}));
+
+    // Held down.
+    REQUIRE(buttons.deadline() == std::chrono::steady_clock::time_point::max());
+    REQUIRE(events({{at(400), KEY_UP, key::press}}, 400) == seq({{be::press, be::up}}));
+    REQUIRE(buttons.deadline() == at(430)); // the end of a possible chord
+    REQUIRE(events({}, 430).empty());
+    REQUIRE(buttons.deadline() == at(600));
+    REQUIRE(events({}, 599).empty());
+    REQUIRE(events({}, 600) == seq({{be::long_press, be::up}}));
+    REQUIRE(events({{at(650), KEY_UP, key::release}}, 700) == seq({{be::release, be::up}}));
+
+    REQUIRE(buttons.dropped() == 0);
+}
+
+TEST_CASE("Button gestures from the input device") {
+    // Reuses the FIFO of the "Button events" test, which the shared input
+    // device may still have open.
+    REQUIRE((mkfifo(BUTTON_DEVICE, 0600) == 0 || errno == EEXIST));
+
+    typedef ev3::button_events be;
+    be buttons;
+
+    int fd = open(BUTTON_DEVICE, O_WRONLY);
+    REQUIRE(fd >= 0);
+
+    input_event ev[3] = {};
+    ev[0].type = EV_KEY; ev[0].code = KEY_DOWN; ev[0].value = 1;
+    ev[1].type = EV_KEY; ev[1].code = KEY_DOWN; ev[1].value = 0;
+    ev[2].type = EV_SYN; ev[2].code = SYN_REPORT;
+
+    // A click from the background thread. The release is reported once the
+    // bounce window has passed.
+    buttons.start();
+    REQUIRE(write(fd, ev, sizeof(ev)) == sizeof(ev));
+
+    std::vector<int> types;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (types.size() < 3 && std::chrono::steady_clock::now() < deadline) {
+        be::event e;
+        while (buttons.next(e)) {
+            REQUIRE(e.buttons == be::down);
+            types.push_back(e.type);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    buttons.stop();
+
+    REQUIRE(types == std::vector<int>({be::press, be::release, be::click}));
+
+    close(fd);
+}
+
+TEST_CASE("Sampler") {
+    populate_arena({"medium_motor:17@ev3-ports:outA", "infrared_sensor:17@ev3-ports:in1"});
+
+    ev3::medium_motor m;
+    ev3::infrared_sensor s;
+    REQUIRE(m.connected());
+    REQUIRE(s.connected());
+
+    ev3::sampler sampler;
+    const size_t pos   = sampler.add_position(m, std::chrono::milliseconds(1));
+    const size_t speed = sampler.add_speed(m, std::chrono::milliseconds(1));
+    const size_t prox  = sampler.add_value(s, 0, std::chrono::milliseconds(5));
+
+    ev3::sampler::sample v;
+    REQUIRE(!sampler.latest(pos, v));
+
+    const auto start = std::chrono::steady_clock::now();
+    sampler.start();
+    REQUIRE(sampler.running());
+    REQUIRE_THROWS_AS(sampler.add_position(m, std::chrono::milliseconds(1)), const std::logic_error&);
+
+    // Polls the latest sample of a channel until it has `value`, for up to
+    // a generous deadline, so that a loaded host does not fail the test.
+    auto eventually = [&](size_t channel, int value) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (!(sampler.latest(channel, v) && v.value == value) &&
+                std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return sampler.latest(channel, v) && v.value == value;
+    };
+
+    REQUIRE(eventually(pos, 42));
+    REQUIRE(v.timestamp >= start);
+    REQUIRE(eventually(prox, 16));
+
+    // Let some history build up; the checks below hold however much it is.
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+
+    // The history is in order and follows the rate of the channel: the k-th
+    // sample is not taken before k periods have passed, and missed ticks are
+    // skipped rather than made up. The bounds follow the time actually
+    // elapsed, so a late wakeup does not fail the test.
+    auto check_history = [&](size_t channel, std::chrono::milliseconds period) {
+        size_t n = 0;
+        auto last = start;
+        while (sampler.pop(channel, v)) {
+            REQUIRE(v.timestamp >= last);
+            REQUIRE(v.timestamp >= start + static_cast<long>(n) * period);
+            last = v.timestamp;
+            ++n;
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        REQUIRE(n >= 1);
+        REQUIRE(n <= size_t(elapsed / period) + 1);
+    };
+    check_history(pos,  std::chrono::milliseconds(1));
+    check_history(prox, std::chrono::milliseconds(5));
+
+    std::fstream(SYS_ROOT "/tacho-motor/motor17/position") << "-9\n";
+    REQUIRE(eventually(pos, -9));
+
+    sampler.stop();
+    REQUIRE(!sampler.running());
+
+    // The speed history is never popped, so it can only overflow once it
+    // has run for more periods than it holds.
+    const auto ran = std::chrono::steady_clock::now() - start;
+    if (ran < static_cast<long>(ev3::sampler::history) * std::chrono::milliseconds(1))
+        REQUIRE(sampler.dropped(speed) == 0);
+}
+
+TEST_CASE("Telemetry recorder") {
+    populate_arena({"medium_motor:18@ev3-ports:outA", "infrared_sensor:18@ev3-ports:in1"});
+
+    ev3::medium_motor m;
+    ev3::infrared_sensor s;
+    REQUIRE(m.connected());
+    REQUIRE(s.connected());
+
+    const std::string path = BUTTON_DEVICE ".log";
+
+    ev3::recorder rec;
+    const size_t pos   = rec.add_position(m);
+    const size_t speed = rec.add_speed(m);
+    const size_t prox  = rec.add_value(s);
+    const size_t keys  = rec.add_buttons();
+    const size_t user  = rec.add_user("error");
+
+    rec.open(path);
+    REQUIRE(rec.is_open());
+    REQUIRE_THROWS_AS(rec.add_speed(m), const std::logic_error&);
+
+    // Enough ticks to go through several segments of the file.
+    const int ticks = 10000;
+    for(int i = 0; i < ticks; ++i) {
+        rec.capture();
+        if (i % 100 == 0) rec.log(user, i);
+    }
+
+    ev3::button_events::event e;
+    e.timestamp = std::chrono::steady_clock::now();
+    e.type      = ev3::button_events::click;
+    e.buttons   = ev3::button_events::enter;
+    rec.log(keys, e);
+
+    rec.close();
+    REQUIRE(!rec.is_open());
+
+    std::vector<ev3::recorder::channel_info> channels;
+    std::vector<ev3::recorder::record>       records;
+    ev3::recorder::load(path, channels, records);
+
+    REQUIRE(channels.size() == 5);
+    REQUIRE(channels[pos].kind == ev3::recorder::kind_motor_position);
+    REQUIRE(std::string(channels[pos].address) == "ev3-ports:outA");
+    REQUIRE(channels[prox].kind == ev3::recorder::kind_sensor_value);
+    REQUIRE(std::string(channels[prox].driver) == "lego-ev3-ir");
+    REQUIRE(std::string(channels[user].address) == "error");
+
+    REQUIRE(records.size() + rec.dropped() == 3 * ticks + ticks / 100 + 1);
+
+    std::map<uint32_t, size_t> count;
+    bool    ordered = true, values = true;
+    int64_t last = 0;
+    for(const auto &r : records) {
+        ordered = ordered && r.timestamp >= last;
+        last = r.timestamp;
+        ++count[r.channel];
+
+        if (r.channel == pos)   values = values && r.value == 42;
+        if (r.channel == speed) values = values && r.value == 0;
+        if (r.channel == prox)  values = values && r.value == 16;
+    }
+    REQUIRE(ordered);
+    REQUIRE(values);
+
+    if (rec.dropped() == 0) {
+        REQUIRE(count[pos] == ticks);
+        REQUIRE(records.back().channel == keys);
+        REQUIRE(records.back().value == (ev3::button_events::click << 8 | ev3::button_events::enter));
+    }
+}
+
+TEST_CASE("Attribute traces") {
+    populate_arena({"medium_motor:19@ev3-ports:outA", "infrared_sensor:19@ev3-ports:in1"});
+
+    const std::string trace = BUTTON_DEVICE ".trace";
+
+    {
+        ev3::trace_recorder rec(trace);
+        backend_guard guard(&rec);
+
+        ev3::medium_motor m;
+        ev3::infrared_sensor s;
+        REQUIRE(m.connected());
+        REQUIRE(s.connected());
+
+        m.set_speed_sp(500).run_forever();
+        REQUIRE(m.position() == 42);
+        std::fstream(SYS_ROOT "/tacho-motor/motor19/position") << "43\n";
+        REQUIRE(m.position() == 43);
+        REQUIRE(s.value() == 16);
+        m.stop();
+    }
+
+    // The replay does not touch sysfs.
+    std::fstream(SYS_ROOT "/tacho-motor/motor19/position") << "77\n";
+
+    {
+        ev3::trace_replay replay(trace);
+        backend_guard guard(&replay);
+
+        ev3::medium_motor m;
+        ev3::infrared_sensor s;
+        REQUIRE(m.connected());
+        REQUIRE(s.connected());
+
+        m.set_speed_sp(500).run_forever();
+        REQUIRE(m.position() == 42);
+        REQUIRE(m.position() == 43);
+        REQUIRE(s.value() == 16);
+        m.stop();
+
+        const auto recorded = replay.recorded_writes();
+        const auto written  = replay.writes();
+        REQUIRE(written.size() == 3);
+        REQUIRE(written.size() == recorded.size());
+        for(size_t i = 0; i < written.size(); ++i) {
+            REQUIRE(written[i].path  == recorded[i].path);
+            REQUIRE(written[i].value == recorded[i].value);
+        }
+        REQUIRE(written[0].value == "500");
+    }
+
+    // Waits run on the clock of the trace.
+    std::ofstream(trace)
+        << "0 l " SYS_ROOT "/tacho-motor/ motor20\n"
+        << "0 r " SYS_ROOT "/tacho-motor/motor20/address ev3-ports:outA\\n\n"
+        << "0 r " SYS_ROOT "/tacho-motor/motor20/driver_name lego-ev3-m-motor\\n\n"
+        << "1000000 r "    SYS_ROOT "/tacho-motor/motor20/state running\\n\n"
+        << "500000000 r "  SYS_ROOT "/tacho-motor/motor20/state running\\n\n"
+        << "2000000000 r " SYS_ROOT "/tacho-motor/motor20/state holding\\n\n";
+
+    {
+        ev3::trace_replay replay(trace);
+        backend_guard guard(&replay);
+
+        ev3::medium_motor m;
+        REQUIRE(m.connected());
+        REQUIRE(m.address() == "ev3-ports:outA");
+
+        const auto start = std::chrono::steady_clock::now();
+        const ev3::attr_backend::time_point zero;
+
+        REQUIRE(!m.wait_while(ev3::motor_state::running, std::chrono::milliseconds(100)));
+        REQUIRE(replay.now() - zero == std::chrono::milliseconds(100));
+
+        REQUIRE(m.wait_while(ev3::motor_state::running, std::chrono::seconds(10)));
+        REQUIRE(replay.now() - zero == std::chrono::seconds(2));
+
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+        REQUIRE(!replay.finished());
+        REQUIRE_THROWS_AS(m.wait_while(ev3::motor_state::holding), const std::system_error&);
+        REQUIRE(replay.finished());
+    }
+}
+
+TEST_CASE("Memory backend") {
+    ev3::memory_backend mem;
+    backend_guard guard(&mem);
+
+    const std::string motor = mem.add_device("tacho-motor", "motor0", {
+            {"address", "ev3-ports:outB"}, {"driver_name", "lego-ev3-l-motor"},
+            {"position", "10"}, {"speed_sp", "0"}, {"command", ""}, {"state", "running"}});
+    mem.add_device("lego-sensor", "sensor0", {
+            {"address", "ev3-ports:in2"}, {"driver_name", "lego-ev3-us"},
+            {"mode", "US-DIST-CM"}, {"num_values", "1"}, {"decimals", "1"},
+            {"bin_data_format", "u16"}, {"units", "cm"}, {"value0", "123"}});
+
+    ev3::large_motor m(ev3::OUTPUT_B);
+    ev3::ultrasonic_sensor s(ev3::INPUT_2);
+    REQUIRE(m.connected());
+    REQUIRE(s.connected());
+    REQUIRE(!ev3::medium_motor().connected());
+
+    REQUIRE(m.position() == 10);
+    REQUIRE(s.value() == 123);
+    REQUIRE(s.float_value() == Approx(12.3));
+
+    m.set_speed_sp(300).run_forever();
+    REQUIRE(mem.get(motor + "speed_sp") == "300");
+    REQUIRE(mem.get(motor + "command")  == "run-forever");
+
+    // Attributes that were not added are missing, as in sysfs.
+    REQUIRE_THROWS_AS(m.duty_cycle(), const std::system_error&);
+
+    // Changes from the outside wake up waits.
+    std::thread driver([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            mem.set(motor + "state", "holding");
+            });
+    REQUIRE(m.wait_while(ev3::motor_state::running, std::chrono::seconds(5)));
+    driver.join();
+
+    REQUIRE(m.state_bits() == ev3::motor_state::holding);
+    REQUIRE(!m.wait_until(ev3::motor_state::running, std::chrono::milliseconds(10)));
+}
+
+TEST_CASE("Sysfs backend") {
+    // A tree of attributes elsewhere than SYS_ROOT.
+    const std::string root = BUTTON_DEVICE ".root";
+    mkdir(root.c_str(), 0755);
+    mkdir((root + "/tacho-motor").c_str(), 0755);
+    mkdir((root + "/tacho-motor/motor7").c_str(), 0755);
+
+    const std::string motor = root + "/tacho-motor/motor7/";
+    std::ofstream(motor + "address")     << "ev3-ports:outC\n";
+    std::ofstream(motor + "driver_name") << "lego-ev3-m-motor\n";
+    std::ofstream(motor + "position")    << "-5\n";
+    std::ofstream(motor + "speed_sp")    << "0\n";
+
+    ev3::sysfs_backend sysfs(root);
+    backend_guard guard(&sysfs);
+
+    ev3::medium_motor m;
+    REQUIRE(m.connected());
+    REQUIRE(m.address() == "ev3-ports:outC");
+    REQUIRE(m.position() == -5);
+
+    m.set_speed_sp(250);
+    std::ifstream is(motor + "speed_sp");
+    int speed = 0;
+    is >> speed;
+    REQUIRE(speed == 250);
+}
+
+TEST_CASE("Motor simulator") {
+    using std::chrono::milliseconds;
+
+    ev3::motor_simulator sim;
+    backend_guard guard(&sim);
+
+    const std::string path = sim.add_motor("ev3-ports:outA", ev3::motor_simulator::lego_ev3_l_motor());
+
+    ev3::large_motor m(ev3::OUTPUT_A);
+    REQUIRE(m.connected());
+    REQUIRE(m.max_speed() == 1050);
+
+    const auto real  = std::chrono::steady_clock::now();
+    const auto start = sim.now();
+
+    SECTION("run to position") {
+        m.set_stop_action(ev3::motor::stop_action_hold);
+        m.set_speed_sp(600).set_position_sp(720).run_to_rel_pos();
+        REQUIRE(m.wait_while(ev3::motor_state::running));
+
+        // 720 counts at 600 counts/s take more than 1.2 s of the simulation,
+        // and far less than that in real time.
+        REQUIRE(sim.now() - start > milliseconds(1200));
+        REQUIRE(std::chrono::steady_clock::now() - real < sim.now() - start);
+
+        sim.sleep_for(milliseconds(500));
+        REQUIRE(m.state_bits() == ev3::motor_state::holding);
+        REQUIRE(std::abs(m.position() - 720) <= 3);
+
+        // Nothing moves any more.
+        m.stop();
+        REQUIRE_THROWS_AS(m.wait_until(ev3::motor_state::running), const std::system_error&);
+    }
+
+    SECTION("speed regulation") {
+        m.set_ramp_up_sp(1000).set_speed_sp(500).run_forever();
+        sim.sleep_for(milliseconds(200));
+        REQUIRE(m.state_bits().has(ev3::motor_state::ramping));
+        REQUIRE(m.speed() < 250);
+
+        sim.sleep_for(milliseconds(1500));
+        REQUIRE(m.state_bits() == ev3::motor_state::running);
+        REQUIRE(std::abs(m.speed() - 500) <= 10);
+
+        sim.set_load(path, 150);
+        sim.sleep_for(milliseconds(500));
+        REQUIRE(m.speed() == 0);
+        REQUIRE(m.state_bits().has(ev3::motor_state::overloaded | ev3::motor_state::stalled));
+
+        m.reset();
+        REQUIRE(m.speed_sp() == 0);
+        REQUIRE(m.position() == 0);
+        REQUIRE(m.state().empty());
+    }
+
+    SECTION("timed runs and validation") {
+        m.set_speed_sp(-300).set_time_sp(500).run_timed();
+        REQUIRE(!m.wait_while(ev3::motor_state::running, milliseconds(400)));
+        REQUIRE(m.wait_while(ev3::motor_state::running, milliseconds(200)));
+        REQUIRE(m.position() < -100);
+
+        REQUIRE_THROWS_AS(m.set_speed_sp(2000), const std::system_error&);
+        REQUIRE_THROWS_AS(m.set_command("jump"), const std::system_error&);
+    }
+
+    SECTION("commands from another thread") {
+        // The wait steps the simulation, and the stop gets in between.
+        m.set_speed_sp(500).run_forever();
+        std::thread stopper([]() {
+                std::this_thread::sleep_for(milliseconds(20));
+                ev3::large_motor(ev3::OUTPUT_A).stop();
+                });
+        REQUIRE(m.wait_while(ev3::motor_state::running));
+        stopper.join();
+        REQUIRE(!m.state_bits().has(ev3::motor_state::running));
+    }
+}
@@ -0,0 +1,65 @@
+// Compares the time per control tick of reading four motors and four
+// sensors device by device with reading them as one sample_group.
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <vector>
+#include <ev3dev.h>
+
+namespace ev3 = ev3dev;
+
+template <class F>
+double time_per_tick(int ticks, F &&tick) {
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < ticks; ++i) tick();
+    std::chrono::duration<double, std::micro> t = std::chrono::steady_clock::now() - start;
+    return t.count() / ticks;
+}
+
+int main(int argc, char *argv[]) {
+    const int ticks = argc > 1 ? atoi(argv[1]) : 10000;
+
+    system(FAKE_SYS "/clean_arena.py");
+    system(FAKE_SYS "/populate_arena.py"
+            " medium_motor:0@ev3-ports:outA medium_motor:1@ev3-ports:outB"
+            " medium_motor:2@ev3-ports:outC medium_motor:3@ev3-ports:outD"
+            " infrared_sensor:0@ev3-ports:in1 infrared_sensor:1@ev3-ports:in2"
+            " infrared_sensor:2@ev3-ports:in3 infrared_sensor:3@ev3-ports:in4");
+
+    std::vector<ev3::medium_motor>    motors;
+    std::vector<ev3::infrared_sensor> sensors;
+
+    for(auto port : {ev3::OUTPUT_A, ev3::OUTPUT_B, ev3::OUTPUT_C, ev3::OUTPUT_D})
+        motors.emplace_back(port);
+    for(auto port : {ev3::INPUT_1, ev3::INPUT_2, ev3::INPUT_3, ev3::INPUT_4})
+        sensors.emplace_back(port);
+
+    ev3::sample_group group;
+    for(const auto &m : motors)  group.add(m, ev3::motor::sample_position | ev3::motor::sample_speed);
+    for(const auto &s : sensors) group.add(s);
+
+    long sum = 0;
+
+    const double single = time_per_tick(ticks, [&]() {
+            for(const auto &m : motors) {
+                auto s = m.snapshot(ev3::motor::sample_position | ev3::motor::sample_speed);
+                sum += s.position + s.speed;
+            }
+            for(const auto &s : sensors)
+                sum += s.snapshot().values[0];
+            });
+
+    const double grouped = time_per_tick(ticks, [&]() {
+            group.read();
+            for(size_t i = 0; i < motors.size(); ++i)
+                sum += group.motor_sample(i).position + group.motor_sample(i).speed;
+            for(size_t i = 0; i < sensors.size(); ++i)
+                sum += group.sensor_sample(i).values[0];
+            });
+
+    std::cout
+        << "12 attributes per tick, " << ticks << " ticks (checksum " << sum << ")\n"
+        << "  per device:   " << single  << " us/tick\n"
+        << "  sample_group: " << grouped << " us/tick\n";
+}
@@ -0,0 +1,66 @@
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <fstream>
+#include <ev3dev_coro.h>
+
+namespace ev3 = ev3dev;
+
+void populate_arena(const std::vector<const char*> &devices) {
+    std::ostringstream command;
+    command << FAKE_SYS "/populate_arena.py";
+    for (auto d : devices) command << " " << d;
+
+    system(FAKE_SYS "/clean_arena.py");
+    system(command.str().c_str());
+}
+
+TEST_CASE("Coroutines") {
+    populate_arena({"medium_motor:0@ev3-ports:outA", "infrared_sensor:0@ev3-ports:in1"});
+
+    ev3::medium_motor m;
+    ev3::infrared_sensor s;
+    REQUIRE(m.connected());
+    REQUIRE(s.connected());
+
+    ev3::coro::scheduler sched;
+    std::vector<std::string> log;
+
+    // Waits for the motor and the sensor, which the other task changes.
+    auto waiter = [&]() -> ev3::coro::task {
+        co_await sched.run_to_rel_pos(m, 90, 500);
+        log.push_back("stopped");
+
+        int v = co_await sched.until(s, [](int v) { return v < 10; });
+        log.push_back("near " + std::to_string(v));
+    };
+
+    auto driver = [&]() -> ev3::coro::task {
+        co_await sched.sleep_for(std::chrono::milliseconds(20));
+        log.push_back("holding");
+        std::fstream(SYS_ROOT "/tacho-motor/motor0/state") << "holding\n";
+
+        co_await sched.sleep_for(std::chrono::milliseconds(20));
+        log.push_back("value");
+        std::fstream(SYS_ROOT "/lego-sensor/sensor0/value0") << "05\n";
+    };
+
+    sched.spawn(waiter());
+    sched.spawn(driver());
+    sched.run();
+
+    REQUIRE(log == std::vector<std::string>({"holding", "stopped", "value", "near 5"}));
+    REQUIRE(m.position_sp() == 90);
+    REQUIRE(m.speed_sp()    == 500);
+
+    // Exceptions reach run().
+    auto failing = [&]() -> ev3::coro::task {
+        co_await sched.sleep_for(std::chrono::milliseconds(1));
+        throw std::runtime_error("failed");
+    };
+
+    sched.spawn(failing());
+    REQUIRE_THROWS_AS(sched.run(), const std::runtime_error&);
+}